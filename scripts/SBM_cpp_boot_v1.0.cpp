@@ -0,0 +1,152 @@
+// Parallel bootstrap of correlation estimation and community detection
+// Resamples subjects (rows) of the count table, recomputes the correlation matrix
+// with the chosen transform / correlation method and refits the WSBM with the
+// thread-safe engine. Replicates run in parallel with independent RNG streams
+// (seed, replicate) and share the read-only count table; they are run by the
+// work-stealing scheduler (wsbm_sched.h), which keeps BLAS / OpenMP single-threaded.
+// counts = n by p taxonomic abundance count table
+// B = no. of bootstrap replicates
+// transform = MCLR / CLR / none, cor = pearson / spearman / kendall
+// K_max, eta0 = as in auto_WSBM; iter, burn = iterations of each refit
+// reproducible = counter-based RNG and pairwise sums in the engine (wsbm_engine.h);
+// the replicates are pooled as integer co-clustering counts, so the result is the
+// same for any n_threads in either mode
+// trace_json = append a Chrome trace of the run (filter, per replicate: resample,
+// transform, correlation, fisher, chain with sampled sweeps, pool; export) to this
+// file (wsbm_timeline.h); trace_rate = fraction of sweeps traced
+
+
+#include <Rcpp.h>
+#include "wsbm_cor.h"
+#include "wsbm_engine.h"
+#include "wsbm_sched.h"
+
+#include <memory>
+#include <mutex>
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+Rcpp::List WSBM_boot(const NumericMatrix& counts, int B = 100, std::string transform = "MCLR",
+                     std::string cor = "spearman", int K_max = 20, double eta0 = 0.1,
+                     int iter = 2000, int burn = 1000, int seed = 1, int n_threads = 0,
+                     double min_prev = 0.05, bool reproducible = false,
+                     std::string trace_json = "", double trace_rate = 0.01) {
+
+  int N = counts.nrow(), p_all = counts.ncol();
+  wsbm::Transform tr = wsbm::parse_transform(transform);
+  wsbm::CorMethod method = wsbm::parse_cor(cor);
+  if(burn >= iter){
+    stop("burn must be smaller than iter");
+  }
+
+  if(n_threads < 1){
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::unique_ptr<wsbm::Timeline> timeline;
+  if(trace_json != ""){
+    timeline.reset(new wsbm::Timeline(trace_json, trace_rate));
+  }
+  wsbm::Timeline* tl = timeline.get();
+  wsbm::Span run_span(tl, "WSBM_boot", "bootstrap");
+  run_span.arg("B", B).arg("n_threads", n_threads);
+
+  // Taxa are fixed by the filtration step on the full table so replicates are comparable
+  wsbm::Laps laps(tl, "preprocess");
+  std::vector<int> taxa = wsbm::filter_taxa(counts.begin(), N, p_all, min_prev);
+  int p = taxa.size();
+  if(p < 2){
+    stop("fewer than 2 taxa pass the filtration step");
+  }
+  std::vector<double> X((std::size_t) N*p);
+  for(int j = 0; j < p; j++){
+    std::copy(counts.begin() + (std::size_t) taxa[j]*N, counts.begin() + (std::size_t) (taxa[j] + 1)*N,
+              X.begin() + (std::size_t) j*N);
+  }
+  laps.lap("filter");
+
+  std::vector<uint64_t> boot_count((std::size_t) p*p, 0), boot_coclust((std::size_t) p*p, 0);
+  uint64_t n_retained = 0;
+  IntegerMatrix z_boot(B, p);
+  IntegerVector K_boot(B);
+  std::vector< std::vector<int> > z_hat(B);
+
+  std::mutex acc_m;
+  auto replicate = [&](int b){
+    wsbm::Span span(tl, "replicate", "bootstrap");
+    span.arg("b", b);
+    wsbm::Laps resample(tl, "bootstrap");
+    std::seed_seq seq{(uint32_t) seed, (uint32_t) b, 0x5eedu};
+    std::mt19937_64 rng(seq);
+    std::uniform_int_distribution<int> draw(0, N - 1);
+
+    std::vector<double> X_b((std::size_t) N*p);
+    for(int s = 0; s < N; s++){
+      int r = draw(rng);
+      for(int j = 0; j < p; j++){
+        X_b[s + (std::size_t) j*N] = X[r + (std::size_t) j*N];
+      }
+    }
+
+    resample.lap("resample");
+
+    std::vector<double> W_f = wsbm::count_W_f(X_b.data(), N, p, tr, method, tl);
+
+    wsbm::Settings s;
+    s.K_max = K_max;
+    s.eta0 = eta0;
+    s.iter = iter;
+    s.burn = burn;
+    s.seed = seed;
+    s.chain = b;
+    s.reproducible = reproducible;
+    s.timeline = tl;
+    wsbm::Fit fit = wsbm::fit(W_f.data(), p, s);
+    z_hat[b] = fit.z_hat;
+
+    wsbm::Span pool(tl, "pool", "bootstrap");
+    std::lock_guard<std::mutex> lock(acc_m);
+    n_retained += fit.n_retained;
+    for(std::size_t i = 0; i < boot_count.size(); i++){
+      boot_count[i] += (uint64_t) std::llround(fit.ppm[i]*fit.n_retained);
+    }
+    for(int j = 0; j < p; j++){
+      for(int i = 0; i < p; i++){
+        boot_coclust[i + (std::size_t) j*p] += fit.z_hat[i] == fit.z_hat[j];
+      }
+    }
+  };
+  try{
+    wsbm::Scheduler sched(n_threads);
+    sched.parallel_for(0, B, 1, replicate);
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+
+  laps.lap("replicates");
+  NumericMatrix ppm_r(p, p), coclust_r(p, p);
+  for(std::size_t i = 0; i < boot_count.size(); i++){
+    ppm_r[i] = (double) boot_count[i]/n_retained;
+    coclust_r[i] = (double) boot_coclust[i]/B;
+  }
+  for(int b = 0; b < B; b++){
+    int K_b = 0;
+    for(int i = 0; i < p; i++){
+      z_boot(b, i) = z_hat[b][i] + 1;
+      K_b = std::max(K_b, z_hat[b][i] + 1);
+    }
+    K_boot[b] = K_b;
+  }
+  IntegerVector taxa_r(p);
+  for(int j = 0; j < p; j++){
+    taxa_r[j] = taxa[j] + 1;
+  }
+  laps.lap("export");
+
+  return Rcpp::List::create(Rcpp::Named("boot_coclust") = coclust_r,
+                            Rcpp::Named("boot_ppm") = ppm_r,
+                            Rcpp::Named("z_boot") = z_boot,
+                            Rcpp::Named("K_boot") = K_boot,
+                            Rcpp::Named("taxa") = taxa_r
+  );
+}
@@ -0,0 +1,313 @@
+// Extending a converged auto_WSBM chain when taxa are added to the network
+// prev = result of auto_WSBM (z, mu, Var, z_store, mu_store, var_store, ppm_store, logpost_store)
+//        with the dense stores: store = TRUE, no trace_file / ppm_file, no mem_limit downgrade
+// W_old = weight matrix the previous result was fitted on (n by n, diagonals set to 0)
+// W_new = new columns of the enlarged weight matrix ((n + m) by m); rows 1..n hold the
+//         correlations of the new taxa with the old ones, rows n+1..n+m among the new taxa
+// eta0 = Dirichlet process concentration parameter
+// iter, burn = no. of further iterations and the (short) burn-in among them
+// The new taxa are seeded from their conditional label probabilities given the
+// current state, then sampling continues; PPM and traces grow in place.
+
+
+#include <RcppArmadilloExtensions/sample.h>
+#include <RcppDist.h>
+// [[Rcpp::depends(RcppArmadillo, RcppDist)]]
+
+using namespace Rcpp;
+using namespace arma;
+
+static Mat<double> fisher(const Mat<double>& W);
+static double logsumexp(const Col<double>& x);
+static void block_stats(const Mat<double>& W_f, const Col<int>& z, const Col<int>& n_k, int K,
+                        Mat<int>& matrix_n, Mat<double>& W_sum, Mat<double>& W_sum_sq);
+
+// [[Rcpp::export]]
+Rcpp::List auto_WSBM_extend(Rcpp::List prev, const arma::mat& W_old, const arma::mat& W_new,
+                            double eta0, int iter = 2000, int burn = 200, bool store = true) {
+
+  int n = W_old.n_rows, m = W_new.n_cols, N = n + m;
+  if(W_new.n_rows != (unsigned) N){
+    stop("W_new must have n + m rows (old taxa first, then the new taxa)");
+  }
+  if(burn >= iter){
+    stop("burn must be smaller than iter");
+  }
+
+  Col<int> z = as< Col<int> >(prev["z"]);
+  Mat<double> mu = as< Mat<double> >(prev["mu"]);
+  Mat<double> Var = as< Mat<double> >(prev["Var"]);
+  Mat<int> z_store = as< Mat<int> >(prev["z_store"]);
+  Mat<int> ppm_store = as< Mat<int> >(prev["ppm_store"]);
+  Cube<double> mu_store = as< Cube<double> >(prev["mu_store"]);
+  Cube<double> var_store = as< Cube<double> >(prev["var_store"]);
+  Col<double> logpost_store = as< Col<double> >(prev["logpost_store"]);
+  if((int) z.n_elem != n){
+    stop("prev was not fitted on W_old");
+  }
+  int K = mu.n_rows;
+
+  // The chain is extended from the dense stores; results whose draws were streamed
+  // (trace_file, or a mem_limit downgrade) or whose PPM went to a CSR file (ppm_file)
+  // do not have them
+  if(ppm_store.n_rows != (unsigned) n || ppm_store.n_cols != (unsigned) n){
+    stop("prev has no dense ppm_store (fitted with ppm_file or downgraded by mem_limit); "
+         "refit auto_WSBM with store = TRUE and without ppm_file");
+  }
+  if(z_store.n_cols != (unsigned) n || z_store.n_rows != logpost_store.n_elem || z_store.n_rows == 0){
+    stop("prev has no dense z_store (fitted with trace_file, store = FALSE or downgraded by mem_limit); "
+         "refit auto_WSBM with store = TRUE and without trace_file");
+  }
+  if(mu_store.n_rows != (unsigned) K || mu_store.n_cols != (unsigned) K || mu_store.n_slices == 0 ||
+     var_store.n_rows != mu_store.n_rows || var_store.n_cols != mu_store.n_cols ||
+     var_store.n_slices != mu_store.n_slices || mu_store.n_slices > z_store.n_rows){
+    stop("prev has no dense mu_store / var_store matching z_store; "
+         "refit auto_WSBM with store = TRUE and without trace_file");
+  }
+
+  // Retained iterations per node (for the PPM denominators)
+  Col<int> ppm_iter(N, fill::zeros);
+  if(prev.containsElementNamed("ppm_iter")){
+    ppm_iter.head(n) = as< Col<int> >(prev["ppm_iter"]);
+  }else{
+    ppm_iter.head(n).fill(mu_store.n_slices);
+  }
+
+  // Enlarged Fisher-transformed matrix
+  Mat<double> W_f = fisher(W_old);
+  W_f.resize(N, N);
+  W_f.cols(n, N - 1) = fisher(W_new);
+  W_f.submat(n, 0, N - 1, n - 1) = W_f.submat(0, n, n - 1, N - 1).t();
+  W_f.diag().zeros();
+
+  // Grow PPM and traces in place; new taxa are NA in the earlier iterations
+  int iter_prev = z_store.n_rows, slices_prev = mu_store.n_slices;
+  ppm_store.resize(N, N);
+  z_store.resize(iter_prev + iter, N);
+  if(iter_prev > 0){
+    z_store.submat(0, n, iter_prev - 1, N - 1).fill(NA_INTEGER);
+  }
+  mu_store.resize(K, K, slices_prev + iter - burn);
+  var_store.resize(K, K, slices_prev + iter - burn);
+  logpost_store.resize(iter_prev + iter);
+  logpost_store.tail(iter).zeros();
+
+  // Initialization
+  int l = 0;
+  Col<int> n_k(K, fill::zeros);
+  Mat<int> matrix_n(K, K, fill::zeros);
+  Mat<double> W_sum(K, K, fill::zeros);
+  Mat<double> W_sum_sq(K, K, fill::zeros);
+  double SS0 = 0.1, nu0 = 10.0, mu0 = 0.0, n0 = 1.0;
+  z.resize(N);
+  Col<int> z_temp = z;
+
+  Col<double> sampler(K, fill::zeros);
+  for(int k = 0; k < K; k++){
+    sampler(k) = k;
+  }
+
+  Col<double> log_beta(K, fill::zeros);
+  Col<double> log_alpha(K, fill::zeros);
+  Col<double> gamma(K, fill::zeros);
+
+  int count = 0;
+  Col<double> logprob_temp(K, fill::zeros);
+  Col<double> prob_temp(K, fill::zeros);
+  NumericVector prob_temp_2(K);
+
+  for(int k = 0; k < K; k++){
+    n_k(k) = accu(z.head(n) == k);
+  }
+
+  // Seed the new taxa one at a time from their conditional label probabilities
+  // given the stick-breaking weights and the already labelled taxa
+  for(int k = 0; k < K - 1; k++){
+    int rest = accu(n_k.tail(K - k - 1));
+    log_beta(k) = log(rbeta(1, 1 + n_k(k), eta0 + rest)(0));
+  }
+  log_beta(K - 1) = 0;
+  for(int k = 0; k < K; k++){
+    log_alpha(k) = log_beta(k);
+    for(l = 0; l < k; l++){
+      log_alpha(k) = log_alpha(k) + log(1 - exp(log_beta(l)));
+    }
+  }
+  for(int i = n; i < N; i++){
+    for(int k = 0; k < K; k++){
+      logprob_temp(k) = log_alpha(k);
+      for(int ii = 0; ii < i; ii++){
+        if(k < z(ii)){
+          logprob_temp(k) = logprob_temp(k) + log_normpdf(W_f(i, ii), mu(k, z(ii)), sqrt(Var(k, z(ii))));
+        }
+        else{
+          logprob_temp(k) = logprob_temp(k) + log_normpdf(W_f(i, ii), mu(z(ii), k), sqrt(Var(z(ii), k)));
+        }
+      }
+    }
+    prob_temp = exp(logprob_temp - logsumexp(logprob_temp)) ;
+    prob_temp_2 = wrap(prob_temp);
+    z(i) = Rcpp::RcppArmadillo::sample(sampler, 1, true, prob_temp_2)(0);
+    n_k(z(i)) = n_k(z(i)) + 1;
+  }
+  z_temp = z;
+
+
+  for(int it = 0; it < iter; it++){
+
+    // Update stick-breaking parameters
+    gamma.fill(0.0);
+    log_alpha.fill(0.0);
+    log_beta.fill(0.0);
+
+    for(int j = 1; j < K; j++){
+      gamma(0) = gamma(0) + n_k(j);
+    }
+    log_beta(0) = log(rbeta(1, 1 + n_k(0), eta0 + gamma(0))(0));
+    log_alpha(0) = log_beta(0);
+
+    for(int k = 1; k < K; k++){
+      if(k == K - 1){
+        log_beta(k) = 0;
+      }else{
+        for(int j = k + 1; j < K; j++){
+          gamma(k) = gamma(k) + n_k(j);
+        }
+        log_beta(k) = log(rbeta(1, 1 + n_k(k), eta0 + gamma(k))(0));
+      }
+      log_alpha(k) = log_beta(k);
+      l = 0;
+      while(l < k){
+        log_alpha(k) = log_alpha(k) + log(1 - exp(log_beta(l)));
+        l++;
+      }
+    }
+
+    // Update z
+
+    for(int i = 0; i < N; i++){
+      for(int k = 0; k < K; k++){
+        logprob_temp(k) = log_alpha(k);
+        for(int ii = 0; ii < N; ii++){
+          if(ii != i){
+            if(k < z(ii)){
+              logprob_temp(k) = logprob_temp(k) + log_normpdf(W_f(i, ii), mu(k, z(ii)), sqrt(Var(k, z(ii))));
+            }
+            else{
+              logprob_temp(k) = logprob_temp(k) + log_normpdf(W_f(i, ii), mu(z(ii), k), sqrt(Var(z(ii), k)));
+            }
+          }
+        }
+      }
+
+      prob_temp = exp(logprob_temp - logsumexp(logprob_temp)) ;
+      prob_temp_2 = wrap(prob_temp);
+
+      z_temp(i) = Rcpp::RcppArmadillo::sample(sampler, 1, true, prob_temp_2)(0);
+      if(z(i) != z_temp(i)){
+        n_k(z_temp(i)) = n_k(z_temp(i)) + 1;
+        n_k(z(i)) = n_k(z(i)) - 1;
+        z(i) = z_temp(i);
+      }
+    }
+
+
+    // Update var
+    block_stats(W_f, z, n_k, K, matrix_n, W_sum, W_sum_sq);
+    for(int k = 0; k < K; k++){
+      for(int kk = k; kk < K; kk++){
+        if(matrix_n(k, kk) > 0){
+          double W_sum_sq_2 = W_sum_sq(k, kk) - pow(W_sum(k, kk), 2)/matrix_n(k, kk);
+          Var(k, kk) = 1/rgamma(1, (matrix_n(k, kk) + nu0)/2,
+              2/(SS0 + W_sum_sq_2 + ((n0*matrix_n(k, kk))/(n0 + matrix_n(k, kk)))*pow(W_sum(k, kk)/matrix_n(k, kk) - mu0, 2)))(0);
+        }else{
+          Var(k, kk) = SS0;
+        }
+      }
+    }
+
+
+    // Update mu
+
+    double logpost = 0.0;
+    for(int k = 0; k < K; k++){
+      for(int kk = k; kk < K; kk++){
+        mu(k, kk) = rnorm(1, (W_sum(k, kk) + n0*mu0)/(matrix_n(k, kk) + n0), sqrt(Var(k, kk)/(matrix_n(k, kk) + n0)))(0);
+        if(store){
+          logpost = logpost + (-1.0*matrix_n(k, kk)/2.0) * log(Var(k, kk)) - W_sum_sq(k, kk)/(2.0*Var(k, kk))
+          + mu(k, kk)*W_sum(k, kk)/Var(k, kk) - matrix_n(k, kk)*pow(mu(k, kk), 2.0)/(2.0*Var(k, kk));
+          logpost = logpost - 0.5*log(Var(k, kk)/n0) - (n0/(2.0*Var(k, kk))) * pow(mu(k, kk) - mu0, 2.0);
+          logpost = logpost - (nu0/2 + 1) * log(Var(k, kk)) + SS0/(2*Var(k, kk));
+        }
+      }
+    }
+
+    if(store){
+      logpost_store(iter_prev + it) = logpost;
+      z_store.row(iter_prev + it) = z.t();
+      if(it >= burn){
+        mu_store.slice(slices_prev + it - burn) = mu;
+        var_store.slice(slices_prev + it - burn) = Var;
+
+        // Update PPM
+
+        for(int i = 0; i < N; i++){
+          for(int ii = i + 1; ii < N; ii++){
+            if(z(ii) == z(i)){
+              ppm_store(i, ii) = ppm_store(i, ii) + 1;
+              ppm_store(ii, i) = ppm_store(ii, i) + 1;
+            }
+          }
+        }
+        ppm_iter = ppm_iter + 1;
+      }
+    }
+
+    if(it*100/iter == count){
+      Rcout<<count<< "% has been done\n";
+      count = count + 10;
+    }
+  }
+
+
+  return Rcpp::List::create(Rcpp::Named("z") = z,
+                            Rcpp::Named("z_store") = z_store,
+                            Rcpp::Named("mu") = mu,
+                            Rcpp::Named("mu_store") = mu_store,
+                            Rcpp::Named("Var") = Var,
+                            Rcpp::Named("var_store") = var_store,
+                            Rcpp::Named("ppm_store") = ppm_store,
+                            Rcpp::Named("ppm_iter") = ppm_iter,
+                            Rcpp::Named("logpost_store") = logpost_store
+  );
+}
+
+// Sufficient statistics of every (k, kk) block, as in auto_WSBM
+void block_stats(const Mat<double>& W_f, const Col<int>& z, const Col<int>& n_k, int K,
+                 Mat<int>& matrix_n, Mat<double>& W_sum, Mat<double>& W_sum_sq){
+  for(int k = 0; k < K; k++){
+    uvec idx_k = find(z == k);
+    for(int kk = k; kk < K; kk++){
+      uvec idx_kk = find(z == kk);
+      Col<double> w = vectorise(W_f.submat(idx_k, idx_kk));
+      if(k == kk){
+        matrix_n(k, kk) = n_k(k) * (n_k(kk) - 1)/2;
+        W_sum(k, kk) = sum(w)/2;
+        W_sum_sq(k, kk) = sum(pow(w, 2))/2;
+      }else{
+        matrix_n(k, kk) = n_k(k) * n_k(kk);
+        W_sum(k, kk) = sum(w);
+        W_sum_sq(k, kk) = sum(pow(w, 2));
+      }
+    }
+  }
+}
+
+Mat<double> fisher(const Mat<double>& W){
+  return 0.5 * log((1 + W)/(1 - W));
+}
+
+double logsumexp(const Col<double>& x){
+  double c = max(x);
+  return c + log(sum(exp(x - c)));
+}
@@ -0,0 +1,174 @@
+// Recursive (divisive) hierarchical community refinement
+// Fits a WSBM to W, then re-fits every community's submatrix of W independently
+// and in parallel, recursing while the posterior supports a split. The sub-fits
+// of one depth are packed onto the threads largest first (wsbm_sched.h).
+// W = weight matrix (correlation matrix with diagonals set to 0)
+// K_max = upper bound for total no. of clusters of each sub-fit
+// eta0 = Dirichlet process concentration parameter
+// split_prob = min. posterior probability of >= 2 occupied communities to accept a split
+// min_size = communities smaller than this are not re-fitted
+// max_depth = max. depth of the tree (root = 0)
+
+
+#include <Rcpp.h>
+#include "wsbm_engine.h"
+#include "wsbm_sched.h"
+
+using namespace Rcpp;
+
+struct HierNode {
+  int parent = -1, depth = 0;
+  std::vector<int> members;   // 0-based indices into W
+  bool fitted = false;
+  double p_split = 0.0;
+  wsbm::Fit fit;
+  std::vector<int> children;
+};
+
+// [[Rcpp::export]]
+Rcpp::List hier_WSBM(const NumericMatrix& W, int K_max = 10, double eta0 = 1.0,
+                     double split_prob = 0.5, int min_size = 10, int max_depth = 4,
+                     int iter = 2000, int burn = 1000, int seed = 1, int n_threads = 0) {
+
+  int n = W.nrow();
+  if(W.ncol() != n){
+    stop("W must be a square matrix");
+  }
+  if(burn >= iter){
+    stop("burn must be smaller than iter");
+  }
+
+  if(n_threads < 1){
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<double> W_f((std::size_t) n*n);
+  wsbm::fisher(W.begin(), W_f.data(), W_f.size());
+
+  std::vector<HierNode> tree(1);
+  tree[0].members.resize(n);
+  for(int i = 0; i < n; i++){
+    tree[0].members[i] = i;
+  }
+
+  wsbm::Scheduler sched(n_threads);
+  std::vector<int> frontier(1, 0);
+  while(!frontier.empty()){
+
+    // Sub-fits at one depth are independent; each has its own RNG stream
+    std::vector<double> cost(frontier.size());
+    for(int f = 0; f < (int) frontier.size(); f++){
+      cost[f] = (double) tree[frontier[f]].members.size()*tree[frontier[f]].members.size();
+    }
+    auto sub_fit = [&](int f){
+      HierNode& node = tree[frontier[f]];
+      int n_s = node.members.size();
+      std::vector<double> W_sub((std::size_t) n_s*n_s);
+      for(int j = 0; j < n_s; j++){
+        for(int i = 0; i < n_s; i++){
+          W_sub[i + (std::size_t) j*n_s] = W_f[node.members[i] + (std::size_t) node.members[j]*n];
+        }
+      }
+      wsbm::Settings s;
+      s.K_max = std::max(2, std::min(K_max, n_s));
+      s.eta0 = eta0;
+      s.iter = iter;
+      s.burn = burn;
+      s.seed = seed;
+      s.chain = frontier[f];
+      node.fit = wsbm::fit(W_sub.data(), n_s, s);
+      int split_draws = 0;
+      for(int K_occ : node.fit.K_trace){
+        split_draws += K_occ >= 2;
+      }
+      node.p_split = 1.0*split_draws/std::max(1, node.fit.n_retained);
+      node.fitted = true;
+    };
+    try{
+      sched.run_jobs(cost, sub_fit);
+    }catch(std::exception& e){
+      stop(e.what());
+    }
+
+    std::vector<int> next;
+    for(int id : frontier){
+      int n_groups = *std::max_element(tree[id].fit.z_hat.begin(), tree[id].fit.z_hat.end()) + 1;
+      if(tree[id].p_split < split_prob || n_groups < 2 || tree[id].depth >= max_depth){
+        continue;
+      }
+      for(int g = 0; g < n_groups; g++){
+        HierNode child;
+        child.parent = id;
+        child.depth = tree[id].depth + 1;
+        for(int i = 0; i < (int) tree[id].members.size(); i++){
+          if(tree[id].fit.z_hat[i] == g){
+            child.members.push_back(tree[id].members[i]);
+          }
+        }
+        tree[id].children.push_back(tree.size());
+        if((int) child.members.size() >= std::max(2, min_size) && child.depth < max_depth){
+          next.push_back(tree.size());
+        }
+        tree.push_back(child);
+      }
+    }
+    frontier.swap(next);
+    Rcpp::checkUserInterrupt();
+  }
+
+  // Leaves of the tree give the finest partition
+  IntegerVector labels(n);
+  CharacterVector path(n);
+  std::vector<std::string> node_path(tree.size(), "1");
+  int n_leaves = 0;
+  Rcpp::List nodes(tree.size());
+  for(int id = 0; id < (int) tree.size(); id++){
+    const HierNode& node = tree[id];
+    for(int c = 0; c < (int) node.children.size(); c++){
+      node_path[node.children[c]] = node_path[id] + "." + std::to_string(c + 1);
+    }
+    if(node.children.empty()){
+      n_leaves++;
+      for(int i : node.members){
+        labels[i] = n_leaves;
+        path[i] = node_path[id];
+      }
+    }
+
+    // 1-based indices for R
+    IntegerVector members(node.members.size()), children(node.children.size());
+    for(int i = 0; i < (int) node.members.size(); i++){
+      members[i] = node.members[i] + 1;
+    }
+    for(int c = 0; c < (int) node.children.size(); c++){
+      children[c] = node.children[c] + 1;
+    }
+    RObject ppm, sub_labels;
+    if(node.fitted){
+      int n_s = node.members.size();
+      NumericMatrix ppm_m(n_s, n_s);
+      IntegerVector z_hat(n_s);
+      std::copy(node.fit.ppm.begin(), node.fit.ppm.end(), ppm_m.begin());
+      for(int i = 0; i < n_s; i++){
+        z_hat[i] = node.fit.z_hat[i] + 1;
+      }
+      ppm = ppm_m;
+      sub_labels = z_hat;
+    }
+    nodes[id] = Rcpp::List::create(Rcpp::Named("id") = id + 1,
+                                   Rcpp::Named("parent") = node.parent + 1,
+                                   Rcpp::Named("depth") = node.depth,
+                                   Rcpp::Named("path") = node_path[id],
+                                   Rcpp::Named("members") = members,
+                                   Rcpp::Named("p_split") = node.p_split,
+                                   Rcpp::Named("ppm") = ppm,
+                                   Rcpp::Named("labels") = sub_labels,
+                                   Rcpp::Named("children") = children
+    );
+  }
+
+  return Rcpp::List::create(Rcpp::Named("tree") = nodes,
+                            Rcpp::Named("cluster_labels") = labels,
+                            Rcpp::Named("cluster_path") = path
+  );
+}
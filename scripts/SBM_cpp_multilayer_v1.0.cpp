@@ -0,0 +1,324 @@
+// Multi-layer WSBM: shared community labels z across L correlation matrices
+// (e.g. cohorts) over the same taxa, with layer-specific block parameters.
+// K is estimated via the same stick-breaking process as auto_WSBM (v3.4).
+// W_list = list of L weight matrices (correlation matrices with diagonals set to 0)
+// K_max = upper bound for total no. of clusters
+// eta0 = Dirichlet process concentration parameter
+// n_threads = no. of threads used for the per-layer likelihood contributions
+
+
+#include <RcppArmadilloExtensions/sample.h>
+#include <RcppDist.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+// [[Rcpp::depends(RcppArmadillo, RcppDist)]]
+// [[Rcpp::plugins(openmp)]]
+
+using namespace Rcpp;
+using namespace arma;
+
+static Mat<double> fisher(const Mat<double>& W);
+static double logsumexp(const Col<double>& x);
+static void block_stats(const Mat<double>& W_f, const Col<int>& z, const Col<int>& n_k, int K,
+                        Mat<int>& matrix_n, Mat<double>& W_sum, Mat<double>& W_sum_sq);
+
+// [[Rcpp::export]]
+Rcpp::List multi_WSBM(Rcpp::List W_list, int K_max, double eta0, bool store, int n_threads = 1) {
+
+  int iter = 10000, burn = 0.5*iter, K = K_max;
+  int L = W_list.size();
+  if(L < 1){
+    stop("W_list must contain at least one matrix");
+  }
+
+  int n = as<NumericMatrix>(W_list[0]).nrow();
+  Cube<double> W_f(n, n, L);
+  for(int l = 0; l < L; l++){
+    NumericMatrix W_l = W_list[l];
+    if(W_l.nrow() != n || W_l.ncol() != n){
+      stop("All matrices in W_list must be n x n over the same taxa");
+    }
+    W_f.slice(l) = fisher(Mat<double>(W_l.begin(), n, n, false, true));
+  }
+
+#ifdef _OPENMP
+  if(n_threads < 1){
+    n_threads = omp_get_max_threads();
+  }
+#endif
+
+  // Initialization
+  int l = 0;
+  Col<int> n_k(K, fill::zeros);
+  Cube<int> matrix_n(K, K, L, fill::zeros);
+  Cube<double> W_sum(K, K, L, fill::zeros);
+  Cube<double> W_sum_sq(K, K, L, fill::zeros);
+  Cube<double> mu(K, K, L, fill::zeros);
+  Cube<double> Var(K, K, L);
+  Var.fill(0.1);
+  Col<double> LogL(L, fill::zeros);
+  double SS0 = 0.1, nu0 = 10.0, mu0 = 0.0, n0 = 1.0;
+  int K_start = randi(1, distr_param(2, std::max(2, K/4)))(0);
+  Col<int> z = randi(n, distr_param(0, K_start - 1));
+  Col<int> z_temp = z;
+  Mat<int> ppm_store(n, n, fill::zeros);
+
+  Col<double> sampler(K, fill::zeros);
+  for(int k = 0; k < K; k++){
+    sampler(k) = k;
+  }
+
+  // DP initialization
+
+  Col<double> log_beta(K, fill::zeros);
+  Col<double> log_alpha(K, fill::zeros);
+  Col<double> gamma(K, fill::zeros);
+
+  // Store
+  Mat<int> z_store(iter, n, fill::zeros);
+  Rcpp::List mu_store(L), var_store(L);
+  std::vector< Cube<double> > mu_store_l(L), var_store_l(L);
+  for(int ll = 0; ll < L; ll++){
+    mu_store_l[ll].zeros(K, K, iter - burn);
+    var_store_l[ll].zeros(K, K, iter - burn);
+  }
+
+  // Temp
+  int count = 0;
+  Mat<double> logprob_layer(K, L, fill::zeros);
+  Col<double> logprob_temp(K, fill::zeros);
+  Col<double> prob_temp(K, fill::zeros);
+  NumericVector prob_temp_2(K);
+  Mat<double> logpost_store(iter, L, fill::zeros);
+
+  for(int k = 0; k < K; k++){
+    n_k(k) = size(z.elem(find(z == k)))(0);
+  }
+
+  // Block statistics are independent across layers
+  #pragma omp parallel for num_threads(n_threads) schedule(static)
+  for(int ll = 0; ll < L; ll++){
+    Mat<int> matrix_n_l(K, K, fill::zeros);
+    Mat<double> W_sum_l(K, K, fill::zeros), W_sum_sq_l(K, K, fill::zeros);
+    block_stats(W_f.slice(ll), z, n_k, K, matrix_n_l, W_sum_l, W_sum_sq_l);
+    matrix_n.slice(ll) = matrix_n_l;
+    W_sum.slice(ll) = W_sum_l;
+    W_sum_sq.slice(ll) = W_sum_sq_l;
+  }
+
+  // Var and mu draws use R's RNG and stay on the main thread
+  for(int ll = 0; ll < L; ll++){
+    for(int k = 0; k < K; k++){
+      for(int kk = k; kk < K; kk++){
+        double m = matrix_n(k, kk, ll);
+        if(m > 0){
+          double W_sum_sq_2 = W_sum_sq(k, kk, ll) - pow(W_sum(k, kk, ll), 2)/m;
+          Var(k, kk, ll) = 1/rgamma(1, (m + nu0)/2,
+              2/(SS0 + W_sum_sq_2 + ((n0*m)/(n0 + m))*pow(W_sum(k, kk, ll)/m - mu0, 2)))(0);
+        }else{
+          Var(k, kk, ll) = SS0;
+        }
+      }
+    }
+    for(int k = 0; k < K; k++){
+      for(int kk = k; kk < K; kk++){
+        double m = matrix_n(k, kk, ll);
+        mu(k, kk, ll) = rnorm(1, (W_sum(k, kk, ll) + n0*mu0)/(m + n0), sqrt(Var(k, kk, ll)/(m + n0)))(0);
+        if(store){
+          LogL(ll) = LogL(ll) + (-1.0*m/2.0) * log(Var(k, kk, ll)) - W_sum_sq(k, kk, ll)/(2.0*Var(k, kk, ll))
+          + mu(k, kk, ll)*W_sum(k, kk, ll)/Var(k, kk, ll) - m*pow(mu(k, kk, ll), 2.0)/(2.0*Var(k, kk, ll));
+          LogL(ll) = LogL(ll) - 0.5*log(Var(k, kk, ll)/n0) - (n0/(2.0*Var(k, kk, ll))) * pow(mu(k, kk, ll) - mu0, 2.0);
+          LogL(ll) = LogL(ll) - (nu0/2 + 1) * log(Var(k, kk, ll)) + SS0/(2*Var(k, kk, ll));
+        }
+      }
+    }
+  }
+
+
+  for(int it = 0; it < iter; it++){
+
+    // Update stick-breaking parameters (shared across layers)
+    gamma.fill(0.0);
+    log_alpha.fill(0.0);
+    log_beta.fill(0.0);
+
+    for(int j = 1; j < K; j++){
+      gamma(0) = gamma(0) + n_k(j);
+    }
+    log_beta(0) = log(rbeta(1, 1 + n_k(0), eta0 + gamma(0))(0));
+    log_alpha(0) = log_beta(0);
+
+    for(int k = 1; k < K; k++){
+      if(k == K - 1){
+        log_beta(k) = 0;
+      }else{
+        for(int j = k + 1; j < K; j++){
+          gamma(k) = gamma(k) + n_k(j);
+        }
+        log_beta(k) = log(rbeta(1, 1 + n_k(k), eta0 + gamma(k))(0));
+      }
+      log_alpha(k) = log_beta(k);
+      l = 0;
+      while(l < k){
+        log_alpha(k) = log_alpha(k) + log(1 - exp(log_beta(l)));
+        l++;
+      }
+    }
+
+    // Update z
+
+    for(int i = 0; i < n; i++){
+
+      // Per-layer likelihood contributions, one column per layer
+      #pragma omp parallel for num_threads(n_threads) schedule(static)
+      for(int ll = 0; ll < L; ll++){
+        const Mat<double>& W_l = W_f.slice(ll);
+        const Mat<double>& mu_l = mu.slice(ll);
+        const Mat<double>& Var_l = Var.slice(ll);
+        for(int k = 0; k < K; k++){
+          double lp = 0.0;
+          for(int ii = 0; ii < n; ii++){
+            if(ii != i){
+              if(k < z(ii)){
+                lp = lp + log_normpdf(W_l(i, ii), mu_l(k, z(ii)), sqrt(Var_l(k, z(ii))));
+              }
+              else{
+                lp = lp + log_normpdf(W_l(i, ii), mu_l(z(ii), k), sqrt(Var_l(z(ii), k)));
+              }
+            }
+          }
+          logprob_layer(k, ll) = lp;
+        }
+      }
+
+      // Reduce over layers in a fixed order
+      logprob_temp = log_alpha + sum(logprob_layer, 1);
+
+      prob_temp = exp(logprob_temp - logsumexp(logprob_temp)) ;
+      prob_temp_2 = wrap(prob_temp);
+
+      z_temp(i) = Rcpp::RcppArmadillo::sample(sampler, 1, true, prob_temp_2)(0);
+      if(z(i) != z_temp(i)){
+        n_k(z_temp(i)) = n_k(z_temp(i)) + 1;
+        n_k(z(i)) = n_k(z(i)) - 1;
+        z(i) = z_temp(i);
+      }
+    }
+
+
+    // Update block statistics
+    #pragma omp parallel for num_threads(n_threads) schedule(static)
+    for(int ll = 0; ll < L; ll++){
+      Mat<int> matrix_n_l(K, K, fill::zeros);
+      Mat<double> W_sum_l(K, K, fill::zeros), W_sum_sq_l(K, K, fill::zeros);
+      block_stats(W_f.slice(ll), z, n_k, K, matrix_n_l, W_sum_l, W_sum_sq_l);
+      matrix_n.slice(ll) = matrix_n_l;
+      W_sum.slice(ll) = W_sum_l;
+      W_sum_sq.slice(ll) = W_sum_sq_l;
+    }
+
+    for(int ll = 0; ll < L; ll++){
+
+      // Update var
+      for(int k = 0; k < K; k++){
+        for(int kk = k; kk < K; kk++){
+          double m = matrix_n(k, kk, ll);
+          if(m > 0){
+            double W_sum_sq_2 = W_sum_sq(k, kk, ll) - pow(W_sum(k, kk, ll), 2)/m;
+            Var(k, kk, ll) = 1/rgamma(1, (m + nu0)/2,
+                2/(SS0 + W_sum_sq_2 + ((n0*m)/(n0 + m))*pow(W_sum(k, kk, ll)/m - mu0, 2)))(0);
+          }else{
+            Var(k, kk, ll) = SS0;
+          }
+        }
+      }
+
+      // Update mu
+      for(int k = 0; k < K; k++){
+        for(int kk = k; kk < K; kk++){
+          double m = matrix_n(k, kk, ll);
+          mu(k, kk, ll) = rnorm(1, (W_sum(k, kk, ll) + n0*mu0)/(m + n0), sqrt(Var(k, kk, ll)/(m + n0)))(0);
+          if(store){
+            logpost_store(it, ll) = logpost_store(it, ll) + (-1.0*m/2.0) * log(Var(k, kk, ll)) - W_sum_sq(k, kk, ll)/(2.0*Var(k, kk, ll))
+            + mu(k, kk, ll)*W_sum(k, kk, ll)/Var(k, kk, ll) - m*pow(mu(k, kk, ll), 2.0)/(2.0*Var(k, kk, ll));
+            logpost_store(it, ll) = logpost_store(it, ll) - 0.5*log(Var(k, kk, ll)/n0) - (n0/(2.0*Var(k, kk, ll))) * pow(mu(k, kk, ll) - mu0, 2.0);
+            logpost_store(it, ll) = logpost_store(it, ll) - (nu0/2 + 1) * log(Var(k, kk, ll)) + SS0/(2*Var(k, kk, ll));
+          }
+        }
+      }
+    }
+
+    if(store){
+      z_store.row(it) = z.t();
+      if(it >= burn){
+        for(int ll = 0; ll < L; ll++){
+          mu_store_l[ll].slice(it - burn) = mu.slice(ll);
+          var_store_l[ll].slice(it - burn) = Var.slice(ll);
+        }
+
+        // Update PPM
+
+        for(int i = 0; i < n; i++){
+          for(int ii = i + 1; ii < n; ii++){
+            if(z(ii) == z(i)){
+              ppm_store(i, ii) = ppm_store(i, ii) + 1;
+              ppm_store(ii, i) = ppm_store(ii, i) + 1;
+            }
+          }
+        }
+      }
+    }
+
+    if(it*100/iter == count){
+      Rcout<<count<< "% has been done\n";
+      count = count + 10;
+    }
+  }
+
+  for(int ll = 0; ll < L; ll++){
+    mu_store[ll] = mu_store_l[ll];
+    var_store[ll] = var_store_l[ll];
+  }
+
+  return Rcpp::List::create(Rcpp::Named("z") = z,
+                            Rcpp::Named("z_store") = z_store,
+                            Rcpp::Named("mu") = mu,
+                            Rcpp::Named("mu_store") = mu_store,
+                            Rcpp::Named("Var") = Var,
+                            Rcpp::Named("var_store") = var_store,
+                            Rcpp::Named("ppm_store") = ppm_store,
+                            Rcpp::Named("LogL") = LogL,
+                            Rcpp::Named("logpost_store") = logpost_store
+  );
+}
+
+// Sufficient statistics of every (k, kk) block of one layer, as in auto_WSBM
+void block_stats(const Mat<double>& W_f, const Col<int>& z, const Col<int>& n_k, int K,
+                 Mat<int>& matrix_n, Mat<double>& W_sum, Mat<double>& W_sum_sq){
+  for(int k = 0; k < K; k++){
+    uvec idx_k = find(z == k);
+    for(int kk = k; kk < K; kk++){
+      uvec idx_kk = find(z == kk);
+      Col<double> w = vectorise(W_f.submat(idx_k, idx_kk));
+      if(k == kk){
+        matrix_n(k, kk) = n_k(k) * (n_k(kk) - 1)/2;
+        W_sum(k, kk) = sum(w)/2;
+        W_sum_sq(k, kk) = sum(pow(w, 2))/2;
+      }else{
+        matrix_n(k, kk) = n_k(k) * n_k(kk);
+        W_sum(k, kk) = sum(w);
+        W_sum_sq(k, kk) = sum(pow(w, 2));
+      }
+    }
+  }
+}
+
+Mat<double> fisher(const Mat<double>& W){
+  return 0.5 * log((1 + W)/(1 - W));
+}
+
+double logsumexp(const Col<double>& x){
+  double c = max(x);
+  return c + log(sum(exp(x - c)));
+}
@@ -2,23 +2,34 @@
 
 #include <RcppArmadilloExtensions/sample.h>
 #include <RcppDist.h>
+#include "wsbm_shm.h"
 // [[Rcpp::depends(RcppArmadillo, RcppDist)]]
 
 using namespace Rcpp;
 using namespace arma;
 
-static Mat<double> fisher(Mat<double> W);
+static Mat<double> fisher(const Mat<double>& W);
+static const wsbm::SharedWf* shared_W_f(SEXP W);
 static double logsumexp(Col<double> x);
 //static Mat<double> inv_fisher(Mat<double> W_inv);
 
 // [[Rcpp::export]]
-Rcpp::List WSBM(Mat<double> W, int K, Col<double> alpha_v, bool store) {
+Rcpp::List WSBM(SEXP W, int K, Col<double> alpha_v, bool store) {
   
   int iter = 10000, burn = 0.5*iter;
-  Mat<double> W_f = fisher(W);
+  // W is the weight matrix or a WSBM_shm handle, whose W_f is read in place
+  // from the shared segment
+  const wsbm::SharedWf* shm = shared_W_f(W);
+  Mat<double> W_f_own;
+  if(shm == NULL){
+    NumericMatrix W_r(W);
+    W_f_own = fisher(Mat<double>(W_r.begin(), W_r.nrow(), W_r.ncol(), false, true));
+  }
+  const Mat<double> W_f(shm ? const_cast<double*>(shm->data()) : W_f_own.memptr(),
+                        shm ? shm->n() : W_f_own.n_rows, shm ? shm->n() : W_f_own.n_cols, false, true);
   
   // Initialization
-  int n = W.n_rows;
+  int n = W_f.n_rows;
   Col<int> n_k(K, fill::zeros);
   Col<double> v(K, fill::zeros);
   
@@ -44,11 +55,15 @@ Rcpp::List WSBM(Mat<double> W, int K, Col<double> alpha_v, bool store) {
   // Store
   //Mat<int> z_store(n*iter, n, fill::zeros);
   //Mat<int> z_store(iter - burn, n, fill::zeros);
-  Mat<int> z_store(iter, n, fill::zeros);
-  Mat<int> ppm_store(n, n, fill::zeros);
+  // Outputs are allocated as R objects up front and filled in place through
+  // Armadillo views, so returning them does not copy
+  IntegerMatrix z_store_r(iter, n), ppm_store_r(n, n);
+  Mat<int> z_store(z_store_r.begin(), iter, n, false, true);
+  Mat<int> ppm_store(ppm_store_r.begin(), n, n, false, true);
   //Col<double> logprob_store(iter, fill::zeros);
-  Cube<double> mu_store(K, K, iter - burn, fill::zeros);
-  Cube<double> var_store(K, K, iter - burn, fill::zeros);
+  NumericVector mu_store_r(Dimension(K, K, iter - burn)), var_store_r(Dimension(K, K, iter - burn));
+  Cube<double> mu_store(mu_store_r.begin(), K, K, iter - burn, false, true);
+  Cube<double> var_store(var_store_r.begin(), K, K, iter - burn, false, true);
   Cube<double> n_k_store(K, K, iter, fill::zeros);
   //Var.fill(1);
   
@@ -57,7 +72,8 @@ Rcpp::List WSBM(Mat<double> W, int K, Col<double> alpha_v, bool store) {
   Col<double> logprob_temp(K, fill::zeros);
   Col<double> prob_temp(K, fill::zeros);
   NumericVector prob_temp_2(K);
-  Col<double> logpost_store(iter, fill::zeros);
+  NumericMatrix logpost_store_r(iter, 1);
+  Col<double> logpost_store(logpost_store_r.begin(), iter, false, true);
   
   for(int k = 0; k < K; k++){
     n_k(k) = size(z.elem(find(z == k)))(0);
@@ -261,22 +277,31 @@ Rcpp::List WSBM(Mat<double> W, int K, Col<double> alpha_v, bool store) {
   
   
   return Rcpp::List::create(Rcpp::Named("z") = z,
-                            Rcpp::Named("z_store") = z_store,
+                            Rcpp::Named("z_store") = z_store_r,
                             //Rcpp::Named("n_k_store") = n_k_store,
                             Rcpp::Named("mu") = mu,
-                            Rcpp::Named("mu_store") = mu_store,
-                            Rcpp::Named("ppm_store") = ppm_store,
+                            Rcpp::Named("mu_store") = mu_store_r,
+                            Rcpp::Named("ppm_store") = ppm_store_r,
                             Rcpp::Named("Var") = Var,
-                            Rcpp::Named("var_store") = var_store,
+                            Rcpp::Named("var_store") = var_store_r,
                             Rcpp::Named("LogL") = LogL,
-                            Rcpp::Named("logpost_store") = logpost_store
+                            Rcpp::Named("logpost_store") = logpost_store_r
   );
 }
 
-Mat<double> fisher(Mat<double> W){
+Mat<double> fisher(const Mat<double>& W){
   return 0.5 * log((1 + W)/(1 - W));
 }
 
+// Shared W_f behind a WSBM_shm handle, NULL if W is an ordinary matrix
+const wsbm::SharedWf* shared_W_f(SEXP W){
+  if(TYPEOF(W) != EXTPTRSXP) return NULL;
+  if(R_ExternalPtrTag(W) != Rf_install("wsbm_shm") || R_ExternalPtrAddr(W) == NULL){
+    stop("W must be a weight matrix or an attached WSBM_shm handle");
+  }
+  return static_cast<const wsbm::SharedWf*>(R_ExternalPtrAddr(W));
+}
+
 double logsumexp(Col<double> x){
   double c = max(x);
   return c + log(sum(exp(x - c)));
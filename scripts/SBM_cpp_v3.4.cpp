@@ -1,28 +1,151 @@
 // Estimation of K via stick-breaking process
-// W = weight matrix (correlation matrix with diagonals set to 0)
+// W = weight matrix (correlation matrix with diagonals set to 0), or a WSBM_shm handle
+//     to a Fisher-transformed W shared between R sessions (wsbm_shm.h)
 // K_max = upper bound for total no. of clusters
 // eta0 = Dirichlet process concentration parameter 
+// opts = optional list of output settings:
+//   ppm_file = write the PPM as a sparse CSR file (wsbm_ppm.h) instead of returning
+//              the dense ppm_store; ppm_threshold = min. co-clustering probability
+//              kept (default 0.5), ppm_top_k = keep each taxon's top-k partners
+//              instead (default 0 = off), taxa_names = names written to the file
+//   snapshot_file = publish the running PPM, the distribution of the no. of occupied
+//              communities and the current labels to this memory-mapped file
+//              (wsbm_snapshot.h) every snapshot_every iterations (default 100)
+//   trace_file = stream the retained draws (z, mu, Var, logpost) to a compressed trace
+//              file (wsbm_trace.h) through a background writer instead of holding
+//              z_store / mu_store / var_store in memory; trace_buffer = ring buffer
+//              capacity in draws (default 1024)
+//   trace_json = append a Chrome trace of the run (fisher, init, the phases of a
+//              sampled trace_rate fraction of the iterations, export) to this file
+//              (wsbm_timeline.h); trace_rate default 0.01
+//   mem_limit = memory budget in MB for the buffers of the run (wsbm_mem.h), checked
+//              before anything is allocated; default the memory available to the
+//              system, Inf = no check. mem_policy = "downgrade" streams the stored
+//              draws to a trace file and then accumulates the PPM packed with a CSR
+//              file (in tempdir() unless trace_file / ppm_file are given) until the
+//              plan fits, "refuse" stops instead; both stop if it cannot fit. The
+//              default is "downgrade" when mem_limit is given and "refuse" otherwise,
+//              so a run never changes its outputs without being asked to.
+//              The returned memory table has the planned and tracked MB per buffer
+// auto_WSBM_mem_plan = the memory table of a run on n taxa without running it
 
 
 #include <RcppArmadilloExtensions/sample.h>
 #include <RcppDist.h>
+#include "wsbm_mem.h"
+#include "wsbm_ppm.h"
+#include "wsbm_snapshot.h"
+#include "wsbm_trace.h"
+#include "wsbm_shm.h"
+#include "wsbm_timeline.h"
+#include <memory>
 // [[Rcpp::depends(RcppArmadillo, RcppDist)]]
 
 using namespace Rcpp;
 using namespace arma;
 
-static Mat<double> fisher(Mat<double> W);
+static Mat<double> fisher(const Mat<double>& W);
+static const wsbm::SharedWf* shared_W_f(SEXP W);
 static double logsumexp(Col<double> x);
+static void block_sums(const Mat<double>& W_f, const Col<int>& z, Mat<double>& W_sum, Mat<double>& W_sum_sq);
+static wsbm::MemConfig mem_config(int n, int K, int iter, int burn, bool store, bool shm,
+                                  Rcpp::Nullable<Rcpp::List> opts);
+static double mem_limit(Rcpp::Nullable<Rcpp::List> opts);
+static std::string mem_policy(Rcpp::Nullable<Rcpp::List> opts);
+static Rcpp::DataFrame mem_table(const wsbm::MemPlan& plan, double limit,
+                                 const std::vector<std::string>& actions, double peak_rss);
 //static Mat<double> inv_fisher(Mat<double> W_inv);
 
 // [[Rcpp::export]]
-Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
+Rcpp::List auto_WSBM(SEXP W, int K_max, double eta0, bool store,
+                     Rcpp::Nullable<Rcpp::List> opts = R_NilValue) {
   
   int iter = 10000, burn = 0.5*iter, K = K_max;
-  Mat<double> W_f = fisher(W);
+  
+  // Output settings
+  std::string ppm_file = "";
+  double ppm_threshold = 0.5;
+  int ppm_top_k = 0;
+  std::vector<std::string> taxa_names;
+  std::string snapshot_file = "";
+  int snapshot_every = 100;
+  std::string trace_file = "";
+  int trace_buffer = 1024;
+  std::string trace_json = "";
+  double trace_rate = 0.01;
+  std::string policy = mem_policy(opts);
+  if(opts.isNotNull()){
+    Rcpp::List o(opts);
+    if(o.containsElementNamed("ppm_file")) ppm_file = as<std::string>(o["ppm_file"]);
+    if(o.containsElementNamed("ppm_threshold")) ppm_threshold = as<double>(o["ppm_threshold"]);
+    if(o.containsElementNamed("ppm_top_k")) ppm_top_k = as<int>(o["ppm_top_k"]);
+    if(o.containsElementNamed("taxa_names")) taxa_names = as< std::vector<std::string> >(o["taxa_names"]);
+    if(o.containsElementNamed("snapshot_file")) snapshot_file = as<std::string>(o["snapshot_file"]);
+    if(o.containsElementNamed("snapshot_every")) snapshot_every = std::max(1, as<int>(o["snapshot_every"]));
+    if(o.containsElementNamed("trace_file")) trace_file = as<std::string>(o["trace_file"]);
+    if(o.containsElementNamed("trace_buffer")) trace_buffer = std::max(1, as<int>(o["trace_buffer"]));
+    if(o.containsElementNamed("trace_json")) trace_json = as<std::string>(o["trace_json"]);
+    if(o.containsElementNamed("trace_rate")) trace_rate = as<double>(o["trace_rate"]);
+  }
+  
+  // W is the weight matrix or a WSBM_shm handle, whose W_f is read in place
+  // from the shared segment
+  const wsbm::SharedWf* shm = shared_W_f(W);
+  int n_W = shm ? shm->n() : Rf_nrows(W);
+  
+  // Memory plan, before anything is allocated
+  wsbm::MemPlan mem(mem_config(n_W, K, iter, burn, store, shm != NULL, opts));
+  double limit = mem_limit(opts);
+  std::vector<std::string> mem_actions;
+  if(mem.total() > limit){
+    char msg[256];
+    std::snprintf(msg, sizeof(msg), "auto_WSBM needs about %.0f MB but the memory limit is %.0f MB",
+                  mem.total()/1048576.0, limit/1048576.0);
+    if(policy == "refuse"){
+      bool given = opts.isNotNull() && Rcpp::List(opts).containsElementNamed("mem_limit");
+      stop(std::string(msg) + " (largest: " + mem.largest() + "); " +
+           (given ? "mem_policy = \"downgrade\" streams the stored draws and the PPM"
+                  : "give mem_limit (MB) to stream the stored draws and the PPM to files instead"));
+    }
+    mem_actions = mem.fit(limit);
+    if(mem.total() > limit){
+      char left[128];
+      std::snprintf(left, sizeof(left), ", and about %.0f MB with streamed outputs", mem.total()/1048576.0);
+      stop(std::string(msg) + left + " (largest: " + mem.largest() + "); share W_f with WSBM_shm or raise mem_limit");
+    }
+    Rcpp::Function tempfile("tempfile");
+    if(mem.config().trace && trace_file == ""){
+      trace_file = as<std::string>(tempfile(Rcpp::Named("pattern") = "wsbm_", Rcpp::Named("fileext") = ".trc"));
+    }
+    if(mem.config().ppm_sparse && ppm_file == ""){
+      ppm_file = as<std::string>(tempfile(Rcpp::Named("pattern") = "wsbm_", Rcpp::Named("fileext") = ".ppm"));
+    }
+    std::string done;
+    for(const std::string& a : mem_actions){
+      done += (done.empty() ? "" : "; ") + a;
+    }
+    Rcpp::warning("%s: %s (trace_file = \"%s\", ppm_file = \"%s\")", msg, done, trace_file, ppm_file);
+  }
+  bool ppm_sparse = ppm_file != "";
+  bool trace = trace_file != "" && store;
+  std::unique_ptr<wsbm::Timeline> timeline;
+  if(trace_json != ""){
+    timeline.reset(new wsbm::Timeline(trace_json, trace_rate));
+  }
+  wsbm::Span run_span(timeline.get(), "auto_WSBM", "auto_WSBM");
+  
+  Mat<double> W_f_own;
+  if(shm == NULL){
+    wsbm::Span span(timeline.get(), "fisher", "preprocess");
+    NumericMatrix W_r(W);
+    W_f_own = fisher(Mat<double>(W_r.begin(), W_r.nrow(), W_r.ncol(), false, true));
+  }
+  const Mat<double> W_f(shm ? const_cast<double*>(shm->data()) : W_f_own.memptr(),
+                        shm ? shm->n() : W_f_own.n_rows, shm ? shm->n() : W_f_own.n_cols, false, true);
+  wsbm::Laps init(timeline.get(), "auto_WSBM");
   
   // Initialization
-  int n = W.n_rows, l = 0;
+  int n = W_f.n_rows, l = 0;
   Col<int> n_k(K, fill::zeros);
   Mat<int> matrix_n(K, K, fill::zeros);
   Mat<double> W_sum(K, K, fill::zeros);
@@ -37,7 +160,18 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
   Col<int> z = randi(n, distr_param(0, K_start - 1));
   //Col<int> z(n, fill::zeros);
   Col<int> z_temp = z;
-  Mat<int> ppm_store(n, n, fill::zeros);
+  // Outputs are allocated as R objects up front and filled in place through
+  // Armadillo views, so returning them does not copy
+  IntegerMatrix ppm_store_r(store && !ppm_sparse ? n : 0, store && !ppm_sparse ? n : 0);
+  Mat<int> ppm_store(ppm_store_r.begin(), ppm_store_r.nrow(), ppm_store_r.ncol(), false, true);
+  wsbm::PackedPPM ppm_packed(store && ppm_sparse ? n : 0);
+  
+  // Anytime snapshots
+  std::unique_ptr<wsbm::SnapshotWriter> snapshot;
+  if(snapshot_file != ""){
+    snapshot.reset(new wsbm::SnapshotWriter(snapshot_file, n, K));
+  }
+  std::vector<uint64_t> K_hist(K + 1, 0);
   
   Col<double> sampler(K, fill::zeros);
   for(int k = 0; k < K; k++){
@@ -53,11 +187,18 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
   // Store
   //Mat<int> z_store(n*iter, n, fill::zeros);
   //Mat<int> z_store(iter - burn, n, fill::zeros);
-  Mat<int> z_store(iter, n, fill::zeros);
+  bool draws = store && !trace;
+  IntegerMatrix z_store_r(draws ? iter : 0, draws ? n : 0);
+  Mat<int> z_store(z_store_r.begin(), z_store_r.nrow(), z_store_r.ncol(), false, true);
   //Col<double> logprob_store(iter, fill::zeros);
-  Cube<double> mu_store(K, K, iter - burn, fill::zeros);
-  Cube<double> var_store(K, K, iter - burn, fill::zeros);
-  Cube<double> n_k_store(K, K, iter, fill::zeros);
+  int n_slices = draws ? iter - burn : 0;
+  NumericVector mu_store_r(Dimension(K, K, n_slices)), var_store_r(Dimension(K, K, n_slices));
+  Cube<double> mu_store(mu_store_r.begin(), K, K, n_slices, false, true);
+  Cube<double> var_store(var_store_r.begin(), K, K, n_slices, false, true);
+  std::unique_ptr<wsbm::TraceWriter> tracer;
+  if(trace){
+    tracer.reset(new wsbm::TraceWriter(trace_file, n, K, trace_buffer));
+  }
   //Mat<double> alpha_mat(iter, K, fill::zeros);
   //Var.fill(1);
   
@@ -66,18 +207,29 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
   Col<double> logprob_temp(K, fill::zeros);
   Col<double> prob_temp(K, fill::zeros);
   NumericVector prob_temp_2(K);
-  Col<double> logpost_store(iter, fill::zeros);
+  NumericMatrix logpost_store_r(iter, 1);
+  Col<double> logpost_store(logpost_store_r.begin(), iter, false, true);
+  
+  mem.track("W_f", 8.0*W_f_own.n_elem);
+  mem.track("z_store", 4.0*z_store.n_elem);
+  mem.track("mu_store", 8.0*mu_store.n_elem);
+  mem.track("var_store", 8.0*var_store.n_elem);
+  mem.track("trace buffers", trace ? (trace_buffer + 2*256.0)*wsbm::trace_detail::record_bytes(n, K) : 0.0);
+  mem.track("ppm_store", 4.0*ppm_store.n_elem);
+  mem.track("packed PPM", ppm_packed.bytes() + 4.0*n);
+  mem.track("snapshot", snapshot ? wsbm::snapshot_detail::HEADER_BYTES + 2.0*wsbm::snapshot_detail::buffer_bytes(n, K) : 0.0);
+  mem.track("logpost_store", 8.0*logpost_store.n_elem);
+  mem.track("other", 16.0*n + 12*8.0*K*K);
   
   for(int k = 0; k < K; k++){
     n_k(k) = size(z.elem(find(z == k)))(0);
   }
+  block_sums(W_f, z, W_sum, W_sum_sq);
   for(int k = 0; k < K; k++){
     for(int kk = k; kk < K; kk++){
       
       if(k == kk){
         matrix_n(k, kk) = n_k(k) * (n_k(kk) - 1)/2;
-        W_sum(k, kk) = sum(vectorise(W_f.elem(find(z == k), find(z == kk))))/2;
-        W_sum_sq(k, kk) = sum(pow(vectorise(W_f.elem(find(z == k), find(z == kk))), 2))/2;
         if(matrix_n(k, kk) > 0){
           W_sum_sq_2(k, kk) = W_sum_sq(k, kk) - pow(W_sum(k, kk), 2)/matrix_n(k, kk);
           Var(k, kk) = 1/rgamma(1, (matrix_n(k, kk) + nu0)/2,
@@ -90,8 +242,6 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
       }
       else{
         matrix_n(k, kk) = n_k(k) * n_k(kk);
-        W_sum(k, kk) = sum(vectorise(W_f.elem(find(z == k), find(z == kk))));
-        W_sum_sq(k, kk) = sum(pow(vectorise(W_f.elem(find(z == k), find(z == kk))), 2));
         if(matrix_n(k, kk) > 0){
           W_sum_sq_2(k, kk) = W_sum_sq(k, kk) - pow(W_sum(k, kk), 2)/matrix_n(k, kk);
           Var(k, kk) = 1/rgamma(1, (matrix_n(k, kk) + nu0)/2,
@@ -122,7 +272,9 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
   //Rcout<<sum(vectorise(A.elem(find(z == 1), find(z == 1))))<<"\n";
   //Rcout<<rbeta(1, 1 + matrix_n1(1, 1), 1 + matrix_n0(1, 1))(0)<<"\n";
   //Rcout<<Var<<"\n";
+  init.lap("init");
   for(int it = 0; it < iter; it++){
+    wsbm::Laps laps(timeline.get(), "sweep", timeline && timeline->sampled(it));
     
     // Update stick-breaking parameters
     gamma.fill(0.0);
@@ -157,6 +309,8 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
     //   alpha_mat.row(it) = exp(log_alpha.t());
     // }
     
+    laps.lap("sticks");
+    
     // Update z
     
     for(int i = 0; i < n; i++){
@@ -205,14 +359,15 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
     }
     
     
+    laps.lap("z");
+    
     // Update var
+    block_sums(W_f, z, W_sum, W_sum_sq);
     for(int k = 0; k < K; k++){
       for(int kk = k; kk < K; kk++){
         
         if(k == kk){
           matrix_n(k, kk) = n_k(k) * (n_k(kk) - 1)/2;
-          W_sum(k, kk) = sum(vectorise(W_f.elem(find(z == k), find(z == kk))))/2;
-          W_sum_sq(k, kk) = sum(pow(vectorise(W_f.elem(find(z == k), find(z == kk))), 2))/2;
           if(matrix_n(k, kk) > 0){
             W_sum_sq_2(k, kk) = W_sum_sq(k, kk) - pow(W_sum(k, kk), 2)/matrix_n(k, kk);
             Var(k, kk) = 1/rgamma(1, (matrix_n(k, kk) + nu0)/2,
@@ -225,8 +380,6 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
         }
         else{
           matrix_n(k, kk) = n_k(k) * n_k(kk);
-          W_sum(k, kk) = sum(vectorise(W_f.elem(find(z == k), find(z == kk))));
-          W_sum_sq(k, kk) = sum(pow(vectorise(W_f.elem(find(z == k), find(z == kk))), 2));
           if(matrix_n(k, kk) > 0){
             W_sum_sq_2(k, kk) = W_sum_sq(k, kk) - pow(W_sum(k, kk), 2)/matrix_n(k, kk);
             Var(k, kk) = 1/rgamma(1, (matrix_n(k, kk) + nu0)/2,
@@ -240,6 +393,8 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
     }
     
     
+    laps.lap("var");
+    
     // Update mu
     
     for(int k = 0; k < K; k++){
@@ -263,22 +418,34 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
     //   n_k_store.slice(it) = W_sum;
     // }
     
+    laps.lap("mu");
+    
     // Take the inv-fisher transformation of mu for interpretation
     if(store){
-      z_store.row(it) = z.t();
+      if(!trace){
+        z_store.row(it) = z.t();
+      }
       if(it >= burn){
         //z_store.row(it - burn) = z.t();
-        mu_store.slice(it - burn) = mu;
-        var_store.slice(it - burn) = Var;
+        if(trace){
+          tracer->push(it, logpost_store(it), z.memptr(), mu.memptr(), Var.memptr());
+        }else{
+          mu_store.slice(it - burn) = mu;
+          var_store.slice(it - burn) = Var;
+        }
         
         // Update PPM
         
-        for(int i = 0; i < n; i++){
-          for(int ii = i; ii < n; ii++){
-            if(ii != i){
-              if(z_store(it, ii) == z_store(it, i)){
-                ppm_store(i, ii) = ppm_store(i, ii) + 1;
-                ppm_store(ii, i) = ppm_store(ii, i) + 1;
+        if(ppm_sparse){
+          ppm_packed.add(z.memptr(), K);
+        }else{
+          for(int i = 0; i < n; i++){
+            for(int ii = i; ii < n; ii++){
+              if(ii != i){
+                if(z(ii) == z(i)){
+                  ppm_store(i, ii) = ppm_store(i, ii) + 1;
+                  ppm_store(ii, i) = ppm_store(ii, i) + 1;
+                }
               }
             }
           }
@@ -292,6 +459,24 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
     
     
     
+    laps.lap("ppm");
+    
+    if(it >= burn){
+      K_hist[accu(n_k > 0)]++;
+    }
+    if(snapshot && ((it + 1) % snapshot_every == 0 || it == iter - 1)){
+      uint64_t n_retained = it >= burn ? it - burn + 1 : 0;
+      if(!store){
+        snapshot->publish(it + 1, n_retained, [](int, int){ return 0; }, K_hist, z.memptr());
+      }else if(ppm_sparse){
+        snapshot->publish(it + 1, n_retained, [&](int i, int j){ return ppm_packed.count(i, j); }, K_hist, z.memptr());
+      }else{
+        snapshot->publish(it + 1, n_retained, [&](int i, int j){ return ppm_store(i, j); }, K_hist, z.memptr());
+      }
+    }
+    
+    laps.lap("snapshot");
+    
     if(it*100/iter == count){
       Rcout<<count<< "% has been done\n";
       //Rcout<<z.t()<<'\n';
@@ -299,25 +484,158 @@ Rcpp::List auto_WSBM(Mat<double> W, int K_max, double eta0, bool store) {
     }
   }
   
+  wsbm::Span export_span(timeline.get(), "export", "auto_WSBM");
+  Rcpp::List trace_stats;
+  if(trace){
+    tracer->close();
+    const wsbm::TraceStats& ts = tracer->stats();
+    trace_stats = Rcpp::List::create(Rcpp::Named("records") = (double) ts.records,
+                                     Rcpp::Named("chunks") = (double) ts.chunks,
+                                     Rcpp::Named("raw_bytes") = (double) ts.raw_bytes,
+                                     Rcpp::Named("comp_bytes") = (double) ts.comp_bytes,
+                                     Rcpp::Named("stalls") = (double) ts.stalls,
+                                     Rcpp::Named("stall_seconds") = ts.stall_seconds);
+  }
+  
+  if(ppm_sparse && store){
+    wsbm::write_ppm_csr(ppm_file, ppm_packed, taxa_names, ppm_threshold, ppm_top_k);
+    mem.track("PPM export", 24.0*n);
+  }
+  Rcpp::DataFrame memory = mem_table(mem, limit, mem_actions, wsbm::peak_rss_mb(false));
   
   return Rcpp::List::create(Rcpp::Named("z") = z,
-                            Rcpp::Named("z_store") = z_store,
+                            Rcpp::Named("z_store") = z_store_r,
                             //Rcpp::Named("alpha_mat") = alpha_mat,
                             //Rcpp::Named("n_k_store") = n_k_store,
                             Rcpp::Named("mu") = mu,
-                            Rcpp::Named("mu_store") = mu_store,
+                            Rcpp::Named("mu_store") = mu_store_r,
                             Rcpp::Named("Var") = Var,
-                            Rcpp::Named("var_store") = var_store,
-                            Rcpp::Named("ppm_store") = ppm_store,
+                            Rcpp::Named("var_store") = var_store_r,
+                            Rcpp::Named("ppm_store") = ppm_store_r,
                             Rcpp::Named("LogL") = LogL,
-                            Rcpp::Named("logpost_store") = logpost_store
+                            Rcpp::Named("logpost_store") = logpost_store_r,
+                            Rcpp::Named("ppm_file") = ppm_file,
+                            Rcpp::Named("trace_file") = trace ? trace_file : std::string(""),
+                            Rcpp::Named("trace_stats") = trace_stats,
+                            Rcpp::Named("memory") = memory
   );
 }
 
-Mat<double> fisher(Mat<double> W){
+// [[Rcpp::export]]
+Rcpp::DataFrame auto_WSBM_mem_plan(int n, int K_max, bool store = true,
+                                   Rcpp::Nullable<Rcpp::List> opts = R_NilValue) {
+  
+  int iter = 10000, burn = 0.5*iter;
+  wsbm::MemPlan mem(mem_config(n, K_max, iter, burn, store, false, opts));
+  double limit = mem_limit(opts);
+  std::vector<std::string> actions;
+  if(mem_policy(opts) == "downgrade"){
+    actions = mem.fit(limit);
+  }
+  return mem_table(mem, limit, actions, NA_REAL);
+}
+
+// Plan inputs from the output settings in opts
+wsbm::MemConfig mem_config(int n, int K, int iter, int burn, bool store, bool shm,
+                           Rcpp::Nullable<Rcpp::List> opts){
+  wsbm::MemConfig c;
+  c.n = n;
+  c.K = K;
+  c.iter = iter;
+  c.burn = burn;
+  c.store = store;
+  c.shm = shm;
+  if(opts.isNotNull()){
+    Rcpp::List o(opts);
+    c.ppm_sparse = o.containsElementNamed("ppm_file") && as<std::string>(o["ppm_file"]) != "";
+    c.trace = o.containsElementNamed("trace_file") && as<std::string>(o["trace_file"]) != "";
+    c.snapshot = o.containsElementNamed("snapshot_file") && as<std::string>(o["snapshot_file"]) != "";
+    if(o.containsElementNamed("trace_buffer")) c.trace_buffer = std::max(1, as<int>(o["trace_buffer"]));
+  }
+  return c;
+}
+
+// Memory limit in bytes: opts$mem_limit (MB), else the memory available to the system
+double mem_limit(Rcpp::Nullable<Rcpp::List> opts){
+  double limit = wsbm::available_bytes();
+  if(opts.isNotNull()){
+    Rcpp::List o(opts);
+    if(o.containsElementNamed("mem_limit")) limit = as<double>(o["mem_limit"])*1048576.0;
+  }
+  return std::isnan(limit) ? R_PosInf : limit;
+}
+
+// Memory policy: opts$mem_policy, else "downgrade" if opts$mem_limit is given and
+// "refuse" if the limit is only the memory available to the system
+std::string mem_policy(Rcpp::Nullable<Rcpp::List> opts){
+  std::string policy = "refuse";
+  if(opts.isNotNull()){
+    Rcpp::List o(opts);
+    if(o.containsElementNamed("mem_limit")) policy = "downgrade";
+    if(o.containsElementNamed("mem_policy")) policy = as<std::string>(o["mem_policy"]);
+  }
+  if(policy != "downgrade" && policy != "refuse"){
+    stop("mem_policy must be \"downgrade\" or \"refuse\"");
+  }
+  return policy;
+}
+
+// Planned and tracked MB per buffer; the limit, the downgrades and the peak RSS of
+// the process (MB) as attributes
+Rcpp::DataFrame mem_table(const wsbm::MemPlan& plan, double limit, const std::vector<std::string>& actions,
+                          double peak_rss){
+  const std::vector<wsbm::MemBuffer>& b = plan.buffers();
+  CharacterVector name(b.size() + 1);
+  NumericVector planned(b.size() + 1), tracked(b.size() + 1);
+  for(std::size_t i = 0; i < b.size(); i++){
+    name[i] = b[i].name;
+    planned[i] = b[i].planned/1048576.0;
+    tracked[i] = b[i].tracked/1048576.0;
+  }
+  name[b.size()] = "total";
+  planned[b.size()] = plan.total()/1048576.0;
+  tracked[b.size()] = plan.tracked_total()/1048576.0;
+  Rcpp::DataFrame out = Rcpp::DataFrame::create(Rcpp::Named("buffer") = name,
+                                                Rcpp::Named("planned_MB") = planned,
+                                                Rcpp::Named("tracked_MB") = tracked,
+                                                Rcpp::Named("stringsAsFactors") = false);
+  out.attr("limit_MB") = limit/1048576.0;
+  out.attr("actions") = wrap(actions);
+  out.attr("peak_rss_MB") = peak_rss;
+  return out;
+}
+
+// Sums of W_f and of its squares per block (k <= kk) over the pairs i < j, in one
+// pass over the upper triangle; no n_k x n_kk copies of W_f, whatever the community
+// sizes (a community's own block is its pairs i < j, the diagonal is not used)
+void block_sums(const Mat<double>& W_f, const Col<int>& z, Mat<double>& W_sum, Mat<double>& W_sum_sq){
+  W_sum.zeros();
+  W_sum_sq.zeros();
+  int n = W_f.n_rows;
+  for(int j = 1; j < n; j++){
+    const double* col = W_f.colptr(j);
+    int z_j = z(j);
+    for(int i = 0; i < j; i++){
+      int k = std::min(z(i), z_j), kk = std::max(z(i), z_j);
+      W_sum(k, kk) += col[i];
+      W_sum_sq(k, kk) += col[i]*col[i];
+    }
+  }
+}
+
+Mat<double> fisher(const Mat<double>& W){
   return 0.5 * log((1 + W)/(1 - W));
 }
 
+// Shared W_f behind a WSBM_shm handle, NULL if W is an ordinary matrix
+const wsbm::SharedWf* shared_W_f(SEXP W){
+  if(TYPEOF(W) != EXTPTRSXP) return NULL;
+  if(R_ExternalPtrTag(W) != Rf_install("wsbm_shm") || R_ExternalPtrAddr(W) == NULL){
+    stop("W must be a weight matrix or an attached WSBM_shm handle");
+  }
+  return static_cast<const wsbm::SharedWf*>(R_ExternalPtrAddr(W));
+}
+
 double logsumexp(Col<double> x){
   double c = max(x);
   return c + log(sum(exp(x - c)));
@@ -0,0 +1,132 @@
+// Streaming correlation engine for growing cohorts
+// Keeps running transform moments / rank structures (see wsbm_cor.h) so that new
+// samples update the correlation matrix W without recomputing over all samples
+// (pearson, kendall; spearman recomputes the ranks of all samples on every update).
+// counts = n by p taxonomic abundance count table (samples in rows)
+// transform = MCLR / CLR / none
+// cor = pearson / spearman / kendall
+// The taxa are fixed by the filtration step (>= min_prev positive counts) at
+// initialization; taxa whose filter status changes later are reported.
+
+
+#include <Rcpp.h>
+#include "wsbm_cor.h"
+
+using namespace Rcpp;
+
+struct CorStreamState {
+  CorStreamState(int p_all, const std::vector<int>& taxa, wsbm::Transform tr,
+                 wsbm::CorMethod method, double min_prev)
+    : taxa(taxa), n_pos(p_all, 0), n_samples(0), min_prev(min_prev),
+      stream(taxa.size(), tr, method) {}
+
+  std::vector<int> taxa;      // columns of the count table kept by the filter
+  std::vector<int> n_pos;     // positive counts per column of the count table
+  int n_samples;
+  double min_prev;
+  wsbm::CorStream stream;
+  std::vector<double> W;      // last emitted correlation matrix
+};
+
+static void add_samples(CorStreamState& st, const NumericMatrix& counts){
+  int N = counts.nrow(), p_all = counts.ncol(), p = st.taxa.size();
+  if(p_all != (int) st.n_pos.size()){
+    stop("new counts must have the same columns as the initial count table");
+  }
+  std::vector<double> x(p);
+  for(int s = 0; s < N; s++){
+    for(int j = 0; j < p_all; j++){
+      st.n_pos[j] += counts(s, j) > 0;
+    }
+    for(int j = 0; j < p; j++){
+      x[j] = counts(s, st.taxa[j]);
+    }
+    st.stream.add(x.data());
+  }
+  st.n_samples += N;
+}
+
+static NumericMatrix as_matrix(const std::vector<double>& W, int p){
+  NumericMatrix W_r(p, p);
+  std::copy(W.begin(), W.end(), W_r.begin());
+  return W_r;
+}
+
+// [[Rcpp::export]]
+SEXP cor_stream_init(const NumericMatrix& counts, std::string transform = "MCLR",
+                     std::string cor = "pearson", double min_prev = 0.05) {
+  int N = counts.nrow(), p_all = counts.ncol();
+  std::vector<int> taxa = wsbm::filter_taxa(counts.begin(), N, p_all, min_prev);
+  if(taxa.size() < 2){
+    stop("fewer than 2 taxa pass the filtration step");
+  }
+  CorStreamState* st = new CorStreamState(p_all, taxa, wsbm::parse_transform(transform),
+                                          wsbm::parse_cor(cor), min_prev);
+  XPtr<CorStreamState> ptr(st, true);
+  add_samples(*st, counts);
+  st->W = st->stream.cor();
+  return ptr;
+}
+
+// [[Rcpp::export]]
+Rcpp::List cor_stream_update(SEXP stream, const NumericMatrix& new_counts, double tol = 1e-3) {
+  XPtr<CorStreamState> st(stream);
+  int p = st->taxa.size();
+
+  std::vector<double> W_old = st->W;
+  add_samples(*st, new_counts);
+  st->W = st->stream.cor();
+
+  // Entries of the upper triangle that moved by more than tol
+  std::vector<int> row, col;
+  std::vector<double> old_r, new_r;
+  NumericVector node_change(p);
+  double max_change = 0.0;
+  for(int j = 0; j < p; j++){
+    for(int i = 0; i < j; i++){
+      double delta = std::fabs(st->W[i + (std::size_t) j*p] - W_old[i + (std::size_t) j*p]);
+      node_change[i] += delta;
+      node_change[j] += delta;
+      max_change = std::max(max_change, delta);
+      if(delta > tol){
+        row.push_back(i + 1);
+        col.push_back(j + 1);
+        old_r.push_back(W_old[i + (std::size_t) j*p]);
+        new_r.push_back(st->W[i + (std::size_t) j*p]);
+      }
+    }
+  }
+
+  // Columns whose filter status would differ on the enlarged table
+  std::vector<bool> kept(st->n_pos.size(), false);
+  for(int j : st->taxa) kept[j] = true;
+  std::vector<int> filter_changed;
+  for(int j = 0; j < (int) st->n_pos.size(); j++){
+    bool pass = st->n_pos[j] >= st->min_prev*st->n_samples;
+    if(pass != kept[j]) filter_changed.push_back(j + 1);
+  }
+
+  return Rcpp::List::create(Rcpp::Named("W") = as_matrix(st->W, p),
+                            Rcpp::Named("changed") = DataFrame::create(Rcpp::Named("row") = wrap(row),
+                                                                       Rcpp::Named("col") = wrap(col),
+                                                                       Rcpp::Named("old") = wrap(old_r),
+                                                                       Rcpp::Named("new") = wrap(new_r)),
+                            Rcpp::Named("node_change") = node_change,
+                            Rcpp::Named("max_change") = max_change,
+                            Rcpp::Named("n_samples") = st->n_samples,
+                            Rcpp::Named("filter_changed") = wrap(filter_changed)
+  );
+}
+
+// [[Rcpp::export]]
+Rcpp::List cor_stream_state(SEXP stream) {
+  XPtr<CorStreamState> st(stream);
+  IntegerVector taxa(st->taxa.size());
+  for(int j = 0; j < (int) st->taxa.size(); j++){
+    taxa[j] = st->taxa[j] + 1;
+  }
+  return Rcpp::List::create(Rcpp::Named("W") = as_matrix(st->W, st->taxa.size()),
+                            Rcpp::Named("taxa") = taxa,
+                            Rcpp::Named("n_samples") = st->n_samples
+  );
+}
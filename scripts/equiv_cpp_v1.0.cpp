@@ -0,0 +1,183 @@
+// Equivalence of the fast sampler kernels with the reference code of auto_WSBM (v3.4)
+// The reference functions below are the straightforward loops of auto_WSBM, kept
+// verbatim as the definition of the model; every fast path of the engine
+// (wsbm_engine.h) is checked against them on randomized states:
+//   score        sufficient-statistic full conditional of z(i) -> prob_temp
+//   score_repro  the same in reproducible mode (pairwise row sums)
+//   stats        block statistics recomputed from scratch
+//   stats_repro  the same as fixed-order pairwise sums
+//   incremental  block statistics after Gibbs moves of random nodes (move())
+// W = weight matrix (correlation matrix with diagonals set to 0)
+// K_max = no. of communities of the random states
+// n_states = no. of random states (random labels, parameters drawn from the conditionals)
+// n_nodes = nodes scored / moved per state; seed = seed of the random states
+// tol = max. allowed absolute error of prob_temp and relative error of the statistics
+
+
+#include <RcppArmadillo.h>
+#include "wsbm_engine.h"
+// [[Rcpp::depends(RcppArmadillo)]]
+
+using namespace Rcpp;
+using namespace arma;
+
+namespace {
+
+double logsumexp(const Col<double>& x){
+  double c = max(x);
+  return c + log(sum(exp(x - c)));
+}
+
+// auto_WSBM: full conditional of z(i) given z, mu, Var (upper triangles) and log_alpha
+Col<double> ref_prob(const Mat<double>& W_f, const Col<int>& z, const Mat<double>& mu,
+                     const Mat<double>& Var, const Col<double>& log_alpha, int i){
+  int n = W_f.n_rows, K = mu.n_rows;
+  Col<double> logprob_temp(K, fill::zeros);
+  for(int k = 0; k < K; k++){
+    logprob_temp(k) = log_alpha(k);
+    for(int ii = 0; ii < n; ii++){
+      if(ii != i){
+        if(k < z(ii)){
+          logprob_temp(k) = logprob_temp(k) + log_normpdf(W_f(i, ii), mu(k, z(ii)), sqrt(Var(k, z(ii))));
+        }
+        else{
+          logprob_temp(k) = logprob_temp(k) + log_normpdf(W_f(i, ii), mu(z(ii), k), sqrt(Var(z(ii), k)));
+        }
+      }
+    }
+  }
+  return exp(logprob_temp - logsumexp(logprob_temp));
+}
+
+// auto_WSBM: block counts and sums (upper triangles)
+void ref_stats(const Mat<double>& W_f, const Col<int>& z, int K,
+               Mat<double>& matrix_n, Mat<double>& W_sum, Mat<double>& W_sum_sq){
+  Col<int> n_k(K, fill::zeros);
+  matrix_n.zeros(K, K);
+  W_sum.zeros(K, K);
+  W_sum_sq.zeros(K, K);
+  for(int k = 0; k < K; k++){
+    n_k(k) = size(z.elem(find(z == k)))(0);
+  }
+  for(int k = 0; k < K; k++){
+    for(int kk = k; kk < K; kk++){
+      if(k == kk){
+        matrix_n(k, kk) = n_k(k) * (n_k(kk) - 1)/2;
+        W_sum(k, kk) = sum(vectorise(W_f.elem(find(z == k), find(z == kk))))/2;
+        W_sum_sq(k, kk) = sum(pow(vectorise(W_f.elem(find(z == k), find(z == kk))), 2))/2;
+      }
+      else{
+        matrix_n(k, kk) = n_k(k) * n_k(kk);
+        W_sum(k, kk) = sum(vectorise(W_f.elem(find(z == k), find(z == kk))));
+        W_sum_sq(k, kk) = sum(pow(vectorise(W_f.elem(find(z == k), find(z == kk))), 2));
+      }
+    }
+  }
+}
+
+struct Errors {
+  double abs = 0.0, rel = 0.0;
+  int checks = 0;
+  void add(double fast, double ref){
+    double d = std::fabs(fast - ref);
+    abs = std::max(abs, d);
+    rel = std::max(rel, d/std::max(1.0, std::fabs(ref)));
+    checks++;
+  }
+};
+
+Mat<double> upper(const std::vector<double>& v, int K){
+  return trimatu(Mat<double>(v.data(), K, K));
+}
+
+void compare_stats(const wsbm::Chain& chain, const Mat<double>& W_f, int K, Errors& err){
+  Col<int> z = conv_to< Col<int> >::from(chain.z());
+  Mat<double> matrix_n, W_sum, W_sum_sq;
+  ref_stats(W_f, z, K, matrix_n, W_sum, W_sum_sq);
+  Mat<double> f_n = upper(chain.matrix_n(), K), f_sum = upper(chain.W_sum(), K), f_sq = upper(chain.W_sum_sq(), K);
+  for(uword p = 0; p < matrix_n.n_elem; p++){
+    err.add(f_n(p), matrix_n(p));
+    err.add(f_sum(p), W_sum(p));
+    err.add(f_sq(p), W_sum_sq(p));
+  }
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+Rcpp::DataFrame WSBM_kernel_equiv(const NumericMatrix& W, int K_max = 10, int n_states = 20,
+                                  int n_nodes = 10, int seed = 1, double tol = 1e-8) {
+
+  int n = W.nrow();
+  if(W.ncol() != n || n < 3){
+    stop("W must be a square matrix with at least 3 rows");
+  }
+  Mat<double> W_f(n, n);
+  wsbm::fisher(W.begin(), W_f.memptr(), W_f.n_elem);
+  W_f.diag().zeros();
+
+  const char* names[] = {"score", "score_repro", "stats", "stats_repro", "incremental"};
+  std::vector<Errors> err(5);
+  std::mt19937_64 rng(seed);
+
+  for(int st = 0; st < n_states; st++){
+    // Random state: labels over a random no. of communities, parameters from the conditionals
+    int K_state = std::uniform_int_distribution<int>(1, K_max)(rng);
+    std::vector<int> z(n);
+    for(int i = 0; i < n; i++){
+      z[i] = std::uniform_int_distribution<int>(0, K_state - 1)(rng);
+    }
+
+    for(int repro = 0; repro < 2; repro++){
+      wsbm::Settings s;
+      s.K_max = K_max;
+      s.seed = seed;
+      s.chain = st;
+      s.reproducible = repro == 1;
+      wsbm::Chain chain(W_f.memptr(), n, s);
+      chain.init_labels(z);
+      chain.update_sticks();
+
+      compare_stats(chain, W_f, K_max, err[repro ? 3 : 2]);
+
+      Col<int> z_ref = conv_to< Col<int> >::from(chain.z());
+      Mat<double> mu = upper(chain.mu(), K_max), Var = upper(chain.Var(), K_max);
+      Col<double> log_alpha(chain.log_alpha());
+      for(int t = 0; t < n_nodes; t++){
+        int i = std::uniform_int_distribution<int>(0, n - 1)(rng);
+        const std::vector<double>& lp = chain.score(i);
+        Col<double> fast(lp);
+        fast = exp(fast - logsumexp(fast));
+        Col<double> ref = ref_prob(W_f, z_ref, mu, Var, log_alpha, i);
+        for(int k = 0; k < K_max; k++){
+          err[repro].add(fast(k), ref(k));
+        }
+      }
+
+      // Incremental statistics after Gibbs moves (default mode only)
+      if(repro == 0){
+        for(int t = 0; t < n_nodes; t++){
+          chain.update_node(std::uniform_int_distribution<int>(0, n - 1)(rng));
+        }
+        compare_stats(chain, W_f, K_max, err[4]);
+      }
+    }
+  }
+
+  CharacterVector kernel(5);
+  IntegerVector checks(5);
+  NumericVector max_abs(5), max_rel(5);
+  LogicalVector pass(5);
+  for(int k = 0; k < 5; k++){
+    kernel[k] = names[k];
+    checks[k] = err[k].checks;
+    max_abs[k] = err[k].abs;
+    max_rel[k] = err[k].rel;
+    pass[k] = (k < 2 ? err[k].abs : err[k].rel) <= tol;
+  }
+  return DataFrame::create(Rcpp::Named("kernel") = kernel,
+                           Rcpp::Named("checks") = checks,
+                           Rcpp::Named("max_abs_err") = max_abs,
+                           Rcpp::Named("max_rel_err") = max_rel,
+                           Rcpp::Named("pass") = pass);
+}
@@ -0,0 +1,63 @@
+// Content hash of R vectors / matrices for the result cache keys
+// Hashes the raw values (XXH64, wsbm_hash.h) together with the type, the
+// dimensions, the names and the dimnames, so a count table or correlation matrix
+// of any size is keyed in one pass at memory bandwidth, and tables with the same
+// values but different taxa get different keys.
+// x = numeric / integer / logical / character / raw vector or matrix
+
+
+#include <Rcpp.h>
+#include "wsbm_hash.h"
+
+using namespace Rcpp;
+
+// Character vector (or NULL, distinct from an empty vector) into the hash
+static uint64_t hash_strings(SEXP x, uint64_t h){
+  if(x == R_NilValue) return wsbm::hash64("\xfe", 1, h);
+  R_xlen_t len = Rf_xlength(x);
+  h = wsbm::hash64(&len, sizeof(len), h);
+  for(R_xlen_t i = 0; i < len; i++){
+    SEXP s = STRING_ELT(x, i);
+    // NA_character_ and "" must differ
+    h = s == NA_STRING ? wsbm::hash64("\xff", 1, h) : wsbm::hash64(CHAR(s), LENGTH(s), h + 1);
+  }
+  return h;
+}
+
+// [[Rcpp::export]]
+std::string WSBM_hash(SEXP x) {
+
+  int type = TYPEOF(x);
+  uint64_t h = wsbm::hash64(&type, sizeof(type));
+  SEXP dim = Rf_getAttrib(x, R_DimSymbol);
+  if(dim != R_NilValue){
+    h = wsbm::hash64(INTEGER(dim), Rf_xlength(dim)*sizeof(int), h);
+  }
+  h = hash_strings(Rf_getAttrib(x, R_NamesSymbol), h);
+  SEXP dimnames = Rf_getAttrib(x, R_DimNamesSymbol);
+  if(dimnames != R_NilValue){
+    for(R_xlen_t d = 0; d < Rf_xlength(dimnames); d++){
+      h = hash_strings(VECTOR_ELT(dimnames, d), h);
+    }
+  }
+
+  R_xlen_t len = Rf_xlength(x);
+  switch(type){
+    case REALSXP:
+      h = wsbm::hash64(REAL(x), len*sizeof(double), h);
+      break;
+    case INTSXP:
+    case LGLSXP:
+      h = wsbm::hash64(INTEGER(x), len*sizeof(int), h);
+      break;
+    case RAWSXP:
+      h = wsbm::hash64(RAW(x), len, h);
+      break;
+    case STRSXP:
+      h = hash_strings(x, h);
+      break;
+    default:
+      stop("WSBM_hash supports atomic vectors / matrices only");
+  }
+  return wsbm::hash_hex(h);
+}
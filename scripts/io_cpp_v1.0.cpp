@@ -0,0 +1,130 @@
+// Readers for the binary files written by the WSBM samplers
+// read_WSBM_ppm: sparse PPM (CSR) file of auto_WSBM(..., opts = list(ppm_file = ...)),
+// returned as an edge list (0-based CSR indices converted to 1-based taxa)
+// read_WSBM_snapshot: latest consistent snapshot published by a running
+// auto_WSBM(..., opts = list(snapshot_file = ...)); safe to call while it samples
+// read_WSBM_trace: retained draws of auto_WSBM(..., opts = list(trace_file = ...)) in
+// the layout of z_store / mu_store / var_store (labels 0-based, upper triangles)
+// file = path of the PPM / snapshot / trace file
+
+
+#include <Rcpp.h>
+#include "wsbm_ppm.h"
+#include "wsbm_snapshot.h"
+#include "wsbm_trace.h"
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+Rcpp::List read_WSBM_ppm(std::string file) {
+
+  wsbm::PPMCSR csr;
+  try{
+    csr = wsbm::read_ppm_csr(file);
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+
+  IntegerVector from(csr.nnz), to(csr.nnz);
+  NumericVector prob(csr.nnz);
+  for(uint64_t i = 0; i < csr.n; i++){
+    for(uint64_t e = csr.row_ptr[i]; e < csr.row_ptr[i + 1]; e++){
+      from[e] = i + 1;
+      to[e] = csr.col_idx[e] + 1;
+      prob[e] = csr.prob[e];
+    }
+  }
+
+  return Rcpp::List::create(Rcpp::Named("edges") = DataFrame::create(Rcpp::Named("from") = from,
+                                                                      Rcpp::Named("to") = to,
+                                                                      Rcpp::Named("prob") = prob),
+                            Rcpp::Named("taxa") = CharacterVector(csr.names.begin(), csr.names.end()),
+                            Rcpp::Named("n_retained") = (int) csr.n_retained,
+                            Rcpp::Named("threshold") = csr.threshold,
+                            Rcpp::Named("top_k") = (int) csr.top_k
+  );
+}
+
+// [[Rcpp::export]]
+Rcpp::List read_WSBM_snapshot(std::string file) {
+
+  wsbm::Snapshot snap;
+  try{
+    snap = wsbm::read_snapshot(file);
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+
+  int n = snap.n;
+  double denom = snap.n_retained > 0 ? (double) snap.n_retained : 1.0;
+  NumericMatrix ppm(n, n);
+  for(int j = 0; j < n; j++){
+    ppm(j, j) = snap.n_retained > 0 ? 1.0 : 0.0;
+    for(int i = 0; i < j; i++){
+      ppm(i, j) = ppm(j, i) = snap.ppm[(std::size_t) j*(j - 1)/2 + i]/denom;
+    }
+  }
+  IntegerVector z(n);
+  for(int i = 0; i < n; i++){
+    z[i] = snap.z[i] + 1;
+  }
+  NumericVector K_dist(snap.K_max + 1);
+  CharacterVector K_names(snap.K_max + 1);
+  for(uint64_t k = 0; k <= snap.K_max; k++){
+    K_dist[k] = snap.K_hist[k]/denom;
+    K_names[k] = std::to_string(k);
+  }
+  K_dist.names() = K_names;
+
+  return Rcpp::List::create(Rcpp::Named("iter") = (double) snap.iter,
+                            Rcpp::Named("n_retained") = (double) snap.n_retained,
+                            Rcpp::Named("generation") = (double) snap.generation,
+                            Rcpp::Named("ppm") = ppm,
+                            Rcpp::Named("K_dist") = K_dist,
+                            Rcpp::Named("z") = z
+  );
+}
+
+// [[Rcpp::export]]
+Rcpp::List read_WSBM_trace(std::string file) {
+
+  try{
+    wsbm::TraceReader tr(file);
+    int n = tr.n(), K = tr.K(), R = tr.n_records();
+    IntegerMatrix z_store(R, n);
+    NumericVector mu_store(Dimension(K, K, R)), var_store(Dimension(K, K, R));
+    NumericVector iter(R), logpost(R);
+
+    int r = 0;
+    for(std::size_t c = 0; c < tr.n_chunks(); c++){
+      std::vector<char> raw = tr.chunk(c);
+      for(std::size_t off = 0; off < raw.size() && r < R; off += tr.record_bytes(), r++){
+        const char* rec = &raw[off];
+        iter[r] = tr.iter(rec);
+        logpost[r] = tr.logpost(rec);
+        const int32_t* z = tr.z(rec);
+        for(int i = 0; i < n; i++){
+          z_store(r, i) = z[i];
+        }
+        const double* mu = tr.mu(rec);
+        const double* Var = tr.Var(rec);
+        std::size_t slice = (std::size_t) r*K*K;
+        for(int kk = 0; kk < K; kk++){
+          for(int k = 0; k <= kk; k++){
+            mu_store[slice + k + (std::size_t) kk*K] = *mu++;
+            var_store[slice + k + (std::size_t) kk*K] = *Var++;
+          }
+        }
+      }
+    }
+
+    return Rcpp::List::create(Rcpp::Named("iter") = iter,
+                              Rcpp::Named("z_store") = z_store,
+                              Rcpp::Named("mu_store") = mu_store,
+                              Rcpp::Named("var_store") = var_store,
+                              Rcpp::Named("logpost") = logpost
+    );
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+}
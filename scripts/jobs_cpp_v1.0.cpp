@@ -0,0 +1,128 @@
+// Batch of WSBM fits (cohorts / networks of any size) on one work-stealing scheduler
+// Every network is a job that spawns its chains as subtasks (wsbm_sched.h): the
+// largest networks start first and idle threads steal chains of the running ones,
+// so networks of very different n keep all cores busy. BLAS / OpenMP libraries in
+// the process are held at one thread while the batch runs.
+// W_list = list of weight matrices (correlation matrices with diagonals set to 0)
+// chains = no. of chains per network, pooled into one PPM
+// K_max, eta0, iter, burn, seed = sampler settings (chain c of network j uses stream
+// (seed, j * chains + c)); reproducible = counter-based RNG and pairwise sums in the
+// engine (wsbm_engine.h). Chains are pooled in chain order, so the PPMs are the same
+// for any n_threads
+// WSBM_blas_threads: set the threads of the BLAS / OpenMP libraries of this R
+// process (e.g. inside parallel::mclapply workers); returns the previous count
+
+
+#include <Rcpp.h>
+#include "wsbm_engine.h"
+#include "wsbm_sched.h"
+
+#include <chrono>
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+Rcpp::List WSBM_batch_fit(Rcpp::List W_list, int chains = 4, int K_max = 20, double eta0 = 0.1,
+                          int iter = 10000, int burn = 5000, int seed = 1, int n_threads = 0,
+                          bool reproducible = false) {
+
+  if(burn >= iter){
+    stop("burn must be smaller than iter");
+  }
+  if(n_threads < 1){
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  chains = std::max(1, chains);
+
+  int J = W_list.size();
+  std::vector< std::vector<double> > W_f(J);
+  std::vector<int> n(J);
+  std::vector<double> cost(J);
+  for(int j = 0; j < J; j++){
+    NumericMatrix W(W_list[j]);
+    if(W.nrow() != W.ncol()) stop("W_list[[" + std::to_string(j + 1) + "]] is not a square matrix");
+    n[j] = W.nrow();
+    W_f[j].resize((std::size_t) n[j]*n[j]);
+    wsbm::fisher(W.begin(), W_f[j].data(), W_f[j].size());
+    for(int i = 0; i < n[j]; i++){
+      W_f[j][i + (std::size_t) i*n[j]] = 0.0;
+    }
+    cost[j] = (double) n[j]*n[j]*chains;
+  }
+
+  std::vector< std::vector<wsbm::Fit> > fits(J, std::vector<wsbm::Fit>(chains));
+  std::vector<double> seconds(J);
+  try{
+    wsbm::Scheduler sched(n_threads);
+    sched.run_jobs(cost, [&](int j){
+      std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+      wsbm::Scheduler::TaskGroup g;
+      for(int c = 0; c < chains; c++){
+        sched.spawn(g, [&, j, c]{
+          wsbm::Settings s;
+          s.K_max = K_max;
+          s.eta0 = eta0;
+          s.iter = iter;
+          s.burn = burn;
+          s.seed = seed;
+          s.chain = (uint64_t) j*chains + c;
+          s.reproducible = reproducible;
+          fits[j][c] = wsbm::fit(W_f[j].data(), n[j], s);
+        });
+      }
+      sched.wait(g);
+      seconds[j] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    });
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+
+  Rcpp::List out(J);
+  for(int j = 0; j < J; j++){
+    int n_j = n[j];
+    NumericMatrix ppm(n_j, n_j);
+    NumericMatrix logpost(iter - burn, chains);
+    IntegerVector K_hist(K_max + 1);
+    for(int c = 0; c < chains; c++){
+      const wsbm::Fit& fit = fits[j][c];
+      for(std::size_t i = 0; i < fit.ppm.size(); i++){
+        ppm[i] += fit.ppm[i]/chains;
+      }
+      for(int d = 0; d < fit.n_retained; d++){
+        logpost(d, c) = fit.logpost[d];
+        K_hist[std::min(fit.K_trace[d], K_max)]++;
+      }
+    }
+
+    // Point estimate: the chains' Binder estimates scored against the pooled PPM
+    std::vector<double> ppm_v(ppm.begin(), ppm.end());
+    double best = std::numeric_limits<double>::infinity();
+    std::vector<int> z_hat;
+    for(int c = 0; c < chains; c++){
+      double loss = wsbm::binder_loss(fits[j][c].z_hat, ppm_v);
+      if(loss < best){
+        best = loss;
+        z_hat = fits[j][c].z_hat;
+      }
+    }
+    IntegerVector labels(n_j);
+    for(int i = 0; i < n_j; i++){
+      labels[i] = z_hat[i] + 1;
+    }
+
+    out[j] = Rcpp::List::create(Rcpp::Named("ppm") = ppm,
+                                Rcpp::Named("cluster_labels") = labels,
+                                Rcpp::Named("K_hist") = K_hist,
+                                Rcpp::Named("logpost") = logpost,
+                                Rcpp::Named("seconds") = seconds[j]);
+  }
+  return out;
+}
+
+// [[Rcpp::export]]
+int WSBM_blas_threads(int n) {
+  int previous = wsbm::BlasThreads::get();
+  std::string found = wsbm::BlasThreads::set(n);
+  if(found == "") Rcpp::warning("no BLAS / OpenMP library with a thread setting was found");
+  return previous;
+}
@@ -0,0 +1,124 @@
+// Timed single-chain fit of the engine for the performance suite (perf_suite.R)
+// W = weight matrix (correlation matrix with diagonals set to 0), or a single number n:
+//     a synthetic network of n nodes with K_true equal planted communities (r = 0.5
+//     within, 0 between, Var = 0.1 on the Fisher scale) generated in C++, so that
+//     networks of n = 20,000 do not need an n x n R matrix
+// K_max, eta0, iter, burn, seed, reproducible = sampler settings (wsbm_engine.h)
+// Returns wall seconds, iterations / s, seconds per phase (sticks, z, stats, params,
+// ppm, estimate), the peak RSS of the process during the fit and the retained traces
+// of K and the log posterior (for ESS)
+// counters = also count cycles, instructions, LLC misses and branch misses per phase
+//     with Linux perf_event_open (wsbm_perf.h): a phase x counter matrix, NA where a
+//     counter is unavailable (attribute "status" says why)
+// WSBM_peak_rss: peak RSS of this process in MB; reset = start a new peak (Linux)
+
+
+#include <Rcpp.h>
+#include "wsbm_engine.h"
+#include "wsbm_mem.h"
+
+#include <chrono>
+#include <string>
+
+using namespace Rcpp;
+
+namespace {
+
+// Planted partition on the Fisher scale, column-major, diagonal 0
+void synthetic_W_f(std::vector<double>& W_f, int n, int K, int seed){
+  std::mt19937_64 rng(seed);
+  std::normal_distribution<double> noise(0.0, std::sqrt(0.1));
+  double mu_in = wsbm::fisher(0.5);
+  W_f.assign((std::size_t) n*n, 0.0);
+  for(int j = 1; j < n; j++){
+    for(int i = 0; i < j; i++){
+      double w = (i*K/n == j*K/n ? mu_in : 0.0) + noise(rng);
+      W_f[i + (std::size_t) j*n] = w;
+      W_f[j + (std::size_t) i*n] = w;
+    }
+  }
+}
+
+} // namespace
+
+// [[Rcpp::export]]
+Rcpp::List WSBM_perf_fit(SEXP W, int K_max = 20, double eta0 = 0.1, int iter = 2000, int burn = 1000,
+                         int seed = 1, bool reproducible = false, int K_true = 4,
+                         bool counters = false) {
+
+  if(burn >= iter){
+    stop("burn must be smaller than iter");
+  }
+  int n;
+  std::vector<double> W_f;
+  if(Rf_length(W) == 1){
+    n = as<int>(W);
+    if(n < 2 || K_true < 1 || K_true > n) stop("need n >= 2 and 1 <= K_true <= n");
+    synthetic_W_f(W_f, n, K_true, seed);
+  }else{
+    NumericMatrix W_mat(W);
+    n = W_mat.nrow();
+    if(W_mat.ncol() != n) stop("W is not a square matrix");
+    W_f.resize((std::size_t) n*n);
+    wsbm::fisher(W_mat.begin(), W_f.data(), W_f.size());
+    for(int i = 0; i < n; i++){
+      W_f[i + (std::size_t) i*n] = 0.0;
+    }
+  }
+
+  wsbm::Settings s;
+  s.K_max = K_max;
+  s.eta0 = eta0;
+  s.iter = iter;
+  s.burn = burn;
+  s.seed = seed;
+  s.reproducible = reproducible;
+  s.timing = true;
+  s.counters = counters;
+
+  wsbm::peak_rss_mb(true);
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  wsbm::Fit fit;
+  try{
+    fit = wsbm::fit(W_f.data(), n, s);
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  double rss = wsbm::peak_rss_mb(false);
+
+  NumericVector phases(wsbm::N_PHASES);
+  CharacterVector phase_names(wsbm::N_PHASES);
+  for(int p = 0; p < wsbm::N_PHASES; p++){
+    phases[p] = fit.phase_seconds[p];
+    phase_names[p] = wsbm::phase_name(p);
+  }
+  phases.attr("names") = phase_names;
+
+  NumericMatrix counts(wsbm::N_PHASES, wsbm::N_COUNTERS);
+  CharacterVector counter_names(wsbm::N_COUNTERS);
+  for(int c = 0; c < wsbm::N_COUNTERS; c++){
+    counter_names[c] = wsbm::counter_name(c);
+    for(int p = 0; p < wsbm::N_PHASES; p++){
+      double v = counters ? fit.phase_counters[p*wsbm::N_COUNTERS + c] : NA_REAL;
+      counts(p, c) = std::isnan(v) ? NA_REAL : v;
+    }
+  }
+  counts.attr("dimnames") = Rcpp::List::create(phase_names, counter_names);
+  counts.attr("status") = counters ? fit.counters_status : std::string("not requested");
+
+  return Rcpp::List::create(Rcpp::Named("n") = n,
+                            Rcpp::Named("iter") = iter,
+                            Rcpp::Named("seconds") = seconds,
+                            Rcpp::Named("iter_per_sec") = iter/seconds,
+                            Rcpp::Named("phases") = phases,
+                            Rcpp::Named("counters") = counts,
+                            Rcpp::Named("peak_rss_mb") = rss,
+                            Rcpp::Named("K_trace") = wrap(fit.K_trace),
+                            Rcpp::Named("logpost") = wrap(fit.logpost));
+}
+
+// [[Rcpp::export]]
+double WSBM_peak_rss(bool reset = false) {
+  return wsbm::peak_rss_mb(reset);
+}
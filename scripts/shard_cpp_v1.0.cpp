@@ -0,0 +1,155 @@
+// Chain shards from R (wsbm_shard.h; the same files as the wsbm_shard command line tool)
+// WSBM_shard_run: run the given chains against a binary W file and write one shard
+// WSBM_shard_merge: check and combine any number of shards into the pooled PPM,
+// K histogram, per-chain diagnostics and split R-hat of the log posterior and K
+// W_file = n x n correlation matrix as raw doubles (column-major)
+// chains = chain ids of this process (distinct across the processes of one analysis)
+// K_max, eta0, iter, burn, seed = sampler settings (must agree across shards)
+// affinity = "none", "compact" or "spread" thread pinning; replicate = one W_f per
+// NUMA node; hugepages = W_f on transparent huge pages (wsbm_numa.h)
+
+
+#include <Rcpp.h>
+#include "wsbm_shard.h"
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+Rcpp::DataFrame WSBM_shard_run(std::string W_file, IntegerVector chains, std::string out,
+                               int K_max = 20, double eta0 = 0.1, int iter = 10000, int burn = 5000,
+                               int seed = 1, int n_threads = 1, std::string affinity = "none",
+                               bool replicate = false, bool hugepages = false) {
+
+  if(burn >= iter){
+    stop("burn must be smaller than iter");
+  }
+  std::vector<uint32_t> ids;
+  for(int c : chains){
+    if(c < 0) stop("chain ids must be non-negative");
+    ids.push_back(c);
+  }
+
+  wsbm::Shard sh;
+  std::vector<wsbm::SocketStats> sockets;
+  try{
+    int n = 0;
+    uint64_t hash = 0;
+    std::vector<double> W = wsbm::read_W_file(W_file, n, hash);
+    wsbm::Settings s;
+    s.K_max = K_max;
+    s.eta0 = eta0;
+    s.iter = iter;
+    s.burn = burn;
+    s.seed = seed;
+    wsbm::Placement pl;
+    pl.affinity = affinity;
+    pl.replicate = replicate;
+    pl.hugepages = hugepages;
+    sh = wsbm::run_shard(W, n, hash, s, ids, n_threads, pl, &sockets);
+    wsbm::write_shard(out, sh);
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+
+  IntegerVector chain(sh.chains.size()), n_retained(sh.chains.size()), node(sh.chains.size()), cpu(sh.chains.size());
+  NumericVector seconds(sh.chains.size());
+  for(std::size_t c = 0; c < sh.chains.size(); c++){
+    chain[c] = sh.chains[c].chain;
+    n_retained[c] = sh.chains[c].n_retained;
+    seconds[c] = sh.chains[c].seconds;
+    node[c] = sh.chains[c].node;
+    cpu[c] = sh.chains[c].cpu < 0 ? NA_INTEGER : sh.chains[c].cpu;
+  }
+
+  IntegerVector s_node(sockets.size()), s_threads(sockets.size());
+  NumericVector s_GB(sockets.size()), s_GBps(sockets.size()), s_peak(sockets.size()), s_util(sockets.size());
+  for(std::size_t k = 0; k < sockets.size(); k++){
+    s_node[k] = sockets[k].node;
+    s_threads[k] = sockets[k].threads;
+    s_GB[k] = sockets[k].GB;
+    s_GBps[k] = sockets[k].GBps;
+    s_peak[k] = sockets[k].peak_GBps;
+    s_util[k] = sockets[k].utilization;
+  }
+  DataFrame timing = DataFrame::create(Rcpp::Named("chain") = chain,
+                                       Rcpp::Named("n_retained") = n_retained,
+                                       Rcpp::Named("seconds") = seconds,
+                                       Rcpp::Named("node") = node,
+                                       Rcpp::Named("cpu") = cpu);
+  timing.attr("sockets") = DataFrame::create(Rcpp::Named("node") = s_node,
+                                             Rcpp::Named("threads") = s_threads,
+                                             Rcpp::Named("W_f_GB") = s_GB,
+                                             Rcpp::Named("GB_per_s") = s_GBps,
+                                             Rcpp::Named("read_test_GB_per_s") = s_peak,
+                                             Rcpp::Named("utilization") = s_util);
+  return timing;
+}
+
+// [[Rcpp::export]]
+Rcpp::List WSBM_shard_merge(std::vector<std::string> files, std::string out = "") {
+
+  wsbm::Shard sh;
+  try{
+    std::vector<wsbm::Shard> shards;
+    for(const std::string& f : files){
+      shards.push_back(wsbm::read_shard(f));
+    }
+    sh = wsbm::merge_shards(shards);
+    if(out != "") wsbm::write_shard(out, sh);
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+
+  int n = sh.n, C = sh.chains.size();
+  uint64_t n_retained = 0;
+  std::vector<double> ppm = wsbm::pooled_ppm(sh, n_retained);
+  NumericMatrix ppm_r(n, n);
+  std::copy(ppm.begin(), ppm.end(), ppm_r.begin());
+
+  NumericVector K_hist(sh.K_max + 1);
+  CharacterVector K_names(sh.K_max + 1);
+  for(uint32_t k = 0; k <= sh.K_max; k++){
+    K_names[k] = std::to_string(k);
+  }
+  IntegerVector chain(C), n_ret(C);
+  NumericVector seconds(C), K_mean(C), logpost_mean(C);
+  std::vector< std::vector<double> > lp, kt;
+  for(int c = 0; c < C; c++){
+    const wsbm::ShardChain& ch = sh.chains[c];
+    for(uint32_t k = 0; k <= sh.K_max; k++){
+      K_hist[k] += ch.K_hist[k];
+    }
+    chain[c] = ch.chain;
+    n_ret[c] = ch.n_retained;
+    seconds[c] = ch.seconds;
+    double ks = 0.0, ls = 0.0;
+    for(uint32_t r = 0; r < ch.n_retained; r++){
+      ks += ch.K_trace[r];
+      ls += ch.logpost[r];
+    }
+    K_mean[c] = ch.n_retained > 0 ? ks/ch.n_retained : NA_REAL;
+    logpost_mean[c] = ch.n_retained > 0 ? ls/ch.n_retained : NA_REAL;
+    lp.push_back(ch.logpost);
+    kt.push_back(std::vector<double>(ch.K_trace.begin(), ch.K_trace.end()));
+  }
+  K_hist.names() = K_names;
+
+  return Rcpp::List::create(Rcpp::Named("ppm") = ppm_r,
+                            Rcpp::Named("n_retained") = (double) n_retained,
+                            Rcpp::Named("K_hist") = K_hist,
+                            Rcpp::Named("rhat") = NumericVector::create(Rcpp::Named("logpost") = wsbm::split_rhat(lp),
+                                                                        Rcpp::Named("K") = wsbm::split_rhat(kt)),
+                            Rcpp::Named("chains") = DataFrame::create(Rcpp::Named("chain") = chain,
+                                                                      Rcpp::Named("n_retained") = n_ret,
+                                                                      Rcpp::Named("seconds") = seconds,
+                                                                      Rcpp::Named("K_mean") = K_mean,
+                                                                      Rcpp::Named("logpost_mean") = logpost_mean),
+                            Rcpp::Named("settings") = Rcpp::List::create(Rcpp::Named("W_hash") = wsbm::hash_hex(sh.W_hash),
+                                                                         Rcpp::Named("n") = n,
+                                                                         Rcpp::Named("K_max") = (int) sh.K_max,
+                                                                         Rcpp::Named("eta0") = sh.eta0,
+                                                                         Rcpp::Named("iter") = (int) sh.iter,
+                                                                         Rcpp::Named("burn") = (int) sh.burn,
+                                                                         Rcpp::Named("seed") = (double) sh.seed)
+  );
+}
@@ -0,0 +1,90 @@
+// Fisher-transformed W in named shared memory, attached by several R sessions (wsbm_shm.h)
+// WSBM_shm_open: attach the segment (creating it from W if it does not exist) and
+// return a handle that auto_WSBM / WSBM accept in place of W
+// WSBM_shm_info / WSBM_shm_release / WSBM_shm_unlink: inspect, detach, force removal
+// W = correlation matrix (diagonals set to 0), or NULL to attach an existing segment
+// name = segment name (default "/wsbm_" + content hash of W); with W, an existing
+//        segment of that name must hold W, otherwise it is refused
+// verify = re-hash the shared matrix on attach (integrity check)
+// mode = octal permissions of a new segment ("0660": the creator's group can attach
+//        and count its handles; users who can only read attach without counting)
+
+
+#include <Rcpp.h>
+#include "wsbm_shm.h"
+
+using namespace Rcpp;
+
+static wsbm::SharedWf* shm_handle(SEXP h){
+  if(TYPEOF(h) != EXTPTRSXP || R_ExternalPtrTag(h) != Rf_install("wsbm_shm")){
+    stop("not a WSBM_shm handle");
+  }
+  return static_cast<wsbm::SharedWf*>(R_ExternalPtrAddr(h));
+}
+
+// [[Rcpp::export]]
+SEXP WSBM_shm_open(Rcpp::Nullable<Rcpp::NumericMatrix> W = R_NilValue, std::string name = "",
+                   bool verify = true, std::string mode = "0660") {
+
+  const double* W_ptr = NULL;
+  int n = 0;
+  NumericMatrix W_r;
+  if(W.isNotNull()){
+    W_r = NumericMatrix(W);
+    if(W_r.nrow() != W_r.ncol()) stop("W must be a square matrix");
+    W_ptr = W_r.begin();
+    n = W_r.nrow();
+    if(name == ""){
+      name = "/wsbm_" + wsbm::hash_hex(wsbm::hash64(W_ptr, (std::size_t) n*n*sizeof(double)));
+    }
+  }else if(name == ""){
+    stop("give W or the name of an existing segment");
+  }
+  if(name[0] != '/') name = "/" + name;
+
+  wsbm::SharedWf* shm = NULL;
+  try{
+    shm = new wsbm::SharedWf(name, W_ptr, n, verify, (mode_t) std::strtol(mode.c_str(), NULL, 8));
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+
+  XPtr<wsbm::SharedWf> h(shm, true, Rf_install("wsbm_shm"), R_NilValue);
+  h.attr("class") = "wsbm_shm";
+  return h;
+}
+
+// [[Rcpp::export]]
+Rcpp::List WSBM_shm_info(SEXP h, bool verify = false) {
+
+  wsbm::SharedWf* shm = shm_handle(h);
+  if(shm == NULL || !shm->attached()){
+    return Rcpp::List::create(Rcpp::Named("attached") = false);
+  }
+  Rcpp::List out = Rcpp::List::create(Rcpp::Named("attached") = true,
+                                      Rcpp::Named("name") = shm->name(),
+                                      Rcpp::Named("n") = shm->n(),
+                                      Rcpp::Named("MB") = shm->bytes()/1048576.0,
+                                      Rcpp::Named("refs") = (double) shm->refs(),
+                                      Rcpp::Named("hash") = wsbm::hash_hex(shm->hash()),
+                                      Rcpp::Named("created") = shm->created(),
+                                      Rcpp::Named("counted") = shm->counted()
+  );
+  if(verify) out["valid"] = shm->verify();
+  return out;
+}
+
+// [[Rcpp::export]]
+void WSBM_shm_release(SEXP h) {
+  wsbm::SharedWf* shm = shm_handle(h);
+  if(shm != NULL){
+    delete shm;
+    R_ClearExternalPtr(h);
+  }
+}
+
+// [[Rcpp::export]]
+bool WSBM_shm_unlink(std::string name) {
+  if(name[0] != '/') name = "/" + name;
+  return wsbm::SharedWf::unlink(name);
+}
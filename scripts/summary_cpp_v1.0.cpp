@@ -0,0 +1,109 @@
+// Block-level summary tables of a fitted partition
+// A single pass over the upper triangle of W gives, for every pair of blocks,
+// the no. of pairs, mean and variance of the correlations, the posterior mean of
+// the block mean mu given the partition (conjugate Normal-Inverse-Gamma prior of
+// auto_WSBM, Fisher scale) transformed back to the r scale with inv_fisher, and
+// each taxon's within-block strength for the hub tables.
+// W = weight matrix (correlation matrix with diagonals set to 0)
+// labels = community labels (e.g. the minbinder point estimate of the PPM)
+// n_hubs = no. of top within-block hub taxa reported per block
+
+
+#include <Rcpp.h>
+#include "wsbm_engine.h"
+
+using namespace Rcpp;
+
+// [[Rcpp::export]]
+Rcpp::List WSBM_block_summary(const NumericMatrix& W, const IntegerVector& labels, int n_hubs = 5) {
+
+  int n = W.nrow();
+  if(W.ncol() != n || labels.size() != n){
+    stop("W must be n x n and labels of length n");
+  }
+
+  // Blocks in increasing label order
+  std::vector<int> lev(labels.begin(), labels.end());
+  std::sort(lev.begin(), lev.end());
+  lev.erase(std::unique(lev.begin(), lev.end()), lev.end());
+  int K = lev.size();
+  std::vector<int> z(n), size(K, 0);
+  for(int i = 0; i < n; i++){
+    z[i] = std::lower_bound(lev.begin(), lev.end(), labels[i]) - lev.begin();
+    size[z[i]]++;
+  }
+
+  std::vector<double> m((std::size_t) K*K, 0.0), s1(K*K, 0.0), s2(K*K, 0.0), f1(K*K, 0.0);
+  std::vector<double> strength(n, 0.0);
+  for(int j = 1; j < n; j++){
+    const double* col = W.begin() + (std::size_t) j*n;
+    int zj = z[j];
+    for(int i = 0; i < j; i++){
+      int zi = z[i];
+      int p = zi < zj ? zi + zj*K : zj + zi*K;
+      double r = col[i];
+      m[p] += 1;
+      s1[p] += r;
+      s2[p] += r*r;
+      f1[p] += wsbm::fisher(r);
+      if(zi == zj){
+        strength[i] += r;
+        strength[j] += r;
+      }
+    }
+  }
+
+  wsbm::Prior pr;
+  NumericMatrix n_pairs(K, K), mean_r(K, K), var_r(K, K), post_mean_r(K, K);
+  for(int kk = 0; kk < K; kk++){
+    for(int k = 0; k <= kk; k++){
+      int p = k + kk*K;
+      double mean = m[p] > 0 ? s1[p]/m[p] : NA_REAL;
+      double var = m[p] > 1 ? (s2[p] - s1[p]*s1[p]/m[p])/(m[p] - 1) : NA_REAL;
+      double post = wsbm::inv_fisher((f1[p] + pr.n0*pr.mu0)/(m[p] + pr.n0));
+      n_pairs(k, kk) = n_pairs(kk, k) = m[p];
+      mean_r(k, kk) = mean_r(kk, k) = mean;
+      var_r(k, kk) = var_r(kk, k) = var;
+      post_mean_r(k, kk) = post_mean_r(kk, k) = post;
+    }
+  }
+
+  // Top within-block hubs by strength
+  std::vector< std::vector<int> > members(K);
+  for(int i = 0; i < n; i++){
+    members[z[i]].push_back(i);
+  }
+  std::vector<int> hub_block, hub_taxon, hub_rank;
+  std::vector<double> hub_strength;
+  Rcpp::List member_list(K);
+  for(int k = 0; k < K; k++){
+    std::vector<int>& mem = members[k];
+    std::stable_sort(mem.begin(), mem.end(), [&strength](int a, int b){ return strength[a] > strength[b]; });
+    for(int h = 0; h < std::min(n_hubs, (int) mem.size()); h++){
+      hub_block.push_back(lev[k]);
+      hub_taxon.push_back(mem[h] + 1);
+      hub_rank.push_back(h + 1);
+      hub_strength.push_back(strength[mem[h]]);
+    }
+    IntegerVector mem_r(mem.size());
+    for(int i = 0; i < (int) mem.size(); i++){
+      mem_r[i] = mem[i] + 1;
+    }
+    member_list[k] = mem_r;
+  }
+
+  IntegerVector block_size(size.begin(), size.end()), block_label(lev.begin(), lev.end());
+  return Rcpp::List::create(Rcpp::Named("block") = block_label,
+                            Rcpp::Named("size") = block_size,
+                            Rcpp::Named("n_pairs") = n_pairs,
+                            Rcpp::Named("mean") = mean_r,
+                            Rcpp::Named("var") = var_r,
+                            Rcpp::Named("post_mean") = post_mean_r,
+                            Rcpp::Named("hubs") = DataFrame::create(Rcpp::Named("block") = wrap(hub_block),
+                                                                    Rcpp::Named("taxon") = wrap(hub_taxon),
+                                                                    Rcpp::Named("rank") = wrap(hub_rank),
+                                                                    Rcpp::Named("strength") = wrap(hub_strength)),
+                            Rcpp::Named("members") = member_list,
+                            Rcpp::Named("strength") = wrap(strength)
+  );
+}
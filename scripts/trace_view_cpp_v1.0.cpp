@@ -0,0 +1,294 @@
+// Lazy ALTREP views of a trace file written by auto_WSBM(..., opts = list(trace_file = ...))
+// z_store (draws x taxa), mu_store / var_store (K x K x draws), logpost and iter
+// are returned as ALTREP vectors that keep only the file open: an element access
+// decompresses the chunk holding that draw (a few recently used chunks are
+// cached), so subsets such as z_store[5000:5100, ] are read without loading the
+// trace. Operations that need the whole vector (e.g. modifying it) materialize it
+// once. Needs R >= 3.6 (ALTREP); older versions get an eager copy.
+// file = path of the finished trace file
+
+
+#include <Rcpp.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+#if R_VERSION >= R_Version(3, 6, 0)
+#define WSBM_HAS_ALTREP
+#include <R_ext/Altrep.h>
+#endif
+#include "wsbm_trace.h"
+
+#include <list>
+#include <memory>
+
+using namespace Rcpp;
+
+namespace {
+
+// Open trace file with a small LRU cache of decompressed chunks
+class TraceView {
+public:
+  explicit TraceView(const std::string& file) : reader(file) {}
+
+  wsbm::TraceReader reader;
+
+  const char* record(uint64_t r){
+    std::size_t c = r/reader.chunk_records();
+    const std::vector<char>& raw = chunk(c);
+    return &raw[(r % reader.chunk_records())*reader.record_bytes()];
+  }
+
+  const std::vector<char>& chunk(std::size_t c){
+    for(std::list< std::pair<std::size_t, std::vector<char> > >::iterator it = cache_.begin(); it != cache_.end(); ++it){
+      if(it->first == c){
+        cache_.splice(cache_.begin(), cache_, it);
+        return cache_.front().second;
+      }
+    }
+    cache_.push_front(std::make_pair(c, reader.chunk(c)));
+    if(cache_.size() > CACHE_CHUNKS) cache_.pop_back();
+    return cache_.front().second;
+  }
+
+private:
+  static const std::size_t CACHE_CHUNKS = 4;
+  std::list< std::pair<std::size_t, std::vector<char> > > cache_;
+};
+
+enum Field { Z, MU, VAR, LOGPOST, ITER };
+
+// One lazy vector: a field of the shared view
+struct FieldView {
+  std::shared_ptr<TraceView> view;
+  Field field;
+  R_xlen_t length;
+
+  uint64_t n_records() const { return view->reader.n_records(); }
+  uint64_t n() const { return view->reader.n(); }
+  uint64_t K() const { return view->reader.K(); }
+
+  // Value of element i in the R (column-major) layout
+  double value(R_xlen_t i){
+    wsbm::TraceReader& tr = view->reader;
+    switch(field){
+      case Z: {
+        uint64_t R = n_records();
+        return tr.z(view->record(i % R))[i/R];
+      }
+      case MU: case VAR: {
+        uint64_t K2 = K()*K(), cell = i % K2, k = cell % K(), kk = cell/K();
+        if(k > kk) return 0.0; // lower triangle, as in the in-memory stores
+        const char* rec = view->record(i/K2);
+        const double* tri = field == MU ? tr.mu(rec) : tr.Var(rec);
+        return tri[kk*(kk + 1)/2 + k];
+      }
+      case LOGPOST:
+        return tr.logpost(view->record(i));
+      default:
+        return (double) tr.iter(view->record(i));
+    }
+  }
+
+  // Fill the whole vector chunk by chunk (each chunk is decompressed once)
+  template <class T>
+  void fill(T* out){
+    wsbm::TraceReader& tr = view->reader;
+    uint64_t R = n_records(), K_ = K(), K2 = K_*K_;
+    uint64_t r = 0;
+    for(std::size_t c = 0; c < tr.n_chunks(); c++){
+      const std::vector<char>& raw = view->chunk(c);
+      for(std::size_t off = 0; off < raw.size() && r < R; off += tr.record_bytes(), r++){
+        const char* rec = &raw[off];
+        if(field == Z){
+          const int32_t* z = tr.z(rec);
+          for(uint64_t j = 0; j < n(); j++) out[r + j*R] = z[j];
+        }else if(field == MU || field == VAR){
+          const double* tri = field == MU ? tr.mu(rec) : tr.Var(rec);
+          T* slice = out + r*K2;
+          for(uint64_t kk = 0; kk < K_; kk++){
+            for(uint64_t k = 0; k < K_; k++){
+              slice[k + kk*K_] = k <= kk ? *tri++ : 0;
+            }
+          }
+        }else{
+          out[r] = field == LOGPOST ? tr.logpost(rec) : tr.iter(rec);
+        }
+      }
+    }
+  }
+};
+
+// C callbacks must not let C++ exceptions escape: errors are re-raised with Rf_error
+char err_buf[512];
+
+#ifdef WSBM_HAS_ALTREP
+
+R_altrep_class_t int_class, real_class;
+
+FieldView* field_view(SEXP x){
+  return static_cast<FieldView*>(R_ExternalPtrAddr(R_altrep_data1(x)));
+}
+
+R_xlen_t view_length(SEXP x){
+  return field_view(x)->length;
+}
+
+void* data_ptr(SEXP data){
+  return TYPEOF(data) == INTSXP ? (void*) INTEGER(data) : (void*) REAL(data);
+}
+
+Rboolean view_inspect(SEXP x, int, int, int, void (*)(SEXP, int, int, int)){
+  Rprintf("wsbm trace view (%s)\n", R_altrep_data2(x) == R_NilValue ? "lazy" : "materialized");
+  return TRUE;
+}
+
+SEXP materialize(SEXP x){
+  SEXP data = R_altrep_data2(x);
+  if(data != R_NilValue) return data;
+  FieldView* fv = field_view(x);
+  bool is_int = fv->field == Z;
+  PROTECT(data = Rf_allocVector(is_int ? INTSXP : REALSXP, fv->length));
+  bool ok = true;
+  try{
+    if(is_int) fv->fill(INTEGER(data));
+    else fv->fill(REAL(data));
+  }catch(std::exception& e){
+    std::snprintf(err_buf, sizeof(err_buf), "%s", e.what());
+    ok = false;
+  }
+  if(!ok){
+    UNPROTECT(1);
+    Rf_error("%s", err_buf);
+  }
+  R_set_altrep_data2(x, data);
+  UNPROTECT(1);
+  return data;
+}
+
+void* view_dataptr(SEXP x, Rboolean){
+  return data_ptr(materialize(x));
+}
+
+const void* view_dataptr_or_null(SEXP x){
+  SEXP data = R_altrep_data2(x);
+  return data == R_NilValue ? NULL : data_ptr(data);
+}
+
+template <class T>
+R_xlen_t view_region(SEXP x, R_xlen_t start, R_xlen_t size, T* buf){
+  SEXP data = R_altrep_data2(x);
+  R_xlen_t len = view_length(x), m = std::min(size, len - start);
+  bool ok = true;
+  if(data != R_NilValue){
+    const T* src = static_cast<const T*>(data_ptr(data));
+    std::copy(src + start, src + start + m, buf);
+    return m;
+  }
+  try{
+    FieldView* fv = field_view(x);
+    for(R_xlen_t i = 0; i < m; i++){
+      buf[i] = (T) fv->value(start + i);
+    }
+  }catch(std::exception& e){
+    std::snprintf(err_buf, sizeof(err_buf), "%s", e.what());
+    ok = false;
+  }
+  if(!ok) Rf_error("%s", err_buf);
+  return m;
+}
+
+int view_int_elt(SEXP x, R_xlen_t i){
+  int v;
+  view_region<int>(x, i, 1, &v);
+  return v;
+}
+
+double view_real_elt(SEXP x, R_xlen_t i){
+  double v;
+  view_region<double>(x, i, 1, &v);
+  return v;
+}
+
+R_xlen_t view_int_region(SEXP x, R_xlen_t start, R_xlen_t size, int* buf){
+  return view_region<int>(x, start, size, buf);
+}
+
+R_xlen_t view_real_region(SEXP x, R_xlen_t start, R_xlen_t size, double* buf){
+  return view_region<double>(x, start, size, buf);
+}
+
+void register_classes(){
+  static bool registered = false;
+  if(registered) return;
+  DllInfo* dll = R_getEmbeddingDllInfo();
+
+  int_class = R_make_altinteger_class("wsbm_trace_int", "wsbm", dll);
+  R_set_altrep_Length_method(int_class, view_length);
+  R_set_altrep_Inspect_method(int_class, view_inspect);
+  R_set_altvec_Dataptr_method(int_class, view_dataptr);
+  R_set_altvec_Dataptr_or_null_method(int_class, view_dataptr_or_null);
+  R_set_altinteger_Elt_method(int_class, view_int_elt);
+  R_set_altinteger_Get_region_method(int_class, view_int_region);
+
+  real_class = R_make_altreal_class("wsbm_trace_real", "wsbm", dll);
+  R_set_altrep_Length_method(real_class, view_length);
+  R_set_altrep_Inspect_method(real_class, view_inspect);
+  R_set_altvec_Dataptr_method(real_class, view_dataptr);
+  R_set_altvec_Dataptr_or_null_method(real_class, view_dataptr_or_null);
+  R_set_altreal_Elt_method(real_class, view_real_elt);
+  R_set_altreal_Get_region_method(real_class, view_real_region);
+
+  registered = true;
+}
+
+SEXP make_view(const std::shared_ptr<TraceView>& view, Field field, R_xlen_t length){
+  Rcpp::XPtr<FieldView> ptr(new FieldView{view, field, length}, true);
+  return R_new_altrep(field == Z ? int_class : real_class, ptr, R_NilValue);
+}
+
+#else
+
+// No ALTREP: eager copy through the same chunk-wise fill
+SEXP make_view(const std::shared_ptr<TraceView>& view, Field field, R_xlen_t length){
+  FieldView fv{view, field, length};
+  if(field == Z){
+    IntegerVector out(length);
+    fv.fill(out.begin());
+    return out;
+  }
+  NumericVector out(length);
+  fv.fill(out.begin());
+  return out;
+}
+
+#endif
+
+} // namespace
+
+// [[Rcpp::export]]
+Rcpp::List read_WSBM_trace_lazy(std::string file) {
+
+  std::shared_ptr<TraceView> view;
+  try{
+    view = std::make_shared<TraceView>(file);
+  }catch(std::exception& e){
+    stop(e.what());
+  }
+#ifdef WSBM_HAS_ALTREP
+  register_classes();
+#endif
+
+  R_xlen_t R = view->reader.n_records(), n = view->reader.n(), K = view->reader.K();
+  RObject z_store = make_view(view, Z, R*n);
+  z_store.attr("dim") = IntegerVector::create(R, n);
+  RObject mu_store = make_view(view, MU, K*K*R);
+  mu_store.attr("dim") = IntegerVector::create(K, K, R);
+  RObject var_store = make_view(view, VAR, K*K*R);
+  var_store.attr("dim") = IntegerVector::create(K, K, R);
+
+  return Rcpp::List::create(Rcpp::Named("iter") = make_view(view, ITER, R),
+                            Rcpp::Named("z_store") = z_store,
+                            Rcpp::Named("mu_store") = mu_store,
+                            Rcpp::Named("var_store") = var_store,
+                            Rcpp::Named("logpost") = make_view(view, LOGPOST, R)
+  );
+}
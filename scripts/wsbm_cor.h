@@ -0,0 +1,389 @@
+// Native count -> correlation pipeline (compositional / CLR / MCLR transforms,
+// pearson / spearman / kendall correlation), mirroring count_to_cor and the
+// MCLR path of WSBM_wrapper in functions.R.
+//
+// CorStream keeps running moments so that new samples (rows of the count
+// table) are applied as incremental updates (pearson, kendall):
+//   pearson  : sums of x, x x^T over samples. MCLR values are y + eps*d with
+//              d = 1{count > 0} and eps depending on all samples, so the sums of
+//              y, d, y y^T, y d^T, d d^T are kept and combined for the current eps.
+//   spearman : not incremental. A new value shifts the ranks of O(N) stored
+//              samples of its taxon, so updating rank moments costs as much as
+//              recomputing them. Only the per-taxon sorted values are kept; every
+//              cor() call looks up all ranks (O(N p log N)) and recomputes the
+//              Pearson correlation of the ranks (O(N p^2)). Add samples in
+//              batches and call cor() once per batch.
+//   kendall  : concordance sums S_ij = sum_{s < t} sgn(x_si - x_ti) sgn(x_sj - x_tj)
+//              and per-taxon tie counts; a new sample adds its signs against
+//              the stored samples, O(N p^2) instead of O(N^2 p^2).
+//
+// Matrices are column-major. Pure C++ (no R API). count_cor / count_W_f record
+// their transform, correlation and fisher stages on an optional timeline
+// (wsbm_timeline.h).
+
+#ifndef WSBM_COR_H
+#define WSBM_COR_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "wsbm_timeline.h"
+
+namespace wsbm {
+
+enum Transform { TRANSFORM_NONE, TRANSFORM_CLR, TRANSFORM_MCLR };
+enum CorMethod { COR_PEARSON, COR_SPEARMAN, COR_KENDALL };
+
+inline Transform parse_transform(const std::string& s){
+  if(s == "none") return TRANSFORM_NONE;
+  if(s == "CLR") return TRANSFORM_CLR;
+  if(s == "MCLR") return TRANSFORM_MCLR;
+  throw std::invalid_argument("transform must be one of 'none', 'CLR', 'MCLR'");
+}
+
+inline CorMethod parse_cor(const std::string& s){
+  if(s == "pearson") return COR_PEARSON;
+  if(s == "spearman") return COR_SPEARMAN;
+  if(s == "kendall") return COR_KENDALL;
+  throw std::invalid_argument("cor must be one of 'pearson', 'spearman', 'kendall'");
+}
+
+// Taxa with a proportion of positive counts >= min_prev (filtration step)
+inline std::vector<int> filter_taxa(const double* counts, int N, int p, double min_prev = 0.05){
+  std::vector<int> keep;
+  for(int j = 0; j < p; j++){
+    int pos = 0;
+    for(int s = 0; s < N; s++){
+      pos += counts[s + (std::size_t) j*N] > 0;
+    }
+    if(pos >= min_prev*N) keep.push_back(j);
+  }
+  return keep;
+}
+
+// Transform one sample (p counts). For MCLR the output is the centred log of the
+// non-zero counts before the eps shift, and d marks the non-zero entries.
+inline void transform_row(const double* x, int p, Transform tr, double* y, double* d){
+  double rs = 0.0;
+  for(int j = 0; j < p; j++) rs += x[j];
+  if(tr == TRANSFORM_NONE){
+    for(int j = 0; j < p; j++){
+      y[j] = x[j]/rs;
+      d[j] = 0.0;
+    }
+  }else if(tr == TRANSFORM_CLR){
+    // pseudocount 1e-7 on the proportions, as in count_to_cor
+    double lg = 0.0;
+    for(int j = 0; j < p; j++){
+      y[j] = std::log(x[j]/rs + 1e-7);
+      lg += y[j];
+    }
+    lg /= p;
+    for(int j = 0; j < p; j++){
+      y[j] -= lg;
+      d[j] = 0.0;
+    }
+  }else{
+    // SPRING::mclr: log counts centred by the mean over non-zero entries
+    double lg = 0.0;
+    int nz = 0;
+    for(int j = 0; j < p; j++){
+      if(x[j] > 0){
+        lg += std::log(x[j]);
+        nz++;
+      }
+    }
+    lg = nz > 0 ? lg/nz : 0.0;
+    for(int j = 0; j < p; j++){
+      d[j] = x[j] > 0 ? 1.0 : 0.0;
+      y[j] = x[j] > 0 ? std::log(x[j]) - lg : 0.0;
+    }
+  }
+}
+
+// Pearson correlation of the columns of an N x p matrix
+inline void pearson_cor(const double* X, int N, int p, double* R){
+  std::vector<double> Xc((std::size_t) N*p), sd(p);
+  for(int j = 0; j < p; j++){
+    double m = 0.0;
+    for(int s = 0; s < N; s++) m += X[s + (std::size_t) j*N];
+    m /= N;
+    double ss = 0.0;
+    for(int s = 0; s < N; s++){
+      double v = X[s + (std::size_t) j*N] - m;
+      Xc[s + (std::size_t) j*N] = v;
+      ss += v*v;
+    }
+    sd[j] = std::sqrt(ss);
+  }
+  for(int j = 0; j < p; j++){
+    for(int i = 0; i <= j; i++){
+      double c = 0.0;
+      const double* xi = &Xc[(std::size_t) i*N];
+      const double* xj = &Xc[(std::size_t) j*N];
+      for(int s = 0; s < N; s++) c += xi[s]*xj[s];
+      double r = c/(sd[i]*sd[j]);
+      R[i + (std::size_t) j*p] = r;
+      R[j + (std::size_t) i*p] = r;
+    }
+  }
+}
+
+// Average ranks (ties share the mean rank) of one column of length N
+inline void rank_avg(const double* x, int N, double* r){
+  std::vector<int> idx(N);
+  for(int s = 0; s < N; s++) idx[s] = s;
+  std::sort(idx.begin(), idx.end(), [x](int a, int b){ return x[a] < x[b]; });
+  int s = 0;
+  while(s < N){
+    int t = s;
+    while(t + 1 < N && x[idx[t + 1]] == x[idx[s]]) t++;
+    double avg = 0.5*(s + t) + 1.0;
+    for(int u = s; u <= t; u++) r[idx[u]] = avg;
+    s = t + 1;
+  }
+}
+
+// Sign of a difference; -Inf - (-Inf) (tied MCLR zeros) is NaN and counts as a tie
+inline int sgn(double v){
+  return (v > 0) - (v < 0);
+}
+
+// Kendall's tau-b (as R's cor(method = "kendall")) of the columns of an N x p matrix
+inline void kendall_cor(const double* X, int N, int p, double* R){
+  std::vector<double> S((std::size_t) p*p, 0.0), ties(p, 0.0);
+  std::vector<int> g(p);
+  for(int t = 1; t < N; t++){
+    for(int s = 0; s < t; s++){
+      for(int j = 0; j < p; j++){
+        g[j] = sgn(X[t + (std::size_t) j*N] - X[s + (std::size_t) j*N]);
+        ties[j] += g[j] == 0;
+      }
+      for(int j = 0; j < p; j++){
+        if(g[j] == 0) continue;
+        for(int i = 0; i <= j; i++) S[i + (std::size_t) j*p] += g[i]*g[j];
+      }
+    }
+  }
+  double n0 = 0.5*N*(N - 1.0);
+  for(int j = 0; j < p; j++){
+    for(int i = 0; i <= j; i++){
+      double r = S[i + (std::size_t) j*p]/std::sqrt((n0 - ties[i])*(n0 - ties[j]));
+      R[i + (std::size_t) j*p] = r;
+      R[j + (std::size_t) i*p] = r;
+    }
+  }
+}
+
+// Transformed N x p data for the MCLR / CLR / compositional settings
+inline std::vector<double> transform_counts(const double* counts, int N, int p, Transform tr){
+  std::vector<double> X((std::size_t) N*p), x(p), y(p), d(p);
+  double y_min = 0.0;
+  for(int s = 0; s < N; s++){
+    for(int j = 0; j < p; j++) x[j] = counts[s + (std::size_t) j*N];
+    transform_row(x.data(), p, tr, y.data(), d.data());
+    for(int j = 0; j < p; j++){
+      X[s + (std::size_t) j*N] = y[j];
+      y_min = std::min(y_min, y[j]);
+    }
+  }
+  if(tr == TRANSFORM_MCLR){
+    double eps = 1.0 - y_min; // shift non-zero entries to >= 1 (atleast = 1)
+    for(int j = 0; j < p; j++){
+      for(int s = 0; s < N; s++){
+        if(counts[s + (std::size_t) j*N] > 0) X[s + (std::size_t) j*N] += eps;
+      }
+    }
+  }
+  return X;
+}
+
+// Value used for ranks and signs of a transformed entry. Values equal up to
+// rounding error (e.g. the same counts in another order) are treated as ties,
+// and with MCLR zeros stay below every non-zero entry whatever eps is.
+inline double rank_key(double y, double d, Transform tr){
+  if(tr == TRANSFORM_MCLR && d == 0) return -std::numeric_limits<double>::infinity();
+  return std::round(y*1e10)/1e10;
+}
+
+// N x p matrix of rank keys of a count table
+inline std::vector<double> rank_values(const double* counts, int N, int p, Transform tr){
+  std::vector<double> X((std::size_t) N*p), x(p), y(p), d(p);
+  for(int s = 0; s < N; s++){
+    for(int j = 0; j < p; j++) x[j] = counts[s + (std::size_t) j*N];
+    transform_row(x.data(), p, tr, y.data(), d.data());
+    for(int j = 0; j < p; j++) X[s + (std::size_t) j*N] = rank_key(y[j], d[j], tr);
+  }
+  return X;
+}
+
+// Correlation matrix (diagonal set to 0) of an N x p count table over all its columns
+inline std::vector<double> count_cor(const double* counts, int N, int p, Transform tr, CorMethod method,
+                                     Timeline* tl = NULL){
+  Laps laps(tl, "preprocess");
+  std::vector<double> X = method == COR_PEARSON ? transform_counts(counts, N, p, tr) : rank_values(counts, N, p, tr);
+  laps.lap(tr == TRANSFORM_MCLR ? "MCLR" : tr == TRANSFORM_CLR ? "CLR" : "transform");
+  std::vector<double> R((std::size_t) p*p);
+  if(method == COR_PEARSON){
+    pearson_cor(X.data(), N, p, R.data());
+  }else if(method == COR_SPEARMAN){
+    std::vector<double> Rk((std::size_t) N*p);
+    for(int j = 0; j < p; j++) rank_avg(&X[(std::size_t) j*N], N, &Rk[(std::size_t) j*N]);
+    pearson_cor(Rk.data(), N, p, R.data());
+  }else{
+    kendall_cor(X.data(), N, p, R.data());
+  }
+  for(int j = 0; j < p; j++) R[j + (std::size_t) j*p] = 0.0;
+  laps.lap("correlation");
+  return R;
+}
+
+// Fisher-transformed correlation matrix of a count table, as used by the samplers.
+// Taxa that are constant in the table (NaN correlations) get 0 and |r| is kept
+// below 1 so the transformation is finite.
+inline std::vector<double> count_W_f(const double* counts, int N, int p, Transform tr, CorMethod method,
+                                     Timeline* tl = NULL){
+  std::vector<double> W_f = count_cor(counts, N, p, tr, method, tl);
+  Span span(tl, "fisher", "preprocess");
+  for(double& w : W_f){
+    if(std::isnan(w)) w = 0.0;
+    w = std::max(-1 + 1e-6, std::min(1 - 1e-6, w));
+    w = 0.5 * std::log((1 + w)/(1 - w));
+  }
+  return W_f;
+}
+
+class CorStream {
+public:
+  CorStream(int p, Transform tr, CorMethod method)
+    : p_(p), N_(0), tr_(tr), method_(method), y_min_(0.0),
+      Sy_(p, 0.0), Sd_(p, 0.0), ties_(p, 0.0), sorted_(p) {
+    if(method_ == COR_PEARSON){
+      Syy_.assign((std::size_t) p*p, 0.0);
+      if(tr_ == TRANSFORM_MCLR){
+        Syd_.assign((std::size_t) p*p, 0.0);
+        Sdd_.assign((std::size_t) p*p, 0.0);
+      }
+    }else if(method_ == COR_KENDALL){
+      S_.assign((std::size_t) p*p, 0.0);
+    }
+  }
+
+  int n_samples() const { return N_; }
+  int n_taxa() const { return p_; }
+
+  // Add one sample of p counts
+  void add(const double* x){
+    std::vector<double> y(p_), d(p_);
+    transform_row(x, p_, tr_, y.data(), d.data());
+    for(int j = 0; j < p_; j++) y_min_ = std::min(y_min_, y[j]);
+
+    if(method_ == COR_PEARSON){
+      for(int j = 0; j < p_; j++){
+        Sy_[j] += y[j];
+        Sd_[j] += d[j];
+        for(int i = 0; i <= j; i++){
+          Syy_[i + (std::size_t) j*p_] += y[i]*y[j];
+        }
+      }
+      if(tr_ == TRANSFORM_MCLR){
+        for(int j = 0; j < p_; j++){
+          for(int i = 0; i < p_; i++) Syd_[i + (std::size_t) j*p_] += y[i]*d[j];
+          for(int i = 0; i <= j; i++) Sdd_[i + (std::size_t) j*p_] += d[i]*d[j];
+        }
+      }
+    }else{
+      // Ranks and signs need the stored values (rank keys do not depend on eps)
+      std::vector<double> v(p_);
+      for(int j = 0; j < p_; j++) v[j] = rank_key(y[j], d[j], tr_);
+      if(method_ == COR_KENDALL){
+        std::vector<int> g(p_);
+        for(int s = 0; s < N_; s++){
+          for(int j = 0; j < p_; j++){
+            g[j] = sgn(v[j] - X_[j][s]);
+            ties_[j] += g[j] == 0;
+          }
+          for(int j = 0; j < p_; j++){
+            if(g[j] == 0) continue;
+            for(int i = 0; i <= j; i++) S_[i + (std::size_t) j*p_] += g[i]*g[j];
+          }
+        }
+      }else{
+        for(int j = 0; j < p_; j++){
+          sorted_[j].insert(std::upper_bound(sorted_[j].begin(), sorted_[j].end(), v[j]), v[j]);
+        }
+      }
+      if((int) X_.size() < p_) X_.resize(p_);
+      for(int j = 0; j < p_; j++) X_[j].push_back(v[j]);
+    }
+    N_++;
+  }
+
+  // Current correlation matrix (p x p, diagonal 0)
+  std::vector<double> cor() const {
+    std::vector<double> R((std::size_t) p_*p_, 0.0);
+    if(N_ < 2) return R;
+    if(method_ == COR_PEARSON){
+      double eps = tr_ == TRANSFORM_MCLR ? 1.0 - y_min_ : 0.0;
+      std::vector<double> m(p_), C((std::size_t) p_*p_);
+      for(int j = 0; j < p_; j++) m[j] = (Sy_[j] + eps*Sd_[j])/N_;
+      for(int j = 0; j < p_; j++){
+        for(int i = 0; i <= j; i++){
+          double s = Syy_[i + (std::size_t) j*p_];
+          if(tr_ == TRANSFORM_MCLR){
+            s += eps*(Syd_[i + (std::size_t) j*p_] + Syd_[j + (std::size_t) i*p_])
+              + eps*eps*Sdd_[i + (std::size_t) j*p_];
+          }
+          C[i + (std::size_t) j*p_] = s/N_ - m[i]*m[j];
+        }
+      }
+      for(int j = 0; j < p_; j++){
+        for(int i = 0; i < j; i++){
+          double r = C[i + (std::size_t) j*p_]/std::sqrt(C[i + (std::size_t) i*p_]*C[j + (std::size_t) j*p_]);
+          R[i + (std::size_t) j*p_] = r;
+          R[j + (std::size_t) i*p_] = r;
+        }
+      }
+    }else if(method_ == COR_SPEARMAN){
+      // Full recompute from the rank structure (see the file comment)
+      std::vector<double> Rk((std::size_t) N_*p_);
+      for(int j = 0; j < p_; j++){
+        const std::vector<double>& srt = sorted_[j];
+        for(int s = 0; s < N_; s++){
+          auto range = std::equal_range(srt.begin(), srt.end(), X_[j][s]);
+          Rk[s + (std::size_t) j*N_] = 0.5*((range.first - srt.begin()) + (range.second - srt.begin()) + 1.0);
+        }
+      }
+      pearson_cor(Rk.data(), N_, p_, R.data());
+    }else{
+      double n0 = 0.5*N_*(N_ - 1.0);
+      for(int j = 0; j < p_; j++){
+        for(int i = 0; i < j; i++){
+          double r = S_[i + (std::size_t) j*p_]/std::sqrt((n0 - ties_[i])*(n0 - ties_[j]));
+          R[i + (std::size_t) j*p_] = r;
+          R[j + (std::size_t) i*p_] = r;
+        }
+      }
+    }
+    for(int j = 0; j < p_; j++) R[j + (std::size_t) j*p_] = 0.0;
+    return R;
+  }
+
+private:
+  int p_, N_;
+  Transform tr_;
+  CorMethod method_;
+  double y_min_;
+  std::vector<double> Sy_, Sd_, Syy_, Syd_, Sdd_;  // pearson moments
+  std::vector<double> S_, ties_;                   // kendall concordance
+  std::vector< std::vector<double> > sorted_;      // spearman rank structure
+  std::vector< std::vector<double> > X_;           // stored values (rank methods)
+};
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,626 @@
+// Local WSBM job daemon (POSIX)
+// A long-lived process listening on a Unix socket that runs fits with the
+// thread-safe engine (wsbm_engine.h), so analyses skip R start-up, sourceCpp
+// compilation and reloading / Fisher-transforming W. Recently used W_f matrices
+// stay resident (LRU, size cap) and are addressed by a content key (WSBM_hash).
+// Jobs wait in a priority queue and each runs with its own thread budget (one
+// thread per chain); progress and the result are streamed back to the client.
+//
+// Build: g++ -O2 -std=c++17 -pthread -I scripts scripts/wsbm_daemon.cpp -o scripts/wsbm_daemon
+// Usage:
+//   wsbm_daemon serve [--socket PATH] [--threads N] [--cache-mb MB]
+//   wsbm_daemon has   [--socket PATH] KEY
+//   wsbm_daemon fit   [--socket PATH] --key KEY [--W FILE] --out FILE [--priority P] [--threads T]
+//                     [--K_max K] [--eta0 E] [--iter I] [--burn B] [--seed S] [--chains C]
+//   wsbm_daemon stop  [--socket PATH]
+// The default socket is $XDG_RUNTIME_DIR/wsbm.sock, or /tmp/wsbm-<uid>/wsbm.sock in a
+// directory of mode 0700. The socket is created with mode 0600 and connections from
+// other users are refused (SO_PEERCRED), so only the owner can submit jobs or STOP
+// the daemon. serve refuses to start on a path it does not own, or where a daemon is
+// already listening, and only removes a stale socket of its own user. stop waits for
+// the running and queued jobs to finish.
+// W FILE = n x n correlation matrix as raw doubles (column-major, e.g. writeBin(as.double(W), f)),
+// only read when KEY is not resident. OUT FILE = int32 n, int32 n_retained, int32 z_hat[n]
+// (1-based), double ppm[n x n].
+//
+// Protocol (one request per connection, tab-separated key=value fields):
+//   client: "FIT\tkey=...\tW=...\tpriority=...\t...\n" | "HAS\tkey=...\n" | "STOP\n"
+//   daemon: "QUEUED <position>", "STARTED <wait s>", "CHAIN <c> K=<K_hat> s=<seconds>",
+//           "RESULT <n> <n_retained>" + binary z_hat / ppm, "DONE <seconds>" | "ERROR <msg>"
+// FIT fields are checked before the job is queued (K_max in [2, 1000], 0 <= burn < iter,
+// eta0 > 0, at most 1024 chains / threads); a chain that fails ends the job with ERROR.
+
+
+#include "wsbm_engine.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <csignal>
+#include <cerrno>
+#include <unistd.h>
+
+#include <atomic>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point t0){
+  return std::chrono::duration<double>(Clock::now() - t0).count();
+}
+
+// Buffered line / binary I/O over a connected socket
+class Conn {
+public:
+  explicit Conn(int fd) : fd_(fd) {}
+  ~Conn(){ ::close(fd_); }
+
+  bool read_line(std::string& line){
+    line.clear();
+    while(true){
+      std::size_t nl = buf_.find('\n');
+      if(nl != std::string::npos){
+        line = buf_.substr(0, nl);
+        buf_.erase(0, nl + 1);
+        return true;
+      }
+      if(!fill()) return false;
+    }
+  }
+
+  bool read_exact(void* out, std::size_t len){
+    char* p = static_cast<char*>(out);
+    while(len > 0){
+      if(buf_.empty() && !fill()) return false;
+      std::size_t m = std::min(len, buf_.size());
+      std::memcpy(p, buf_.data(), m);
+      buf_.erase(0, m);
+      p += m;
+      len -= m;
+    }
+    return true;
+  }
+
+  bool write(const void* data, std::size_t len){
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    const char* p = static_cast<const char*>(data);
+    while(len > 0){
+      ssize_t m = ::send(fd_, p, len, 0);
+      if(m <= 0) return false;
+      p += m;
+      len -= m;
+    }
+    return true;
+  }
+
+  bool write_line(const std::string& s){
+    std::string line = s + "\n";
+    return write(line.data(), line.size());
+  }
+
+private:
+  int fd_;
+  std::string buf_;
+  std::mutex write_mutex_;
+
+  bool fill(){
+    char tmp[65536];
+    ssize_t m = ::recv(fd_, tmp, sizeof(tmp), 0);
+    if(m <= 0) return false;
+    buf_.append(tmp, m);
+    return true;
+  }
+};
+
+std::map<std::string, std::string> parse_fields(const std::string& line){
+  std::map<std::string, std::string> f;
+  std::stringstream ss(line);
+  std::string tok;
+  bool first = true;
+  while(std::getline(ss, tok, '\t')){
+    if(first){
+      f["cmd"] = tok;
+      first = false;
+      continue;
+    }
+    std::size_t eq = tok.find('=');
+    if(eq != std::string::npos) f[tok.substr(0, eq)] = tok.substr(eq + 1);
+  }
+  return f;
+}
+
+std::string field(const std::map<std::string, std::string>& f, const std::string& key, const std::string& def){
+  std::map<std::string, std::string>::const_iterator it = f.find(key);
+  return it == f.end() || it->second.empty() ? def : it->second;
+}
+
+// Whole-number field in [lo, hi]; anything else is refused before the job is queued
+long long int_field(const std::map<std::string, std::string>& f, const std::string& key, const std::string& def,
+                    long long lo, long long hi){
+  std::string v = field(f, key, def);
+  char* end = NULL;
+  errno = 0;
+  long long x = std::strtoll(v.c_str(), &end, 10);
+  if(errno != 0 || end == v.c_str() || *end != '\0' || x < lo || x > hi){
+    throw std::runtime_error(key + " must be an integer in [" + std::to_string(lo) + ", " + std::to_string(hi) + "]");
+  }
+  return x;
+}
+
+// Resident Fisher-transformed matrices, least recently used evicted beyond the cap
+class MatrixCache {
+public:
+  struct Entry {
+    int n;
+    std::vector<double> W_f;
+  };
+
+  explicit MatrixCache(std::size_t max_bytes) : max_bytes_(max_bytes), bytes_(0) {}
+
+  std::shared_ptr<const Entry> get(const std::string& key){
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, Item>::iterator it = items_.find(key);
+    if(it == items_.end()) return std::shared_ptr<const Entry>();
+    lru_.splice(lru_.begin(), lru_, it->second.pos);
+    return it->second.entry;
+  }
+
+  std::shared_ptr<const Entry> load(const std::string& key, const std::string& file){
+    std::shared_ptr<const Entry> hit = get(key);
+    if(hit) return hit;
+
+    std::ifstream in(file.c_str(), std::ios::binary | std::ios::ate);
+    if(!in) throw std::runtime_error("cannot read W file " + file);
+    std::size_t bytes = in.tellg();
+    int n = (int) std::llround(std::sqrt(bytes/8.0));
+    if((std::size_t) n*n*8 != bytes || n < 2) throw std::runtime_error("W file is not an n x n double matrix");
+    std::shared_ptr<Entry> e = std::make_shared<Entry>();
+    e->n = n;
+    e->W_f.resize((std::size_t) n*n);
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(e->W_f.data()), bytes);
+    wsbm::fisher(e->W_f.data(), e->W_f.data(), e->W_f.size());
+    for(int i = 0; i < n; i++){
+      e->W_f[i + (std::size_t) i*n] = 0.0;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if(items_.count(key) == 0){
+      lru_.push_front(key);
+      items_[key] = Item{e, lru_.begin()};
+      bytes_ += bytes;
+      while(bytes_ > max_bytes_ && lru_.size() > 1){
+        std::map<std::string, Item>::iterator old = items_.find(lru_.back());
+        bytes_ -= old->second.entry->W_f.size()*sizeof(double);
+        items_.erase(old);
+        lru_.pop_back();
+      }
+    }
+    return e;
+  }
+
+private:
+  struct Item {
+    std::shared_ptr<const Entry> entry;
+    std::list<std::string>::iterator pos;
+  };
+  std::size_t max_bytes_, bytes_;
+  std::mutex mutex_;
+  std::list<std::string> lru_;
+  std::map<std::string, Item> items_;
+};
+
+// Priority queue over the daemon's thread budget: a job starts when it is the
+// highest-priority waiting job (FIFO among equal priorities) and its threads are free
+class Scheduler {
+public:
+  explicit Scheduler(int threads) : free_(threads), total_(threads), next_(0) {}
+
+  int total() const { return total_; }
+
+  // Returns the queue position on entry, blocks until the job may start
+  int acquire(int priority, int threads, const std::function<void(int)>& on_queued){
+    std::unique_lock<std::mutex> lock(mutex_);
+    Ticket t{-priority, next_++};
+    waiting_.insert(t);
+    int position = std::distance(waiting_.begin(), waiting_.find(t));
+    on_queued(position);
+    cv_.wait(lock, [&]{ return *waiting_.begin() == t && free_ >= threads; });
+    waiting_.erase(t);
+    free_ -= threads;
+    cv_.notify_all();
+    return position;
+  }
+
+  void release(int threads){
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_ += threads;
+    cv_.notify_all();
+  }
+
+  // Threads of a started job, given back when the lease leaves scope (also on a throw)
+  class Lease {
+  public:
+    Lease(Scheduler& s, int threads) : s_(s), threads_(threads) {}
+    ~Lease(){ s_.release(threads_); }
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+  private:
+    Scheduler& s_;
+    int threads_;
+  };
+
+private:
+  struct Ticket {
+    int neg_priority;
+    uint64_t seq;
+    bool operator<(const Ticket& o) const {
+      return neg_priority < o.neg_priority || (neg_priority == o.neg_priority && seq < o.seq);
+    }
+    bool operator==(const Ticket& o) const { return seq == o.seq; }
+  };
+  int free_, total_;
+  uint64_t next_;
+  std::set<Ticket> waiting_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+struct Daemon {
+  MatrixCache cache;
+  Scheduler scheduler;
+  int listen_fd = -1;
+  std::atomic<bool> stopping{false};
+  // Connection handlers still running; serve waits for them before Daemon is destroyed
+  int active = 0;
+  std::mutex active_m;
+  std::condition_variable active_cv;
+
+  Daemon(int threads, std::size_t cache_bytes) : cache(cache_bytes), scheduler(threads) {}
+
+  void run_fit(Conn& c, const std::map<std::string, std::string>& f){
+    Clock::time_point t0 = Clock::now();
+    std::string key = field(f, "key", "");
+    if(key.empty()) throw std::runtime_error("missing key");
+    std::shared_ptr<const MatrixCache::Entry> W = cache.get(key);
+    if(!W){
+      std::string file = field(f, "W", "");
+      if(file.empty()) throw std::runtime_error("key not resident and no W file given");
+      W = cache.load(key, file);
+    }
+
+    // Every field is checked before the job takes threads from the budget
+    wsbm::Settings s;
+    s.K_max = int_field(f, "K_max", "20", 2, 1000);
+    std::string eta0 = field(f, "eta0", "0.1");
+    char* end = NULL;
+    s.eta0 = std::strtod(eta0.c_str(), &end);
+    if(end == eta0.c_str() || *end != '\0' || !std::isfinite(s.eta0) || s.eta0 <= 0){
+      throw std::runtime_error("eta0 must be a positive number");
+    }
+    s.iter = int_field(f, "iter", "10000", 1, 100000000);
+    s.burn = int_field(f, "burn", "5000", 0, s.iter - 1);
+    s.seed = int_field(f, "seed", "1", 0, std::numeric_limits<long long>::max());
+    int chains = int_field(f, "chains", "1", 1, 1024);
+    int threads = int_field(f, "threads", "1", 1, 1024);
+    threads = std::min(std::min(threads, scheduler.total()), chains);
+    int priority = int_field(f, "priority", "0", -1000000, 1000000);
+    int n = W->n;
+    wsbm::check_settings(n, s);
+
+    scheduler.acquire(priority, threads, [&](int pos){ c.write_line("QUEUED " + std::to_string(pos)); });
+    Scheduler::Lease lease(scheduler, threads);
+    c.write_line("STARTED " + std::to_string(seconds_since(t0)));
+
+    // Chains on the job's threads, each with its own RNG stream (seed, chain). A chain
+    // that throws (e.g. bad_alloc) stops the job and is reported as ERROR, since an
+    // exception leaving a std::thread would terminate the daemon
+    std::vector<wsbm::Fit> fits(chains);
+    std::atomic<int> next_chain(0);
+    std::exception_ptr error;
+    std::mutex error_m;
+    std::vector<std::thread> pool;
+    for(int t = 0; t < threads; t++){
+      pool.emplace_back([&]{
+        for(int ch = next_chain++; ch < chains; ch = next_chain++){
+          try{
+            Clock::time_point tc = Clock::now();
+            wsbm::Settings sc = s;
+            sc.chain = ch;
+            fits[ch] = wsbm::fit(W->W_f.data(), n, sc);
+            int K_hat = *std::max_element(fits[ch].z_hat.begin(), fits[ch].z_hat.end()) + 1;
+            c.write_line("CHAIN " + std::to_string(ch) + " K=" + std::to_string(K_hat) +
+                         " s=" + std::to_string(seconds_since(tc)));
+          }catch(...){
+            std::lock_guard<std::mutex> lock(error_m);
+            if(!error) error = std::current_exception();
+            next_chain = chains; // no new chains
+          }
+        }
+      });
+    }
+    for(std::thread& th : pool) th.join();
+    if(error) std::rethrow_exception(error);
+
+    // Pooled PPM; point estimate = chain estimate with the smallest Binder loss under it
+    std::vector<double> ppm((std::size_t) n*n, 0.0);
+    int n_retained = 0;
+    for(const wsbm::Fit& fit : fits){
+      for(std::size_t i = 0; i < ppm.size(); i++) ppm[i] += fit.ppm[i]/chains;
+      n_retained += fit.n_retained;
+    }
+    const std::vector<int>* best = &fits[0].z_hat;
+    double best_loss = wsbm::binder_loss(*best, ppm);
+    for(const wsbm::Fit& fit : fits){
+      double loss = wsbm::binder_loss(fit.z_hat, ppm);
+      if(loss < best_loss){
+        best_loss = loss;
+        best = &fit.z_hat;
+      }
+    }
+    std::vector<int32_t> z_hat(best->begin(), best->end());
+    for(int32_t& z : z_hat) z++;
+
+    c.write_line("RESULT " + std::to_string(n) + " " + std::to_string(n_retained));
+    c.write(z_hat.data(), z_hat.size()*sizeof(int32_t));
+    c.write(ppm.data(), ppm.size()*sizeof(double));
+    c.write_line("DONE " + std::to_string(seconds_since(t0)));
+  }
+
+  void handle(int fd){
+    Conn c(fd);
+    if(!same_user(fd)){
+      c.write_line("ERROR connection from another user");
+      return;
+    }
+    std::string line;
+    if(!c.read_line(line)) return;
+    std::map<std::string, std::string> f = parse_fields(line);
+    try{
+      if(f["cmd"] == "FIT"){
+        run_fit(c, f);
+      }else if(f["cmd"] == "HAS"){
+        c.write_line(cache.get(field(f, "key", "")) ? "YES" : "NO");
+      }else if(f["cmd"] == "STOP"){
+        stopping = true;
+        c.write_line("BYE");
+        ::shutdown(listen_fd, SHUT_RDWR);
+      }else{
+        c.write_line("ERROR unknown command " + f["cmd"]);
+      }
+    }catch(std::exception& e){
+      c.write_line(std::string("ERROR ") + e.what());
+    }
+  }
+
+  void handler_done(){
+    std::lock_guard<std::mutex> lock(active_m);
+    active--;
+    active_cv.notify_all();
+  }
+
+  void wait_handlers(){
+    std::unique_lock<std::mutex> lock(active_m);
+    active_cv.wait(lock, [&]{ return active == 0; });
+  }
+
+  static bool same_user(int fd){
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if(::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) return false;
+    return cred.uid == ::geteuid();
+#else
+    (void) fd;
+    return true; // the socket's 0600 mode is the only check
+#endif
+  }
+};
+
+// $XDG_RUNTIME_DIR/wsbm.sock, else /tmp/wsbm-<uid>/wsbm.sock (directory created 0700
+// and checked to be a directory of this user that nobody else can enter)
+std::string default_socket(){
+  const char* xdg = std::getenv("XDG_RUNTIME_DIR");
+  struct stat st;
+  if(xdg != NULL && *xdg != '\0' && ::stat(xdg, &st) == 0 && S_ISDIR(st.st_mode)){
+    return std::string(xdg) + "/wsbm.sock";
+  }
+  std::string dir = "/tmp/wsbm-" + std::to_string(::geteuid());
+  if(::mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST){
+    throw std::runtime_error("cannot create " + dir);
+  }
+  if(::lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != ::geteuid() ||
+     (st.st_mode & 077) != 0){
+    throw std::runtime_error(dir + " is not a private directory of this user");
+  }
+  return dir + "/wsbm.sock";
+}
+
+sockaddr_un socket_address(const std::string& path){
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("socket path too long");
+  std::strcpy(addr.sun_path, path.c_str());
+  return addr;
+}
+
+// Remove a stale socket of this user at path; false if path is something else, is
+// not ours or has a daemon listening on it
+bool clear_stale_socket(const std::string& path){
+  struct stat st;
+  if(::lstat(path.c_str(), &st) != 0) return errno == ENOENT;
+  if(!S_ISSOCK(st.st_mode) || st.st_uid != ::geteuid()) return false;
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = socket_address(path);
+  bool live = fd >= 0 && ::connect(fd, (sockaddr*) &addr, sizeof(addr)) == 0;
+  if(fd >= 0) ::close(fd);
+  return !live && ::unlink(path.c_str()) == 0;
+}
+
+int serve(const std::string& path, int threads, std::size_t cache_bytes){
+  if(!clear_stale_socket(path)){
+    std::fprintf(stderr, "wsbm_daemon: %s exists and is not a stale socket of this user\n", path.c_str());
+    return 1;
+  }
+  Daemon d(threads, cache_bytes);
+  d.listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = socket_address(path);
+  mode_t old_mask = ::umask(0177); // the socket is created 0600
+  bool bound = d.listen_fd >= 0 && ::bind(d.listen_fd, (sockaddr*) &addr, sizeof(addr)) == 0;
+  ::umask(old_mask);
+  struct stat own;
+  if(!bound || ::chmod(path.c_str(), 0600) != 0 || ::lstat(path.c_str(), &own) != 0 || ::listen(d.listen_fd, 64) != 0){
+    std::perror("wsbm_daemon: cannot listen");
+    return 1;
+  }
+  std::fprintf(stderr, "wsbm_daemon: listening on %s (%d threads, %zu MB cache)\n",
+               path.c_str(), threads, cache_bytes >> 20);
+  while(!d.stopping){
+    int fd = ::accept(d.listen_fd, NULL, NULL);
+    if(fd < 0){
+      if(d.stopping) break;
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(d.active_m);
+      d.active++;
+    }
+    std::thread([&d, fd]{
+      d.handle(fd);
+      d.handler_done();
+    }).detach();
+  }
+  ::close(d.listen_fd);
+  // Only the socket this daemon created is removed
+  struct stat st;
+  if(::lstat(path.c_str(), &st) == 0 && st.st_dev == own.st_dev && st.st_ino == own.st_ino){
+    ::unlink(path.c_str());
+  }
+  d.wait_handlers(); // running and queued jobs, and the STOP reply
+  return 0;
+}
+
+int connect_to(const std::string& path){
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr = socket_address(path);
+  if(fd < 0 || ::connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0){
+    std::fprintf(stderr, "wsbm_daemon: no daemon on %s\n", path.c_str());
+    std::exit(2);
+  }
+  return fd;
+}
+
+// Client side of FIT: prints the progress lines, writes the result to out
+int client_fit(const std::string& path, const std::string& request, const std::string& out){
+  Conn c(connect_to(path));
+  c.write_line(request);
+  std::string line;
+  while(c.read_line(line)){
+    std::printf("%s\n", line.c_str());
+    std::fflush(stdout);
+    if(line.compare(0, 6, "ERROR ") == 0) return 1;
+    if(line.compare(0, 5, "DONE ") == 0) return 0;
+    if(line.compare(0, 7, "RESULT ") == 0){
+      int32_t hdr[2] = {0, 0};
+      std::sscanf(line.c_str() + 7, "%d %d", &hdr[0], &hdr[1]);
+      std::size_t n = hdr[0];
+      std::vector<int32_t> z(n);
+      std::vector<double> ppm(n*n);
+      if(!c.read_exact(z.data(), n*sizeof(int32_t)) || !c.read_exact(ppm.data(), n*n*sizeof(double))) break;
+      std::FILE* f = std::fopen(out.c_str(), "wb");
+      if(f == NULL){
+        std::fprintf(stderr, "wsbm_daemon: cannot write %s\n", out.c_str());
+        return 1;
+      }
+      std::fwrite(hdr, sizeof(int32_t), 2, f);
+      std::fwrite(z.data(), sizeof(int32_t), n, f);
+      std::fwrite(ppm.data(), sizeof(double), n*n, f);
+      std::fclose(f);
+    }
+  }
+  std::fprintf(stderr, "wsbm_daemon: connection closed before the result\n");
+  return 1;
+}
+
+} // namespace
+
+int main(int argc, char** argv){
+  std::signal(SIGPIPE, SIG_IGN);
+  if(argc < 2){
+    std::fprintf(stderr, "usage: wsbm_daemon serve|has|fit|stop [options]\n");
+    return 2;
+  }
+  std::string cmd = argv[1], path, positional;
+  std::map<std::string, std::string> opt;
+  for(int a = 2; a < argc; a++){
+    std::string s = argv[a];
+    if(s.compare(0, 2, "--") == 0 && a + 1 < argc){
+      opt[s.substr(2)] = argv[++a];
+    }else{
+      positional = s;
+    }
+  }
+  try{
+    path = opt.count("socket") ? opt["socket"] : default_socket();
+  }catch(std::exception& e){
+    std::fprintf(stderr, "wsbm_daemon: %s\n", e.what());
+    return 2;
+  }
+
+  if(cmd == "serve"){
+    int threads = opt.count("threads") ? std::atoi(opt["threads"].c_str()) : (int) std::thread::hardware_concurrency();
+    std::size_t cache_mb = opt.count("cache-mb") ? std::strtoull(opt["cache-mb"].c_str(), NULL, 10) : 4096;
+    return serve(path, std::max(1, threads), cache_mb << 20);
+  }
+  if(cmd == "has"){
+    Conn c(connect_to(path));
+    c.write_line("HAS\tkey=" + positional);
+    std::string line;
+    if(!c.read_line(line)) return 1;
+    std::printf("%s\n", line.c_str());
+    return 0;
+  }
+  if(cmd == "stop"){
+    Conn c(connect_to(path));
+    c.write_line("STOP");
+    std::string line;
+    c.read_line(line);
+    return 0;
+  }
+  if(cmd == "fit"){
+    if(!opt.count("out")){
+      std::fprintf(stderr, "wsbm_daemon fit: --out is required\n");
+      return 2;
+    }
+    std::string request = "FIT";
+    const char* keys[] = {"key", "W", "priority", "threads", "K_max", "eta0", "iter", "burn", "seed", "chains"};
+    for(const char* k : keys){
+      if(opt.count(k)) request += std::string("\t") + k + "=" + opt[k];
+    }
+    return client_fit(path, request, opt["out"]);
+  }
+  std::fprintf(stderr, "wsbm_daemon: unknown command %s\n", cmd.c_str());
+  return 2;
+}
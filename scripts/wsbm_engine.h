@@ -0,0 +1,697 @@
+// Thread-safe WSBM sampler engine (stick-breaking K, as in auto_WSBM v3.4)
+//
+// Pure C++ (no R API, no Armadillo RNG) so that several chains can run at
+// once on worker threads. Each chain owns its RNG stream seeded by
+// (seed, chain). The model, priors and update order are those of auto_WSBM;
+// the z update scores each node from per-block sufficient statistics of its
+// row of W_f, and the block sums are updated incrementally when a node moves.
+//
+// W_f is the Fisher-transformed weight matrix, column-major n x n, diagonal 0.
+//
+// Reproducible mode (Settings::reproducible): every random draw is a pure
+// function of (seed, chain, iteration, site) from a counter-based generator with
+// portable transforms (site = node for z, stick or block for the parameters), and
+// the row and block sums are fixed-order pairwise reductions over aligned leaves
+// of 64 nodes, recomputed from z before every parameter update. Results then do
+// not depend on thread counts, on how the sums are split up, or on the C++
+// library's distributions; they differ from the default mode.
+//
+// Settings::timing accumulates the wall time of every phase of a fit (Phase) in
+// Chain::phase_seconds / Fit::phase_seconds, at two clock reads per phase and sweep.
+// Settings::counters adds the hardware counters of the chain's thread per phase
+// (wsbm_perf.h) in Chain::phase_counters / Fit::phase_counters; off, no counter is
+// opened or read. Settings::timeline records the fit, the sweeps picked by its
+// sampling rate with their phases, and the PPM / estimate phases as trace spans.
+
+#ifndef WSBM_ENGINE_H
+#define WSBM_ENGINE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "wsbm_perf.h"
+#include "wsbm_timeline.h"
+
+namespace wsbm {
+
+const double LOG_2PI = 1.8378770664093454836;
+
+inline double fisher(double r){
+  return 0.5 * std::log((1 + r)/(1 - r));
+}
+
+inline double inv_fisher(double r_inv){
+  return (std::exp(2 * r_inv) - 1)/(std::exp(2 * r_inv) + 1);
+}
+
+inline void fisher(const double* W, double* W_f, std::size_t len){
+  for(std::size_t i = 0; i < len; i++){
+    W_f[i] = fisher(W[i]);
+  }
+}
+
+// Hyperparameters of the Normal-Inverse-Gamma block prior
+struct Prior {
+  double SS0 = 0.1, nu0 = 10.0, mu0 = 0.0, n0 = 1.0;
+};
+
+struct Settings {
+  int K_max = 20;
+  double eta0 = 1.0;
+  int iter = 10000;
+  int burn = 5000;
+  uint64_t seed = 1;
+  uint64_t chain = 0;
+  bool reproducible = false;
+  bool timing = false;
+  bool counters = false; // implies timing
+  Timeline* timeline = NULL; // spans of the fit and of sampled sweeps (wsbm_timeline.h)
+};
+
+// Reject settings the sampler cannot run: the stick-breaking start needs two
+// communities (z takes labels 0 and 1 whatever K_max is), and the retained
+// draws need 0 <= burn < iter
+inline void check_settings(int n, const Settings& s){
+  if(s.K_max < 2) throw std::invalid_argument("K_max must be at least 2");
+  if(n < 2) throw std::invalid_argument("W must have at least 2 taxa");
+  if(s.burn < 0 || s.burn >= s.iter) throw std::invalid_argument("burn must be in [0, iter)");
+}
+
+// Timed phases of a fit: the four steps of a sweep, PPM accumulation, point estimate
+enum Phase { PHASE_STICKS, PHASE_Z, PHASE_STATS, PHASE_PARAMS, PHASE_PPM, PHASE_ESTIMATE, N_PHASES };
+
+inline const char* phase_name(int p){
+  static const char* names[N_PHASES] = {"sticks", "z", "stats", "params", "ppm", "estimate"};
+  return names[p];
+}
+
+// Adds the time since the previous lap to a phase (no-op without accumulator),
+// the counter deltas to counts[phase*N_COUNTERS + c] if perf is given, and the
+// lap as a span to the timeline if tl is given
+class PhaseTimer {
+public:
+  explicit PhaseTimer(std::vector<double>* acc, const PerfCounters* perf = NULL,
+                      std::vector<double>* counts = NULL, Timeline* tl = NULL)
+    : acc_(acc), perf_(acc && counts ? perf : NULL), counts_(counts), tl_(tl) {
+    skip();
+  }
+  void lap(int phase, bool trace = true){
+    if(!acc_ && !tl_) return;
+    Timeline::Clock::time_point t = Timeline::Clock::now();
+    if(tl_ && trace) tl_->record(phase_name(phase), "sweep", t_, t);
+    if(acc_) (*acc_)[phase] += std::chrono::duration<double>(t - t_).count();
+    t_ = t;
+    if(perf_){
+      double now[N_COUNTERS];
+      perf_->read(now);
+      for(int c = 0; c < N_COUNTERS; c++){
+        (*counts_)[phase*N_COUNTERS + c] += now[c] - last_[c];
+        last_[c] = now[c];
+      }
+    }
+  }
+  void skip(){
+    if(acc_ || tl_) t_ = Timeline::Clock::now();
+    if(perf_) perf_->read(last_);
+  }
+private:
+  std::vector<double>* acc_;
+  const PerfCounters* perf_;
+  std::vector<double>* counts_;
+  Timeline* tl_;
+  Timeline::Clock::time_point t_;
+  double last_[N_COUNTERS];
+};
+
+// Counter-based random numbers: draw j at (iter, site) of stream (seed, chain)
+// is a hash of the five, so no state is carried between sites
+class CounterRng {
+public:
+  CounterRng(uint64_t seed, uint64_t chain) : key_(mix(mix(seed + 0x243F6A8885A308D3ULL) ^ chain)), base_(0), j_(0) {}
+
+  void at(uint64_t iter, uint64_t site){
+    base_ = mix(mix(key_ ^ iter) + site);
+    j_ = 0;
+  }
+  uint64_t next(){ return mix(base_ + 0x9E3779B97F4A7C15ULL*(++j_)); }
+
+  // Uniform on (0, 1)
+  double unif(){ return ((next() >> 11) + 0.5)*(1.0/9007199254740992.0); }
+  // Box-Muller (one output per pair of uniforms)
+  double norm(){
+    double u1 = unif(), u2 = unif();
+    return std::sqrt(-2.0*std::log(u1))*std::cos(6.283185307179586477*u2);
+  }
+  // Marsaglia-Tsang, boosted for shape < 1
+  double gamma(double shape){
+    if(shape < 1.0){
+      double u = unif();
+      return gamma(shape + 1.0)*std::pow(u, 1.0/shape);
+    }
+    double d = shape - 1.0/3.0, c = 1.0/std::sqrt(9.0*d);
+    for(;;){
+      double x, v;
+      do{
+        x = norm();
+        v = 1.0 + c*x;
+      }while(v <= 0.0);
+      v = v*v*v;
+      double u = unif();
+      if(u < 1.0 - 0.0331*x*x*x*x) return d*v;
+      if(std::log(u) < 0.5*x*x + d*(1.0 - v + std::log(v))) return d*v;
+    }
+  }
+
+private:
+  uint64_t key_, base_, j_;
+
+  static uint64_t mix(uint64_t z){
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+};
+
+// Fixed-order pairwise (cascade) sum of equal-length vectors: leaves are added
+// in sequence and merged like a binary counter, so the result depends only on
+// the sequence of leaves, not on how they were produced
+class PairwiseSum {
+public:
+  explicit PairwiseSum(std::size_t width) : w_(width), carry_(width) {}
+
+  void reset(){ std::fill(used_.begin(), used_.end(), false); }
+
+  void add(const double* leaf){
+    std::copy(leaf, leaf + w_, carry_.begin());
+    std::size_t l = 0;
+    for(; l < used_.size() && used_[l]; l++){
+      for(std::size_t k = 0; k < w_; k++){
+        carry_[k] = levels_[l][k] + carry_[k];
+      }
+      used_[l] = false;
+    }
+    if(l == used_.size()){
+      levels_.push_back(carry_);
+      used_.push_back(true);
+    }else{
+      levels_[l].swap(carry_);
+      carry_.resize(w_);
+      used_[l] = true;
+    }
+  }
+
+  // Sum of all leaves (highest level first)
+  void result(double* out) const {
+    std::fill(out, out + w_, 0.0);
+    for(std::size_t l = used_.size(); l-- > 0; ){
+      if(!used_[l]) continue;
+      for(std::size_t k = 0; k < w_; k++){
+        out[k] = out[k] + levels_[l][k];
+      }
+    }
+  }
+
+private:
+  std::size_t w_;
+  std::vector<double> carry_;
+  std::vector< std::vector<double> > levels_;
+  std::vector<bool> used_;
+};
+
+class Chain {
+public:
+  Chain(const double* W_f, int n, const Settings& s, const Prior& p = Prior())
+    : W_f_((check_settings(n, s), W_f)), n_(n), K_(s.K_max), eta0_(s.eta0), prior_(p),
+      z_(n, 0), n_k_(s.K_max, 0),
+      matrix_n_(s.K_max * s.K_max, 0.0), W_sum_(s.K_max * s.K_max, 0.0),
+      W_sum_sq_(s.K_max * s.K_max, 0.0), mu_(s.K_max * s.K_max, 0.0),
+      Var_(s.K_max * s.K_max, p.SS0), log_alpha_(s.K_max, 0.0),
+      S1_(s.K_max), S2_(s.K_max), cnt_(s.K_max), logprob_(s.K_max),
+      logpost_(0.0), it_(0), repro_(s.reproducible), crng_(s.seed, s.chain),
+      row_sum_(2*s.K_max), block_sum_(2*(std::size_t) s.K_max*s.K_max), row_leaf_(2*s.K_max),
+      timing_(s.timing || s.counters), phase_(N_PHASES, 0.0),
+      perf_(s.counters ? new PerfCounters() : NULL), counts_(s.counters ? N_PHASES*N_COUNTERS : 0, 0.0),
+      tl_(s.timeline) {
+    std::seed_seq seq{(uint32_t) s.seed, (uint32_t) (s.seed >> 32),
+                      (uint32_t) s.chain, (uint32_t) (s.chain >> 32)};
+    rng_.seed(seq);
+  }
+
+  // Random start as in auto_WSBM: K_start ~ U{2, ..., K_max/4}, z ~ U{0, ..., K_start - 1}
+  void init_random(){
+    site_at(INIT, n_);
+    int K_start = std::max(2, std::min(K_, runif_int(2, std::max(2, K_/4))));
+    for(int i = 0; i < n_; i++){
+      site_at(INIT, i);
+      z_[i] = runif_int(0, K_start - 1);
+    }
+    start();
+  }
+
+  // Warm start from given labels (0-based, < K_max)
+  void init_labels(const std::vector<int>& z){
+    z_ = z;
+    start();
+  }
+
+  // One Gibbs sweep: stick-breaking weights, z, var, mu
+  void sweep(){
+    bool traced = tl_ && tl_->sampled(it_);
+    Span span(tl_, "sweep", "sweep", traced);
+    span.arg("it", it_);
+    PhaseTimer t(timing_ ? &phase_ : NULL, perf_.get(), &counts_, traced ? tl_ : NULL);
+    update_sticks();
+    t.lap(PHASE_STICKS);
+    for(int i = 0; i < n_; i++){
+      update_node(i);
+    }
+    t.lap(PHASE_Z);
+    if(++it_ % 100 == 0 || repro_){
+      recompute_stats(); // guard against drift of the incremental sums
+    }
+    t.lap(PHASE_STATS);
+    update_params();
+    t.lap(PHASE_PARAMS);
+  }
+
+  // Full-conditional log probabilities of node i over k = 0, ..., K_max - 1
+  // (unnormalized, given the current state of all other nodes)
+  const std::vector<double>& score(int i){
+    row_stats(i);
+    for(int k = 0; k < K_; k++){
+      double lp = log_alpha_[k];
+      for(int b = 0; b < K_; b++){
+        if(cnt_[b] == 0) continue;
+        int p = k < b ? k + b*K_ : b + k*K_;
+        double v = Var_[p], m = mu_[p];
+        lp += -0.5*cnt_[b]*(LOG_2PI + std::log(v))
+          - (S2_[b] - 2.0*m*S1_[b] + cnt_[b]*m*m)/(2.0*v);
+      }
+      logprob_[k] = lp;
+    }
+    return logprob_;
+  }
+
+  int n() const { return n_; }
+  int K_max() const { return K_; }
+  const std::vector<int>& z() const { return z_; }
+  const std::vector<int>& n_k() const { return n_k_; }
+  // Upper-triangular K_max x K_max block parameters and statistics (column-major)
+  const std::vector<double>& mu() const { return mu_; }
+  const std::vector<double>& Var() const { return Var_; }
+  const std::vector<double>& matrix_n() const { return matrix_n_; }
+  const std::vector<double>& W_sum() const { return W_sum_; }
+  const std::vector<double>& W_sum_sq() const { return W_sum_sq_; }
+  const std::vector<double>& log_alpha() const { return log_alpha_; }
+  double logpost() const { return logpost_; }
+  // Wall seconds per Phase of the sweeps so far (Settings::timing)
+  const std::vector<double>& phase_seconds() const { return phase_; }
+  // Hardware counts per Phase x Counter, row-major (Settings::counters; NaN = not counted)
+  const std::vector<double>& phase_counters() const { return counts_; }
+  // Counters of the thread that created the chain (NULL without Settings::counters)
+  const PerfCounters* perf() const { return perf_.get(); }
+  int n_occupied() const {
+    int K_occ = 0;
+    for(int k = 0; k < K_; k++){
+      K_occ += n_k_[k] > 0;
+    }
+    return K_occ;
+  }
+  std::mt19937_64& rng(){ return rng_; }
+
+  // Recompute all block statistics from scratch (upper triangle of W_f)
+  void recompute_stats(){
+    std::fill(n_k_.begin(), n_k_.end(), 0);
+    for(int i = 0; i < n_; i++){
+      n_k_[z_[i]]++;
+    }
+    if(repro_){
+      pairwise_block_stats();
+      count_pairs();
+      return;
+    }
+    std::fill(W_sum_.begin(), W_sum_.end(), 0.0);
+    std::fill(W_sum_sq_.begin(), W_sum_sq_.end(), 0.0);
+    for(int j = 1; j < n_; j++){
+      const double* col = W_f_ + (std::size_t) j*n_;
+      int zj = z_[j];
+      for(int i = 0; i < j; i++){
+        int zi = z_[i];
+        int p = zi < zj ? zi + zj*K_ : zj + zi*K_;
+        W_sum_[p] += col[i];
+        W_sum_sq_[p] += col[i]*col[i];
+      }
+    }
+    count_pairs();
+  }
+
+  // Conjugate draws of Var then mu for every block, given the current statistics
+  void update_params(){
+    const Prior& pr = prior_;
+    for(int kk = 0; kk < K_; kk++){
+      for(int k = 0; k <= kk; k++){
+        int p = k + kk*K_;
+        double m = matrix_n_[p];
+        site_at(it_, n_ + K_ + p);
+        if(m > 0){
+          double W_sum_sq_2 = W_sum_sq_[p] - W_sum_[p]*W_sum_[p]/m;
+          double rate = 0.5*(pr.SS0 + W_sum_sq_2 + ((pr.n0*m)/(pr.n0 + m))*std::pow(W_sum_[p]/m - pr.mu0, 2));
+          Var_[p] = 1/rgamma((m + pr.nu0)/2, 1/rate);
+        }else{
+          Var_[p] = pr.SS0;
+        }
+      }
+    }
+    logpost_ = 0.0;
+    for(int kk = 0; kk < K_; kk++){
+      for(int k = 0; k <= kk; k++){
+        int p = k + kk*K_;
+        double m = matrix_n_[p], v = Var_[p];
+        site_at(it_, n_ + K_ + (std::size_t) K_*K_ + p);
+        mu_[p] = (W_sum_[p] + pr.n0*pr.mu0)/(m + pr.n0) + std::sqrt(v/(m + pr.n0))*rnorm();
+        logpost_ += (-1.0*m/2.0) * std::log(v) - W_sum_sq_[p]/(2.0*v)
+          + mu_[p]*W_sum_[p]/v - m*mu_[p]*mu_[p]/(2.0*v);
+        logpost_ += -0.5*std::log(v/pr.n0) - (pr.n0/(2.0*v)) * std::pow(mu_[p] - pr.mu0, 2.0);
+        logpost_ += -(pr.nu0/2 + 1) * std::log(v) + pr.SS0/(2*v);
+      }
+    }
+  }
+
+  // Stick-breaking weights log_alpha given n_k
+  void update_sticks(){
+    double log_rest = 0.0; // sum_{l < k} log(1 - beta_l)
+    int gamma = n_;
+    for(int k = 0; k < K_; k++){
+      gamma -= n_k_[k];
+      double log_beta = 0.0;
+      site_at(it_, n_ + k);
+      if(k < K_ - 1){
+        log_beta = std::log(rbeta(1 + n_k_[k], eta0_ + gamma));
+      }
+      log_alpha_[k] = log_beta + log_rest;
+      log_rest += std::log(1 - std::exp(log_beta));
+    }
+  }
+
+  // Gibbs update of z(i) from its full conditional
+  void update_node(int i){
+    score(i);
+    site_at(it_, i);
+    int k_new = sample_log(logprob_);
+    move(i, k_new);
+  }
+
+  // Move node i to community c, updating n_k and the block sums from the row
+  // statistics computed by the last score(i) / row_stats(i)
+  void move(int i, int c){
+    int a = z_[i];
+    if(a == c) return;
+    for(int b = 0; b < K_; b++){
+      if(cnt_[b] == 0) continue;
+      int pa = a < b ? a + b*K_ : b + a*K_;
+      int pc = c < b ? c + b*K_ : b + c*K_;
+      W_sum_[pa] -= S1_[b];
+      W_sum_sq_[pa] -= S2_[b];
+      W_sum_[pc] += S1_[b];
+      W_sum_sq_[pc] += S2_[b];
+    }
+    n_k_[a]--;
+    n_k_[c]++;
+    z_[i] = c;
+    count_pairs();
+  }
+
+  // Per-block sums of row i of W_f over the other nodes
+  void row_stats(int i){
+    std::fill(S1_.begin(), S1_.end(), 0.0);
+    std::fill(S2_.begin(), S2_.end(), 0.0);
+    std::fill(cnt_.begin(), cnt_.end(), 0);
+    const double* col = W_f_ + (std::size_t) i*n_; // W_f is symmetric
+    if(repro_){
+      pairwise_row(col, n_, i);
+      for(int ii = 0; ii < n_; ii++){
+        if(ii != i) cnt_[z_[ii]]++;
+      }
+      return;
+    }
+    for(int ii = 0; ii < n_; ii++){
+      if(ii == i) continue;
+      int b = z_[ii];
+      S1_[b] += col[ii];
+      S2_[b] += col[ii]*col[ii];
+      cnt_[b]++;
+    }
+  }
+
+  // Random draws from the chain's own stream
+  double runif(){
+    return repro_ ? crng_.unif() : std::uniform_real_distribution<double>(0.0, 1.0)(rng_);
+  }
+  int runif_int(int lo, int hi){
+    if(repro_) return std::min(hi, lo + (int) (crng_.unif()*(hi - lo + 1)));
+    return std::uniform_int_distribution<int>(lo, hi)(rng_);
+  }
+  double rnorm(){
+    return repro_ ? crng_.norm() : std::normal_distribution<double>(0.0, 1.0)(rng_);
+  }
+  double rgamma(double shape, double scale){
+    return repro_ ? crng_.gamma(shape)*scale : std::gamma_distribution<double>(shape, scale)(rng_);
+  }
+  double rbeta(double a, double b){
+    double x = rgamma(a, 1.0), y = rgamma(b, 1.0);
+    return x/(x + y);
+  }
+
+  // Draw an index with probability proportional to exp(logprob)
+  int sample_log(const std::vector<double>& logprob){
+    double c = *std::max_element(logprob.begin(), logprob.end());
+    double total = 0.0;
+    for(double lp : logprob){
+      total += std::exp(lp - c);
+    }
+    double u = runif()*total;
+    int K = (int) logprob.size();
+    for(int k = 0; k < K; k++){
+      u -= std::exp(logprob[k] - c);
+      if(u <= 0.0) return k;
+    }
+    return K - 1;
+  }
+
+private:
+  void start(){
+    recompute_stats();
+    update_params();
+  }
+
+  static const uint64_t INIT = ~0ULL; // iteration key of the random start
+  static const int LEAF = 64;          // nodes per leaf of the pairwise sums
+
+  // Key the counter-based draws that follow (reproducible mode only)
+  void site_at(uint64_t iter, uint64_t site){
+    if(repro_) crng_.at(iter, site);
+  }
+
+  // S1_ / S2_ of col[0 .. len) by community, skipping index skip
+  void pairwise_row(const double* col, int len, int skip){
+    std::vector<double>& leaf = row_leaf_;
+    row_sum_.reset();
+    for(int start = 0; start < len; start += LEAF){
+      std::fill(leaf.begin(), leaf.end(), 0.0);
+      for(int ii = start; ii < std::min(len, start + LEAF); ii++){
+        if(ii == skip) continue;
+        int b = z_[ii];
+        leaf[b] += col[ii];
+        leaf[K_ + b] += col[ii]*col[ii];
+      }
+      row_sum_.add(leaf.data());
+    }
+    row_sum_.result(leaf.data());
+    std::copy(leaf.begin(), leaf.begin() + K_, S1_.begin());
+    std::copy(leaf.begin() + K_, leaf.end(), S2_.begin());
+  }
+
+  // W_sum_ / W_sum_sq_ as a pairwise sum over columns of their pairwise column sums
+  void pairwise_block_stats(){
+    std::size_t K2 = (std::size_t) K_*K_;
+    std::vector<double> leaf(2*K2), out(2*K2);
+    block_sum_.reset();
+    for(int j = 1; j < n_; j++){
+      pairwise_row(W_f_ + (std::size_t) j*n_, j, -1);
+      std::fill(leaf.begin(), leaf.end(), 0.0);
+      int zj = z_[j];
+      for(int b = 0; b < K_; b++){
+        int p = b < zj ? b + zj*K_ : zj + b*K_;
+        leaf[p] += S1_[b];
+        leaf[K2 + p] += S2_[b];
+      }
+      block_sum_.add(leaf.data());
+    }
+    block_sum_.result(out.data());
+    std::copy(out.begin(), out.begin() + K2, W_sum_.begin());
+    std::copy(out.begin() + K2, out.end(), W_sum_sq_.begin());
+  }
+
+  void count_pairs(){
+    for(int kk = 0; kk < K_; kk++){
+      for(int k = 0; k <= kk; k++){
+        matrix_n_[k + kk*K_] = k == kk ? 0.5*n_k_[k]*(n_k_[k] - 1.0) : 1.0*n_k_[k]*n_k_[kk];
+      }
+    }
+  }
+
+  const double* W_f_;
+  int n_, K_;
+  double eta0_;
+  Prior prior_;
+  std::vector<int> z_, n_k_;
+  std::vector<double> matrix_n_, W_sum_, W_sum_sq_, mu_, Var_, log_alpha_;
+  std::vector<double> S1_, S2_;
+  std::vector<int> cnt_;
+  std::vector<double> logprob_;
+  double logpost_;
+  int it_;
+  std::mt19937_64 rng_;
+  bool repro_;
+  CounterRng crng_;
+  PairwiseSum row_sum_, block_sum_;
+  std::vector<double> row_leaf_;
+  bool timing_;
+  std::vector<double> phase_;
+  std::unique_ptr<PerfCounters> perf_;
+  std::vector<double> counts_;
+  Timeline* tl_;
+};
+
+// Posterior summaries of one chain
+struct Fit {
+  int n = 0;
+  int n_retained = 0;
+  std::vector<int> z;            // last state
+  std::vector<int> z_hat;        // point estimate (retained draw minimizing Binder loss)
+  std::vector<double> ppm;       // n x n co-clustering probabilities, diagonal 1
+  std::vector<int> K_trace;      // occupied communities per retained draw
+  std::vector<double> logpost;   // log posterior per retained draw
+  std::vector<double> phase_seconds; // wall seconds per Phase (Settings::timing)
+  std::vector<double> phase_counters; // Phase x Counter counts, row-major (Settings::counters)
+  std::string counters_status;        // "" if every counter was available
+};
+
+// Accumulate the upper triangle of the co-clustering counts for labels z
+inline void add_ppm(std::vector<double>& ppm, const std::vector<int>& z){
+  int n = (int) z.size();
+  for(int j = 1; j < n; j++){
+    for(int i = 0; i < j; i++){
+      if(z[i] == z[j]) ppm[i + (std::size_t) j*n] += 1.0;
+    }
+  }
+}
+
+// Binder loss of labels z against co-clustering probabilities ppm (upper triangle)
+inline double binder_loss(const std::vector<int>& z, const std::vector<double>& ppm){
+  int n = (int) z.size();
+  double loss = 0.0;
+  for(int j = 1; j < n; j++){
+    for(int i = 0; i < j; i++){
+      double p = ppm[i + (std::size_t) j*n];
+      loss += z[i] == z[j] ? 1.0 - p : p;
+    }
+  }
+  return loss;
+}
+
+// Relabel z to 0, 1, ... in order of first appearance
+inline std::vector<int> relabel(const std::vector<int>& z){
+  std::vector<int> map, out(z.size());
+  for(std::size_t i = 0; i < z.size(); i++){
+    if((int) map.size() <= z[i]) map.resize(z[i] + 1, -1);
+    if(map[z[i]] < 0){
+      map[z[i]] = *std::max_element(map.begin(), map.end()) + 1;
+    }
+    out[i] = map[z[i]];
+  }
+  return out;
+}
+
+// Run one chain from a random start and summarize the draws after burn-in.
+// keep_draws bounds the retained draws kept for the Binder point estimate.
+inline Fit fit(const double* W_f, int n, const Settings& s, const Prior& p = Prior(),
+               int keep_draws = 500){
+  Span span(s.timeline, "chain", "fit");
+  span.arg("chain", s.chain).arg("n", n).arg("iter", s.iter);
+  Chain chain(W_f, n, s, p); // checks the settings before the n x n PPM is allocated
+  Fit res;
+  res.n = n;
+  res.ppm.assign((std::size_t) n*n, 0.0);
+  chain.init_random();
+
+  int thin = std::max(1, (s.iter - s.burn)/std::max(1, keep_draws));
+  std::vector< std::vector<int> > draws;
+  bool timed = s.timing || s.counters;
+  std::vector<double> post(N_PHASES, 0.0), post_counts(N_PHASES*N_COUNTERS, 0.0); // phases outside the sweeps
+  PhaseTimer t(timed ? &post : NULL, chain.perf(), &post_counts, s.timeline);
+  for(int it = 0; it < s.iter; it++){
+    chain.sweep();
+    t.skip(); // timed by the chain
+    if(it >= s.burn){
+      add_ppm(res.ppm, chain.z());
+      res.K_trace.push_back(chain.n_occupied());
+      res.logpost.push_back(chain.logpost());
+      res.n_retained++;
+      if((it - s.burn) % thin == 0){
+        draws.push_back(chain.z());
+      }
+    }
+    t.lap(PHASE_PPM, s.timeline && s.timeline->sampled(it));
+  }
+  res.z = chain.z();
+
+  double denom = std::max(1, res.n_retained);
+  for(int j = 0; j < n; j++){
+    for(int i = 0; i < j; i++){
+      double v = res.ppm[i + (std::size_t) j*n]/denom;
+      res.ppm[i + (std::size_t) j*n] = v;
+      res.ppm[j + (std::size_t) i*n] = v;
+    }
+    res.ppm[j + (std::size_t) j*n] = 1.0;
+  }
+
+  double best = std::numeric_limits<double>::infinity();
+  for(const std::vector<int>& d : draws){
+    double loss = binder_loss(d, res.ppm);
+    if(loss < best){
+      best = loss;
+      res.z_hat = d;
+    }
+  }
+  if(res.z_hat.empty()) res.z_hat = res.z;
+  res.z_hat = relabel(res.z_hat);
+  t.lap(PHASE_ESTIMATE);
+  if(timed){
+    res.phase_seconds = chain.phase_seconds();
+    res.phase_seconds[PHASE_PPM] = post[PHASE_PPM];
+    res.phase_seconds[PHASE_ESTIMATE] = post[PHASE_ESTIMATE];
+  }
+  if(s.counters){
+    res.phase_counters = chain.phase_counters();
+    for(int p = PHASE_PPM; p <= PHASE_ESTIMATE; p++){
+      for(int c = 0; c < N_COUNTERS; c++){
+        res.phase_counters[p*N_COUNTERS + c] = post_counts[p*N_COUNTERS + c];
+      }
+    }
+    res.counters_status = chain.perf()->status();
+  }
+  return res;
+}
+
+} // namespace wsbm
+
+#endif
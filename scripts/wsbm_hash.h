@@ -0,0 +1,96 @@
+// Fast 64-bit content hash (XXH64) for the result cache keys
+
+#ifndef WSBM_HASH_H
+#define WSBM_HASH_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace wsbm {
+
+namespace hash_detail {
+
+const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL, P3 = 0x165667B19E3779F9ULL,
+  P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl(uint64_t x, int r){
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t read64(const unsigned char* p){
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint32_t read32(const unsigned char* p){
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input){
+  return rotl(acc + input*P2, 31)*P1;
+}
+
+inline uint64_t merge(uint64_t acc, uint64_t v){
+  return (acc ^ round(0, v))*P1 + P4;
+}
+
+} // namespace hash_detail
+
+// XXH64 of len bytes (little-endian reads, as on all supported platforms)
+inline uint64_t hash64(const void* data, std::size_t len, uint64_t seed = 0){
+  using namespace hash_detail;
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  const unsigned char* end = p + len;
+  uint64_t h;
+
+  if(len >= 32){
+    uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+    for(; p + 32 <= end; p += 32){
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+    }
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge(h, v1);
+    h = merge(h, v2);
+    h = merge(h, v3);
+    h = merge(h, v4);
+  }else{
+    h = seed + P5;
+  }
+  h += len;
+
+  for(; p + 8 <= end; p += 8){
+    h = rotl(h ^ round(0, read64(p)), 27)*P1 + P4;
+  }
+  if(p + 4 <= end){
+    h = rotl(h ^ (read32(p)*P1), 23)*P2 + P3;
+    p += 4;
+  }
+  for(; p < end; p++){
+    h = rotl(h ^ (*p*P5), 11)*P1;
+  }
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+inline std::string hash_hex(uint64_t h){
+  char buf[17];
+  std::snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) h);
+  return buf;
+}
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,180 @@
+// Memory plan of an auto_WSBM run
+//
+// MemPlan predicts the bytes of every large buffer of auto_WSBM (SBM_cpp_v3.4.cpp)
+// from n, K_max, iter, burn and the output settings before anything is allocated,
+// and keeps the bytes each buffer actually reached (track), so a run can be checked
+// against a limit before it starts and reported after it ends. fit(limit) switches
+// the outputs that have a streaming form -- the stored draws to a trace file
+// (wsbm_trace.h), the dense PPM to the packed accumulator and a CSR file
+// (wsbm_ppm.h) -- until the plan fits. The Fisher-transformed W_f has no such form;
+// it can be shared between sessions (wsbm_shm.h). The block sums are one pass over
+// W_f into K x K matrices, so no buffer depends on the community sizes and the plan
+// is the worst case for any partition. O(n + K^2) vectors are in "other"; the
+// caller's W, which already exists, is not counted.
+
+#ifndef WSBM_MEM_H
+#define WSBM_MEM_H
+
+#include "wsbm_snapshot.h"
+#include "wsbm_trace.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace wsbm {
+
+struct MemConfig {
+  uint64_t n = 0, K = 0, iter = 0, burn = 0;
+  bool store = true;       // stored draws and PPM are filled
+  bool shm = false;        // W_f read from a WSBM_shm segment
+  bool trace = false;      // draws streamed to a trace file
+  bool ppm_sparse = false; // packed PPM and CSR file
+  bool snapshot = false;
+  uint64_t trace_buffer = 1024;
+};
+
+struct MemBuffer {
+  std::string name;
+  double planned, tracked;
+};
+
+class MemPlan {
+public:
+  explicit MemPlan(const MemConfig& c) : c_(c) { build(); }
+
+  const MemConfig& config() const { return c_; }
+  const std::vector<MemBuffer>& buffers() const { return buffers_; }
+
+  double total() const {
+    double s = 0;
+    for(const MemBuffer& b : buffers_) s += b.planned;
+    return s;
+  }
+
+  double tracked_total() const {
+    double s = 0;
+    for(const MemBuffer& b : buffers_) s += b.tracked;
+    return s;
+  }
+
+  // Record that a buffer reached this size (the peak is kept)
+  void track(const std::string& name, double bytes){
+    for(MemBuffer& b : buffers_){
+      if(b.name == name) b.tracked = std::max(b.tracked, bytes);
+    }
+  }
+
+  // Switch outputs to their streaming form until the plan fits the limit;
+  // returns what was switched
+  std::vector<std::string> fit(double limit){
+    std::vector<std::string> actions;
+    if(total() > limit && c_.store && !c_.trace){
+      c_.trace = true;
+      build();
+      actions.push_back("stored draws streamed to a trace file");
+    }
+    if(total() > limit && c_.store && !c_.ppm_sparse){
+      c_.ppm_sparse = true;
+      build();
+      actions.push_back("dense PPM replaced by the packed PPM and a CSR file");
+    }
+    return actions;
+  }
+
+  // Largest planned buffers, e.g. "W_f 3052 MB, ppm_store 1526 MB"
+  std::string largest(int top = 3) const {
+    std::vector<MemBuffer> b = buffers_;
+    std::sort(b.begin(), b.end(), [](const MemBuffer& x, const MemBuffer& y){ return x.planned > y.planned; });
+    std::string out;
+    char buf[128];
+    for(int i = 0; i < top && i < (int) b.size() && b[i].planned > 0; i++){
+      std::snprintf(buf, sizeof(buf), "%s%s %.0f MB", i > 0 ? ", " : "", b[i].name.c_str(), b[i].planned/1048576.0);
+      out += buf;
+    }
+    return out;
+  }
+
+private:
+  MemConfig c_;
+  std::vector<MemBuffer> buffers_;
+
+  void build(){
+    double n = c_.n, K = c_.K, pairs = n*(n - 1)/2;
+    bool draws = c_.store && !c_.trace;
+    double rec = trace_detail::record_bytes(c_.n, c_.K);
+    buffers_.clear();
+    add("W_f", c_.shm ? 0 : 8*n*n);
+    add("z_store", draws ? 4*(double) c_.iter*n : 0);
+    add("mu_store", draws ? 8*K*K*(c_.iter - c_.burn) : 0);
+    add("var_store", draws ? 8*K*K*(c_.iter - c_.burn) : 0);
+    add("trace buffers", c_.store && c_.trace ? (c_.trace_buffer + 2*256)*rec : 0); // ring, chunk, compressed chunk
+    add("ppm_store", c_.store && !c_.ppm_sparse ? 4*n*n : 0);
+    add("packed PPM", c_.store && c_.ppm_sparse ? 2*pairs + 4*n : 0);
+    add("PPM export", c_.store && c_.ppm_sparse ? 24*n : 0); // row_ptr and one row
+    add("snapshot", c_.snapshot ? snapshot_detail::HEADER_BYTES + 2*snapshot_detail::buffer_bytes(c_.n, c_.K) : 0);
+    add("logpost_store", 8*(double) c_.iter);
+    add("other", 16*n + 12*8*K*K);
+  }
+
+  void add(const char* name, double planned){
+    MemBuffer b = {name, planned, 0.0};
+    buffers_.push_back(b);
+  }
+};
+
+// Memory the system can give without swapping (MemAvailable), NaN if unknown
+inline double available_bytes(){
+#ifdef __linux__
+  std::ifstream meminfo("/proc/meminfo");
+  std::string line;
+  while(std::getline(meminfo, line)){
+    if(line.compare(0, 13, "MemAvailable:") == 0){
+      return std::atof(line.c_str() + 13)*1024.0;
+    }
+  }
+#endif
+  return std::numeric_limits<double>::quiet_NaN();
+}
+
+// Peak RSS of this process in MB; reset = start a new peak (Linux), NaN if unknown
+inline double peak_rss_mb(bool reset){
+#ifdef __linux__
+  if(reset){
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5"; // resets VmHWM to the current RSS
+  }
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while(std::getline(status, line)){
+    if(line.compare(0, 6, "VmHWM:") == 0){
+      return std::atof(line.c_str() + 6)/1024.0;
+    }
+  }
+#endif
+#ifndef _WIN32
+  struct rusage ru;
+  if(getrusage(RUSAGE_SELF, &ru) == 0){
+#ifdef __APPLE__
+    return ru.ru_maxrss/1048576.0; // bytes
+#else
+    return ru.ru_maxrss/1024.0;    // kB
+#endif
+  }
+#endif
+  return std::numeric_limits<double>::quiet_NaN();
+}
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,228 @@
+// NUMA placement for multi-chain runs sharing one W_f
+//
+// The topology is read from /sys/devices/system/node (no libnuma), restricted
+// to the CPUs the process may run on. Chain threads can be pinned with an
+// affinity policy ("compact" fills one node before the next, "spread" deals
+// threads round-robin over nodes), and W_f can be replicated once per node in
+// use: each replica is written by a thread pinned to that node, so the kernel's
+// first-touch policy places its pages locally, and can be backed by transparent
+// huge pages. Chains then read the replica of the node they run on.
+//
+// Bandwidth report: every sweep of the engine reads each node's row of W_f once
+// (n x n doubles), so the W_f traffic of a socket is sweeps * n^2 * 8 bytes over
+// the wall time; it is set against a short pinned read test of the same threads.
+// Without Linux sysfs / affinity calls everything runs as one node, unpinned.
+
+#ifndef WSBM_NUMA_H
+#define WSBM_NUMA_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+namespace wsbm {
+
+struct Placement {
+  std::string affinity = "none"; // none | compact | spread
+  bool replicate = false;        // one W_f per NUMA node in use
+  bool hugepages = false;        // madvise(MADV_HUGEPAGE) on W_f
+};
+
+// W_f traffic and read bandwidth of one NUMA node
+struct SocketStats {
+  int node = 0;
+  int threads = 0;
+  double GB = 0.0;        // W_f bytes read by the chains of this node
+  double GBps = 0.0;      // ... over the wall time of the run
+  double peak_GBps = 0.0; // pinned read test with the same no. of threads
+  double utilization = 0.0;
+};
+
+inline std::vector<int> parse_cpulist(const std::string& s){
+  std::vector<int> cpus;
+  std::stringstream ss(s);
+  std::string tok;
+  while(std::getline(ss, tok, ',')){
+    if(tok.empty() || tok == "\n") continue;
+    std::size_t dash = tok.find('-');
+    int from = std::atoi(tok.c_str());
+    int to = dash == std::string::npos ? from : std::atoi(tok.c_str() + dash + 1);
+    for(int c = from; c <= to; c++) cpus.push_back(c);
+  }
+  return cpus;
+}
+
+// CPUs of every NUMA node (node index = position); one pseudo-node if unknown
+inline std::vector< std::vector<int> > numa_topology(){
+  std::vector<int> allowed;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if(sched_getaffinity(0, sizeof(set), &set) == 0){
+    for(int c = 0; c < CPU_SETSIZE; c++){
+      if(CPU_ISSET(c, &set)) allowed.push_back(c);
+    }
+  }
+#endif
+  if(allowed.empty()){
+    for(int c = 0; c < (int) std::max(1u, std::thread::hardware_concurrency()); c++) allowed.push_back(c);
+  }
+
+  std::vector< std::vector<int> > nodes;
+  for(int node = 0; node < 256; node++){
+    std::ifstream in(("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist").c_str());
+    std::string line;
+    if(!in || !std::getline(in, line)) continue;
+    std::vector<int> cpus;
+    for(int c : parse_cpulist(line)){
+      if(std::find(allowed.begin(), allowed.end(), c) != allowed.end()) cpus.push_back(c);
+    }
+    if(!cpus.empty()) nodes.push_back(cpus);
+  }
+  if(nodes.empty()) nodes.push_back(allowed);
+  return nodes;
+}
+
+// Node and CPU of each of n_threads threads under the policy (cpu -1 = unpinned)
+inline void assign_threads(const std::vector< std::vector<int> >& nodes, int n_threads,
+                           const std::string& policy, std::vector<int>& node_of, std::vector<int>& cpu_of){
+  node_of.assign(n_threads, 0);
+  cpu_of.assign(n_threads, -1);
+  if(policy == "none") return;
+  if(policy != "compact" && policy != "spread"){
+    throw std::runtime_error("affinity must be none, compact or spread");
+  }
+  std::vector<std::size_t> used(nodes.size(), 0);
+  std::size_t total = 0;
+  for(const std::vector<int>& cpus : nodes) total += cpus.size();
+  for(int t = 0; t < n_threads; t++){
+    std::size_t node = 0;
+    if(policy == "spread"){
+      node = t % nodes.size();
+    }else{
+      std::size_t slot = t % total;
+      while(slot >= nodes[node].size()){
+        slot -= nodes[node].size();
+        node++;
+      }
+    }
+    node_of[t] = node;
+    cpu_of[t] = nodes[node][used[node]++ % nodes[node].size()];
+  }
+}
+
+inline bool pin_thread(int cpu){
+#ifdef __linux__
+  if(cpu < 0) return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void) cpu;
+  return false;
+#endif
+}
+
+// Page-aligned anonymous buffer of doubles, optionally on huge pages
+class NodeBuffer {
+public:
+  NodeBuffer(std::size_t len, bool hugepages) : len_(len), data_(NULL), mapped_(false) {
+    std::size_t bytes = std::max<std::size_t>(1, len*sizeof(double));
+#ifdef __linux__
+    void* p = ::mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p != MAP_FAILED){
+#ifdef MADV_HUGEPAGE
+      if(hugepages) ::madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+      data_ = static_cast<double*>(p);
+      mapped_ = true;
+    }
+#endif
+    (void) hugepages;
+    if(data_ == NULL){
+      data_ = new double[std::max<std::size_t>(1, len)];
+    }
+  }
+  ~NodeBuffer(){
+#ifdef __linux__
+    if(mapped_){
+      ::munmap(data_, std::max<std::size_t>(1, len_*sizeof(double)));
+      return;
+    }
+#endif
+    delete[] data_;
+  }
+  NodeBuffer(const NodeBuffer&) = delete;
+  NodeBuffer& operator=(const NodeBuffer&) = delete;
+
+  double* data(){ return data_; }
+
+private:
+  std::size_t len_;
+  double* data_;
+  bool mapped_;
+};
+
+// Copy src into a new buffer from a thread pinned to cpu (first touch on its node)
+inline std::unique_ptr<NodeBuffer> first_touch_copy(const double* src, std::size_t len, int cpu, bool hugepages){
+  std::unique_ptr<NodeBuffer> buf(new NodeBuffer(len, hugepages));
+  double* dst = buf->data();
+  std::thread th([&]{
+    pin_thread(cpu);
+    std::memcpy(dst, src, len*sizeof(double));
+  });
+  th.join();
+  return buf;
+}
+
+// Aggregate read bandwidth (GB/s) of threads pinned to cpus, each summing data
+inline double read_bandwidth(const double* data, std::size_t len, const std::vector<int>& cpus,
+                             double seconds = 0.05){
+  if(len == 0 || cpus.empty()) return 0.0;
+  std::atomic<uint64_t> bytes(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> pool;
+  for(std::size_t t = 0; t < cpus.size(); t++){
+    pool.emplace_back([&, t]{
+      pin_thread(cpus[t]);
+      while(!go.load()) std::this_thread::yield();
+      std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+      volatile double sink = 0.0;
+      uint64_t done = 0;
+      while(std::chrono::steady_clock::now() < end){
+        double acc = 0.0;
+        for(std::size_t i = 0; i < len; i++) acc += data[i];
+        sink = sink + acc;
+        done += len*sizeof(double);
+      }
+      bytes += done;
+    });
+  }
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  go = true;
+  for(std::thread& th : pool) th.join();
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+  return bytes/wall/1e9;
+}
+
+} // namespace wsbm
+
+#endif
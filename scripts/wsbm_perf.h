@@ -0,0 +1,103 @@
+// Hardware performance counters of the calling thread (Linux perf_event_open)
+//
+// Counts user-space cycles, instructions, last-level cache misses and branch
+// misses of the thread that creates the object, read at every lap of the engine's
+// PhaseTimer (wsbm_engine.h, Settings::counters), so each phase of a fit gets its
+// own counts next to its wall time. Each event has its own descriptor, so an event
+// the CPU or VM does not offer is reported as NaN while the others still count;
+// counts are scaled for multiplexing by time enabled / time running. Opening fails
+// (status() says why) without Linux, or when /proc/sys/kernel/perf_event_paranoid
+// forbids user-space counting. Nothing is opened or read unless counters are asked for.
+
+#ifndef WSBM_PERF_H
+#define WSBM_PERF_H
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace wsbm {
+
+enum Counter { CNT_CYCLES, CNT_INSTRUCTIONS, CNT_LLC_MISSES, CNT_BRANCH_MISSES, N_COUNTERS };
+
+inline const char* counter_name(int c){
+  static const char* names[N_COUNTERS] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+  return names[c];
+}
+
+class PerfCounters {
+public:
+  PerfCounters() : n_open_(0) {
+    for(int c = 0; c < N_COUNTERS; c++) fd_[c] = -1;
+#ifdef __linux__
+    static const uint64_t config[N_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for(int c = 0; c < N_COUNTERS; c++){
+      struct perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = config[c];
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fd_[c] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0); // this thread, any CPU
+      if(fd_[c] >= 0){
+        n_open_++;
+      }else if(status_.empty()){
+        status_ = std::string(counter_name(c)) + ": " + std::strerror(errno);
+      }
+    }
+    if(n_open_ == 0) status_ = "perf_event_open failed (" + status_ + "); see perf_event_paranoid";
+#else
+    status_ = "hardware counters need Linux perf_event_open";
+#endif
+  }
+
+  ~PerfCounters(){
+#ifdef __linux__
+    for(int c = 0; c < N_COUNTERS; c++){
+      if(fd_[c] >= 0) close(fd_[c]);
+    }
+#endif
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  bool available() const { return n_open_ > 0; }
+  // "" if every counter is open, otherwise the first failure
+  const std::string& status() const { return status_; }
+
+  // Counts since opening (NaN for counters that are not open)
+  void read(double* out) const {
+    for(int c = 0; c < N_COUNTERS; c++){
+      out[c] = std::numeric_limits<double>::quiet_NaN();
+#ifdef __linux__
+      uint64_t v[3]; // value, time enabled, time running
+      if(fd_[c] >= 0 && ::read(fd_[c], v, sizeof(v)) == (ssize_t) sizeof(v)){
+        out[c] = v[2] > 0 ? (double) v[0]*((double) v[1]/v[2]) : 0.0;
+      }
+#endif
+    }
+  }
+
+private:
+  int fd_[N_COUNTERS];
+  int n_open_;
+  std::string status_;
+};
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,210 @@
+// Minimal indexed-colour PNG writer and the cluster-ordered correlation heatmap
+// of the README / Demo.R figures: the diverging pink-white-green palette of
+// scale_fill_gradient2(low = "pink", mid = "white", high = "green", limits = c(-1, 1))
+// (interpolated in CIELAB, as ggplot2 does) and dashed block boundary lines.
+// Needs zlib (link with -lz).
+
+#ifndef WSBM_PNG_H
+#define WSBM_PNG_H
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace wsbm {
+
+struct RGB {
+  uint8_t r, g, b;
+};
+
+namespace png_detail {
+
+struct Lab {
+  double L, a, b;
+};
+
+inline double srgb_to_linear(double c){
+  return c <= 0.04045 ? c/12.92 : std::pow((c + 0.055)/1.055, 2.4);
+}
+
+inline double linear_to_srgb(double c){
+  c = c <= 0.0031308 ? 12.92*c : 1.055*std::pow(c, 1/2.4) - 0.055;
+  return std::fmin(1.0, std::fmax(0.0, c));
+}
+
+// sRGB <-> CIELAB with the D65 white point
+inline Lab to_lab(RGB c){
+  double r = srgb_to_linear(c.r/255.0), g = srgb_to_linear(c.g/255.0), b = srgb_to_linear(c.b/255.0);
+  double x = (0.4124564*r + 0.3575761*g + 0.1804375*b)/0.95047;
+  double y = (0.2126729*r + 0.7151522*g + 0.0721750*b);
+  double z = (0.0193339*r + 0.1191920*g + 0.9503041*b)/1.08883;
+  auto f = [](double t){ return t > 216.0/24389 ? std::cbrt(t) : (24389.0/27*t + 16)/116; };
+  return Lab{116*f(y) - 16, 500*(f(x) - f(y)), 200*(f(y) - f(z))};
+}
+
+inline RGB to_rgb(Lab c){
+  double fy = (c.L + 16)/116, fx = fy + c.a/500, fz = fy - c.b/200;
+  auto finv = [](double t){ return t*t*t > 216.0/24389 ? t*t*t : (116*t - 16)/(24389.0/27); };
+  double x = 0.95047*finv(fx), y = finv(fy), z = 1.08883*finv(fz);
+  double r = 3.2404542*x - 1.5371385*y - 0.4985314*z;
+  double g = -0.9692660*x + 1.8760108*y + 0.0415560*z;
+  double b = 0.0556434*x - 0.2040259*y + 1.0572252*z;
+  return RGB{(uint8_t) std::lround(255*linear_to_srgb(r)),
+             (uint8_t) std::lround(255*linear_to_srgb(g)),
+             (uint8_t) std::lround(255*linear_to_srgb(b))};
+}
+
+inline void put_u32(std::vector<uint8_t>& out, uint32_t v){
+  out.push_back(v >> 24);
+  out.push_back(v >> 16);
+  out.push_back(v >> 8);
+  out.push_back(v);
+}
+
+inline void chunk(std::FILE* f, const char* type, const std::vector<uint8_t>& data){
+  std::vector<uint8_t> buf;
+  put_u32(buf, data.size());
+  buf.insert(buf.end(), type, type + 4);
+  buf.insert(buf.end(), data.begin(), data.end());
+  uint32_t crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, buf.data() + 4, buf.size() - 4);
+  put_u32(buf, crc);
+  std::fwrite(buf.data(), 1, buf.size(), f);
+}
+
+} // namespace png_detail
+
+// n_steps colours from low (-1) through mid (0) to high (+1)
+inline std::vector<RGB> diverging_palette(int n_steps, RGB low = RGB{255, 192, 203},
+                                          RGB mid = RGB{255, 255, 255}, RGB high = RGB{0, 255, 0}){
+  png_detail::Lab l = png_detail::to_lab(low), m = png_detail::to_lab(mid), h = png_detail::to_lab(high);
+  std::vector<RGB> pal(n_steps);
+  for(int s = 0; s < n_steps; s++){
+    double v = -1.0 + 2.0*s/(n_steps - 1);
+    png_detail::Lab e = v < 0 ? l : h;
+    double t = std::fabs(v);
+    pal[s] = png_detail::to_rgb(png_detail::Lab{m.L + t*(e.L - m.L), m.a + t*(e.a - m.a), m.b + t*(e.b - m.b)});
+  }
+  return pal;
+}
+
+// Palette layout of the heatmap: gradient, boundary line colour, NA colour
+const int HEAT_STEPS = 254, HEAT_LINE = 254, HEAT_NA = 255;
+
+inline std::vector<RGB> heatmap_palette(){
+  std::vector<RGB> pal = diverging_palette(HEAT_STEPS);
+  pal.push_back(RGB{255, 153, 153}); // red at alpha 0.4 over white
+  pal.push_back(RGB{127, 127, 127}); // grey50, ggplot2's na.value
+  return pal;
+}
+
+// Raster of the n x n matrix W (column-major) with rows / columns in the given
+// order, laid out as geom_tile(aes(x = Row, y = Col)): x runs along the rows of
+// W and y upwards along the columns. For n >= size_px the cells are averaged into
+// size_px x size_px pixel bins, otherwise each cell is a square of size_px / n
+// pixels. boundaries are the block ends (cumulative block sizes) in the ordered
+// matrix; dashed lines are drawn there. The image side length is returned in side.
+inline std::vector<uint8_t> heatmap_pixels(const double* W, int n, const std::vector<int>& order,
+                                           const std::vector<int>& boundaries, int size_px, int& side){
+  int bins = std::min(n, size_px), cell = std::max(1, size_px/n);
+  side = bins*cell;
+
+  std::vector<double> sum((std::size_t) bins*bins, 0.0);
+  std::vector<int> cnt((std::size_t) bins*bins, 0);
+  for(int j = 0; j < n; j++){
+    const double* col = W + (std::size_t) order[j]*n;
+    int bj = (int) ((long long) j*bins/n);
+    for(int i = 0; i < n; i++){
+      double v = col[order[i]];
+      if(std::isnan(v)) continue;
+      int bi = (int) ((long long) i*bins/n);
+      sum[bi + (std::size_t) bj*bins] += v;
+      cnt[bi + (std::size_t) bj*bins]++;
+    }
+  }
+
+  std::vector<uint8_t> px((std::size_t) side*side);
+  for(int t = 0; t < side; t++){
+    int bj = (side - 1 - t)/cell; // top image row = last column
+    for(int x = 0; x < side; x++){
+      int bi = x/cell;
+      std::size_t b = bi + (std::size_t) bj*bins;
+      uint8_t idx = HEAT_NA;
+      if(cnt[b] > 0){
+        double v = std::max(-1.0, std::min(1.0, sum[b]/cnt[b]));
+        idx = (uint8_t) std::lround((v + 1)/2*(HEAT_STEPS - 1));
+      }
+      px[x + (std::size_t) t*side] = idx;
+    }
+  }
+
+  // Dashed boundary lines between blocks (6 on, 4 off)
+  for(int pos : boundaries){
+    if(pos <= 0 || pos >= n) continue;
+    int q = (int) ((long long) pos*bins/n)*cell;
+    if(q <= 0 || q >= side) continue; // boundary inside the first or last bin
+    for(int u = 0; u < side; u++){
+      if(u % 10 >= 6) continue;
+      px[q + (std::size_t) u*side] = HEAT_LINE;
+      px[u + (std::size_t) (side - 1 - q)*side] = HEAT_LINE; // top image row = last column
+    }
+  }
+  return px;
+}
+
+// Write a width x height image of palette indices (row-major, top row first)
+inline void write_png_indexed(const std::string& file, int width, int height,
+                              const std::vector<uint8_t>& pixels, const std::vector<RGB>& palette){
+  std::FILE* f = std::fopen(file.c_str(), "wb");
+  if(f == NULL){
+    throw std::runtime_error("cannot open " + file + " for writing");
+  }
+  const uint8_t sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  std::fwrite(sig, 1, 8, f);
+
+  std::vector<uint8_t> ihdr;
+  png_detail::put_u32(ihdr, width);
+  png_detail::put_u32(ihdr, height);
+  ihdr.push_back(8);  // bit depth
+  ihdr.push_back(3);  // colour type: indexed
+  ihdr.push_back(0);
+  ihdr.push_back(0);
+  ihdr.push_back(0);
+  png_detail::chunk(f, "IHDR", ihdr);
+
+  std::vector<uint8_t> plte;
+  for(const RGB& c : palette){
+    plte.push_back(c.r);
+    plte.push_back(c.g);
+    plte.push_back(c.b);
+  }
+  png_detail::chunk(f, "PLTE", plte);
+
+  // Scanlines with filter type 0 (none)
+  std::vector<uint8_t> raw((std::size_t) (width + 1)*height);
+  for(int y = 0; y < height; y++){
+    raw[(std::size_t) y*(width + 1)] = 0;
+    std::copy(pixels.begin() + (std::size_t) y*width, pixels.begin() + (std::size_t) (y + 1)*width,
+              raw.begin() + (std::size_t) y*(width + 1) + 1);
+  }
+  uLongf len = compressBound(raw.size());
+  std::vector<uint8_t> idat(len);
+  if(compress2(idat.data(), &len, raw.data(), raw.size(), 6) != Z_OK){
+    std::fclose(f);
+    throw std::runtime_error("zlib compression failed");
+  }
+  idat.resize(len);
+  png_detail::chunk(f, "IDAT", idat);
+  png_detail::chunk(f, "IEND", std::vector<uint8_t>());
+  std::fclose(f);
+}
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,200 @@
+// Compact PPM accumulator and sparse (CSR) export
+//
+// PackedPPM keeps the co-clustering counts of the upper triangle only, as 16-bit
+// counters (n(n-1) bytes instead of the 4n^2 bytes of a dense int matrix), and is
+// updated per community rather than per pair. write_ppm_csr exports either the
+// pairs with co-clustering probability >= threshold or each taxon's top-k
+// partners, reading the accumulator row by row without forming the dense matrix
+// or holding the retained pairs in memory.
+//
+// CSR file layout (little-endian):
+//   char[8]  magic "WSBMPPM1"
+//   uint64   n, nnz
+//   uint32   n_retained, top_k (0 = threshold mode)
+//   double   threshold
+//   n x (uint32 length, char[length])   taxon names
+//   uint64[n + 1]  row_ptr
+//   uint32[nnz]    col_idx (0-based)
+//   float[nnz]     prob
+
+#ifndef WSBM_PPM_H
+#define WSBM_PPM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace wsbm {
+
+class PackedPPM {
+public:
+  explicit PackedPPM(int n) : n_(n), n_retained_(0), counts_((std::size_t) n*(n - 1)/2, 0) {}
+
+  int n() const { return n_; }
+  int n_retained() const { return n_retained_; }
+
+  // Index of the pair (i, j), i < j, in the packed upper triangle
+  static std::size_t index(int i, int j){
+    return (std::size_t) j*(j - 1)/2 + i;
+  }
+
+  uint16_t count(int i, int j) const {
+    if(i == j) return n_retained_;
+    return i < j ? counts_[index(i, j)] : counts_[index(j, i)];
+  }
+
+  // Add one retained draw of the labels z (values in 0, ..., K - 1)
+  void add(const int* z, int K){
+    if(n_retained_ == std::numeric_limits<uint16_t>::max()){
+      throw std::overflow_error("PackedPPM holds at most 65535 retained draws");
+    }
+    groups_.assign(K, std::vector<int>());
+    for(int i = 0; i < n_; i++){
+      groups_[z[i]].push_back(i); // increasing i within each group
+    }
+    for(const std::vector<int>& g : groups_){
+      for(std::size_t b = 1; b < g.size(); b++){
+        std::size_t base = (std::size_t) g[b]*(g[b] - 1)/2;
+        for(std::size_t a = 0; a < b; a++){
+          counts_[base + g[a]]++;
+        }
+      }
+    }
+    n_retained_++;
+  }
+
+  std::size_t bytes() const { return counts_.size()*sizeof(uint16_t); }
+
+private:
+  int n_, n_retained_;
+  std::vector<uint16_t> counts_;
+  std::vector< std::vector<int> > groups_;
+};
+
+// Write the thresholded (top_k = 0) or top-k co-clustering partners of every taxon.
+// The rows are selected again for row_ptr, col_idx and prob and streamed to the file,
+// so the export needs O(n) memory whatever the number of retained pairs. A failed
+// write (e.g. a full disk) removes the partial file and throws.
+inline void write_ppm_csr(const std::string& file, const PackedPPM& ppm, const std::vector<std::string>& names,
+                          double threshold = 0.5, int top_k = 0){
+  int n = ppm.n();
+  double denom = std::max(1, ppm.n_retained());
+  std::vector< std::pair<float, uint32_t> > row;
+  auto partners = [&](int i){
+    row.clear();
+    for(int j = 0; j < n; j++){
+      if(j == i) continue;
+      float p = ppm.count(i, j)/denom;
+      if(top_k > 0 ? p > 0 : p >= threshold) row.push_back(std::make_pair(p, (uint32_t) j));
+    }
+    if(top_k > 0 && (int) row.size() > top_k){
+      std::partial_sort(row.begin(), row.begin() + top_k, row.end(),
+                        [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b){
+                          return a.first > b.first || (a.first == b.first && a.second < b.second);
+                        });
+      row.resize(top_k);
+      std::sort(row.begin(), row.end(), [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b){
+        return a.second < b.second;
+      });
+    }
+  };
+
+  std::vector<uint64_t> row_ptr(n + 1, 0);
+  for(int i = 0; i < n; i++){
+    partners(i);
+    row_ptr[i + 1] = row_ptr[i] + row.size();
+  }
+
+  std::FILE* f = std::fopen(file.c_str(), "wb");
+  if(f == NULL){
+    throw std::runtime_error("cannot open " + file + " for writing");
+  }
+  uint64_t n64 = n, nnz = row_ptr[n];
+  uint32_t n_ret = ppm.n_retained(), k32 = top_k;
+  bool ok = std::fwrite("WSBMPPM1", 1, 8, f) == 8
+    && std::fwrite(&n64, sizeof(n64), 1, f) == 1
+    && std::fwrite(&nnz, sizeof(nnz), 1, f) == 1
+    && std::fwrite(&n_ret, sizeof(n_ret), 1, f) == 1
+    && std::fwrite(&k32, sizeof(k32), 1, f) == 1
+    && std::fwrite(&threshold, sizeof(threshold), 1, f) == 1;
+  for(int i = 0; ok && i < n; i++){
+    std::string name = i < (int) names.size() ? names[i] : std::to_string(i + 1);
+    uint32_t len = name.size();
+    ok = std::fwrite(&len, sizeof(len), 1, f) == 1 && std::fwrite(name.data(), 1, len, f) == len;
+  }
+  ok = ok && std::fwrite(row_ptr.data(), sizeof(uint64_t), row_ptr.size(), f) == row_ptr.size();
+  std::vector<uint32_t> col_idx;
+  for(int i = 0; ok && i < n; i++){
+    partners(i);
+    col_idx.clear();
+    for(const std::pair<float, uint32_t>& e : row) col_idx.push_back(e.second);
+    ok = std::fwrite(col_idx.data(), sizeof(uint32_t), col_idx.size(), f) == col_idx.size();
+  }
+  std::vector<float> prob;
+  for(int i = 0; ok && i < n; i++){
+    partners(i);
+    prob.clear();
+    for(const std::pair<float, uint32_t>& e : row) prob.push_back(e.first);
+    ok = std::fwrite(prob.data(), sizeof(float), prob.size(), f) == prob.size();
+  }
+  ok = !std::ferror(f) && ok;
+  ok = std::fclose(f) == 0 && ok;
+  if(!ok){
+    // A truncated file would be read back as a wrong PPM
+    std::remove(file.c_str());
+    throw std::runtime_error("writing the PPM file " + file + " failed");
+  }
+}
+
+// Contents of a CSR file written by write_ppm_csr
+struct PPMCSR {
+  uint64_t n = 0, nnz = 0;
+  uint32_t n_retained = 0, top_k = 0;
+  double threshold = 0.0;
+  std::vector<std::string> names;
+  std::vector<uint64_t> row_ptr;
+  std::vector<uint32_t> col_idx;
+  std::vector<float> prob;
+};
+
+inline PPMCSR read_ppm_csr(const std::string& file){
+  std::FILE* f = std::fopen(file.c_str(), "rb");
+  if(f == NULL){
+    throw std::runtime_error("cannot open " + file);
+  }
+  PPMCSR csr;
+  char magic[8];
+  bool ok = std::fread(magic, 1, 8, f) == 8 && std::memcmp(magic, "WSBMPPM1", 8) == 0;
+  ok = ok && std::fread(&csr.n, sizeof(uint64_t), 1, f) == 1 && std::fread(&csr.nnz, sizeof(uint64_t), 1, f) == 1;
+  ok = ok && std::fread(&csr.n_retained, sizeof(uint32_t), 1, f) == 1 && std::fread(&csr.top_k, sizeof(uint32_t), 1, f) == 1;
+  ok = ok && std::fread(&csr.threshold, sizeof(double), 1, f) == 1;
+  for(uint64_t i = 0; ok && i < csr.n; i++){
+    uint32_t len = 0;
+    ok = std::fread(&len, sizeof(len), 1, f) == 1;
+    std::string name(len, ' ');
+    ok = ok && (len == 0 || std::fread(&name[0], 1, len, f) == len);
+    csr.names.push_back(name);
+  }
+  if(ok){
+    csr.row_ptr.resize(csr.n + 1);
+    csr.col_idx.resize(csr.nnz);
+    csr.prob.resize(csr.nnz);
+    ok = std::fread(csr.row_ptr.data(), sizeof(uint64_t), csr.n + 1, f) == csr.n + 1
+      && std::fread(csr.col_idx.data(), sizeof(uint32_t), csr.nnz, f) == csr.nnz
+      && std::fread(csr.prob.data(), sizeof(float), csr.nnz, f) == csr.nnz;
+  }
+  std::fclose(f);
+  if(!ok){
+    throw std::runtime_error(file + " is not a valid WSBM PPM CSR file");
+  }
+  return csr;
+}
+
+} // namespace wsbm
+
+#endif
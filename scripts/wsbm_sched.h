@@ -0,0 +1,301 @@
+// Work-stealing scheduler for WSBM jobs (replicates, chains, sub-fits, cohorts)
+//
+// Every worker owns a deque: it runs its own tasks newest first and, when idle,
+// steals the oldest task of another worker. Tasks may spawn subtasks into a
+// TaskGroup and wait for them; a waiting thread keeps running tasks instead of
+// blocking, so nested parallelism (e.g. cohorts -> chains) uses the same fixed
+// set of threads. The calling thread takes part in wait(), so a scheduler of
+// n_threads starts n_threads - 1 workers. run_jobs submits independent jobs
+// largest cost first (e.g. iter * n^2), so jobs of very different size pack onto
+// the cores with a short tail.
+//
+// While a scheduler is alive the BLAS and OpenMP runtimes loaded in the process
+// (OpenBLAS, MKL, BLIS, libgomp / libomp; found with dlsym, none is required) are
+// limited to inner_threads threads each, so kernels calling them from parallel
+// jobs do not oversubscribe the machine; each library's previous setting is
+// restored. A scheduler created inside a task of another scheduler is independent:
+// the outer scheduler's workers are external callers to it.
+// Tasks run on worker threads and must not call the R API.
+
+#ifndef WSBM_SCHED_H
+#define WSBM_SCHED_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+namespace wsbm {
+
+// Thread counts of the BLAS / OpenMP libraries present in the process
+class BlasThreads {
+public:
+  // Limit to n threads for the lifetime of the guard (n < 1: leave as is)
+  explicit BlasThreads(int n) : active_(n >= 1) {
+    for(int l = 0; l < N_LIBS; l++) saved_[l] = 0;
+    if(!active_) return;
+#ifndef _WIN32
+    if(int (*f)() = (int (*)()) sym("openblas_get_num_threads")) saved_[OPENBLAS] = f();
+    if(int (*f)() = (int (*)()) sym("MKL_Get_Max_Threads")) saved_[MKL] = f();
+    if(long (*f)() = (long (*)()) sym("bli_thread_get_num_threads")) saved_[BLIS] = (int) f();
+    if(int (*f)() = (int (*)()) sym("omp_get_max_threads")) saved_[OMP] = f();
+#endif
+    set(n);
+  }
+  // Every library gets back its own count (OpenMP: of the thread that made the guard)
+  ~BlasThreads(){
+    if(!active_) return;
+#ifndef _WIN32
+    if(saved_[OPENBLAS] > 0) ((void (*)(int)) sym("openblas_set_num_threads"))(saved_[OPENBLAS]);
+    if(saved_[MKL] > 0) ((void (*)(int)) sym("MKL_Set_Num_Threads"))(saved_[MKL]);
+    if(saved_[BLIS] > 0) ((void (*)(long)) sym("bli_thread_set_num_threads"))(saved_[BLIS]);
+    if(saved_[OMP] > 0) set_omp(saved_[OMP]);
+#endif
+  }
+  BlasThreads(const BlasThreads&) = delete;
+  BlasThreads& operator=(const BlasThreads&) = delete;
+
+  // Max. threads of the first library found (0 = none found)
+  static int get(){
+#ifndef _WIN32
+    if(int (*f)() = (int (*)()) sym("openblas_get_num_threads")) return f();
+    if(int (*f)() = (int (*)()) sym("MKL_Get_Max_Threads")) return f();
+    if(long (*f)() = (long (*)()) sym("bli_thread_get_num_threads")) return (int) f();
+    if(int (*f)() = (int (*)()) sym("omp_get_max_threads")) return f();
+#endif
+    return 0;
+  }
+
+  // Set every library found; returns their names
+  static std::string set(int n){
+    std::string found;
+#ifndef _WIN32
+    if(void (*f)(int) = (void (*)(int)) sym("openblas_set_num_threads")){ f(n); found += "OpenBLAS "; }
+    if(void (*f)(int) = (void (*)(int)) sym("MKL_Set_Num_Threads")){ f(n); found += "MKL "; }
+    if(void (*f)(long) = (void (*)(long)) sym("bli_thread_set_num_threads")){ f(n); found += "BLIS "; }
+    set_omp(n);
+    if(sym("omp_set_num_threads")) found += "OpenMP";
+#endif
+    return found;
+  }
+
+  // OpenMP thread counts are per thread: called by every worker
+  static void set_omp(int n){
+#ifndef _WIN32
+    if(void (*f)(int) = (void (*)(int)) sym("omp_set_num_threads")) f(n);
+#endif
+  }
+
+private:
+  enum { OPENBLAS, MKL, BLIS, OMP, N_LIBS };
+  int saved_[N_LIBS]; // 0 = library not found
+  bool active_;
+
+#ifndef _WIN32
+  static void* sym(const char* name){
+    return ::dlsym(RTLD_DEFAULT, name);
+  }
+#endif
+};
+
+class Scheduler {
+public:
+  // Completion counter of a set of tasks (and their first error)
+  class TaskGroup {
+  public:
+    TaskGroup() : pending_(0) {}
+    bool done() const { return pending_.load(std::memory_order_acquire) == 0; }
+  private:
+    friend class Scheduler;
+    std::atomic<int> pending_;
+    std::mutex m_;
+    std::exception_ptr error_;
+  };
+
+  explicit Scheduler(int n_threads, int inner_threads = 1)
+    : n_threads_(std::max(1, n_threads)), inner_threads_(inner_threads),
+      blas_(n_threads_ > 1 ? inner_threads : 0), queued_(0), stop_(false) {
+    for(int w = 0; w <= n_threads_; w++){
+      queues_.emplace_back(new Queue());
+    }
+    for(int w = 1; w < n_threads_; w++){
+      threads_.emplace_back([this, w]{ worker(w); });
+    }
+  }
+
+  ~Scheduler(){
+    {
+      std::lock_guard<std::mutex> lock(idle_m_);
+      stop_ = true;
+    }
+    idle_cv_.notify_all();
+    for(std::thread& th : threads_) th.join();
+  }
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  int n_threads() const { return n_threads_; }
+
+  // Queue f in g: on the current worker's deque, or the shared queue from outside
+  void spawn(TaskGroup& g, std::function<void()> f){
+    g.pending_.fetch_add(1, std::memory_order_relaxed);
+    int w = current() >= 0 ? current() : n_threads_;
+    {
+      std::lock_guard<std::mutex> lock(queues_[w]->m);
+      queues_[w]->tasks.push_back(Task{std::move(f), &g});
+    }
+    {
+      std::lock_guard<std::mutex> lock(idle_m_);
+      queued_++;
+    }
+    idle_cv_.notify_one();
+  }
+
+  // Run tasks until every task of g has finished; rethrows the first error
+  void wait(TaskGroup& g){
+    int self = current() >= 0 ? current() : 0;
+    Slot saved = slot();
+    slot() = Slot{this, self};
+    while(!g.done()){
+      if(!run_one(self)){
+        std::unique_lock<std::mutex> lock(idle_m_);
+        idle_cv_.wait_for(lock, std::chrono::milliseconds(1), [&]{ return queued_ > 0 || g.done(); });
+      }
+    }
+    slot() = saved;
+    if(g.error_) std::rethrow_exception(g.error_);
+  }
+
+  // Independent jobs 0..n_jobs-1, largest cost first
+  void run_jobs(const std::vector<double>& cost, const std::function<void(int)>& job){
+    std::vector<int> order(cost.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b){ return cost[a] > cost[b]; });
+    TaskGroup g;
+    for(int j : order){
+      spawn(g, [&job, j]{ job(j); });
+    }
+    wait(g);
+  }
+
+  // f(i) for i in [begin, end), split recursively into chunks of at most grain
+  void parallel_for(int begin, int end, int grain, const std::function<void(int)>& f){
+    TaskGroup g;
+    grain = std::max(1, grain);
+    spawn(g, [this, &g, begin, end, grain, &f]{ split(g, begin, end, grain, f); });
+    wait(g);
+  }
+
+private:
+  struct Task {
+    std::function<void()> f;
+    TaskGroup* g;
+  };
+  struct Queue {
+    std::mutex m;
+    std::deque<Task> tasks;
+  };
+
+  int n_threads_, inner_threads_;
+  BlasThreads blas_;
+  std::vector< std::unique_ptr<Queue> > queues_; // one per worker, last = shared
+  std::vector<std::thread> threads_;
+  std::mutex idle_m_;
+  std::condition_variable idle_cv_;
+  int queued_;
+  bool stop_;
+
+  // Scheduler and worker index of the calling thread; a thread belongs to one
+  // scheduler at a time, so nested schedulers each see their own workers
+  struct Slot {
+    const Scheduler* owner;
+    int id;
+  };
+  static Slot& slot(){
+    static thread_local Slot s = {NULL, -1};
+    return s;
+  }
+
+  // Worker index of the calling thread in this scheduler (-1 = not a worker)
+  int current() const {
+    const Slot& s = slot();
+    return s.owner == this ? s.id : -1;
+  }
+
+  void split(TaskGroup& g, int begin, int end, int grain, const std::function<void(int)>& f){
+    while(end - begin > grain){
+      int mid = begin + (end - begin)/2;
+      spawn(g, [this, &g, mid, end, grain, &f]{ split(g, mid, end, grain, f); });
+      end = mid;
+    }
+    for(int i = begin; i < end; i++) f(i);
+  }
+
+  bool take(int w, bool own, Task& t){
+    std::lock_guard<std::mutex> lock(queues_[w]->m);
+    std::deque<Task>& q = queues_[w]->tasks;
+    if(q.empty()) return false;
+    if(own){
+      t = std::move(q.back());
+      q.pop_back();
+    }else{
+      t = std::move(q.front());
+      q.pop_front();
+    }
+    return true;
+  }
+
+  // Own deque (newest first), then the shared queue and other workers (oldest first)
+  bool run_one(int self){
+    Task t;
+    bool got = take(self, true, t);
+    for(int k = 0; !got && k <= n_threads_; k++){
+      int victim = (self + k) % (n_threads_ + 1);
+      if(victim != self) got = take(victim, false, t);
+    }
+    if(!got) return false;
+    {
+      std::lock_guard<std::mutex> lock(idle_m_);
+      queued_--;
+    }
+    try{
+      t.f();
+    }catch(...){
+      std::lock_guard<std::mutex> lock(t.g->m_);
+      if(!t.g->error_) t.g->error_ = std::current_exception();
+    }
+    t.g->pending_.fetch_sub(1, std::memory_order_acq_rel);
+    idle_cv_.notify_all();
+    return true;
+  }
+
+  void worker(int w){
+    slot() = Slot{this, w};
+    BlasThreads::set_omp(std::max(1, inner_threads_));
+    for(;;){
+      if(run_one(w)) continue;
+      std::unique_lock<std::mutex> lock(idle_m_);
+      idle_cv_.wait(lock, [&]{ return queued_ > 0 || stop_; });
+      if(stop_ && queued_ == 0) return;
+    }
+  }
+};
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,136 @@
+// Chain shards without R or a network service (wsbm_shard.h)
+// Build: g++ -O2 -std=c++17 -pthread -I scripts scripts/wsbm_shard.cpp -o scripts/wsbm_shard
+// Usage:
+//   wsbm_shard run   --W FILE --chains 0-3 --out SHARD [--threads T] [--K_max K] [--eta0 E]
+//                    [--iter I] [--burn B] [--seed S]
+//                    [--affinity none|compact|spread] [--replicate 0|1] [--hugepages 0|1]
+//   wsbm_shard merge --out SHARD SHARD1 SHARD2 ...
+//   wsbm_shard info  SHARD
+// W FILE = n x n correlation matrix as raw doubles (column-major, e.g. writeBin(as.double(W), f)).
+// --chains takes a list of ids and ranges (e.g. 0,1,4-7); every process of one
+// analysis uses the same W FILE, settings and seed and distinct chain ids.
+// --affinity pins the chain threads, --replicate keeps one W_f per NUMA node and
+// --hugepages backs W_f with transparent huge pages (wsbm_numa.h); run then also
+// prints the W_f bandwidth of every socket.
+
+
+#include "wsbm_shard.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::vector<uint32_t> parse_chains(const std::string& spec){
+  std::vector<uint32_t> ids;
+  std::stringstream ss(spec);
+  std::string tok;
+  while(std::getline(ss, tok, ',')){
+    std::size_t dash = tok.find('-');
+    uint32_t from = std::strtoul(tok.c_str(), NULL, 10);
+    uint32_t to = dash == std::string::npos ? from : std::strtoul(tok.c_str() + dash + 1, NULL, 10);
+    for(uint32_t c = from; c <= to; c++) ids.push_back(c);
+  }
+  return ids;
+}
+
+void print_summary(const wsbm::Shard& sh){
+  uint64_t n_retained = 0;
+  std::vector< std::vector<double> > lp, kt;
+  std::vector<uint64_t> K_hist(sh.K_max + 1, 0);
+  for(const wsbm::ShardChain& c : sh.chains){
+    n_retained += c.n_retained;
+    lp.push_back(c.logpost);
+    kt.push_back(std::vector<double>(c.K_trace.begin(), c.K_trace.end()));
+    for(std::size_t k = 0; k < K_hist.size(); k++) K_hist[k] += c.K_hist[k];
+    if(c.cpu >= 0){
+      std::printf("chain %u: %u retained draws, %.2f s (node %d, cpu %d)\n", c.chain, c.n_retained, c.seconds, c.node, c.cpu);
+    }else{
+      std::printf("chain %u: %u retained draws, %.2f s\n", c.chain, c.n_retained, c.seconds);
+    }
+  }
+  std::printf("W hash %s, n = %u, K_max = %u, eta0 = %g, iter = %u, burn = %u, seed = %llu\n",
+              wsbm::hash_hex(sh.W_hash).c_str(), sh.n, sh.K_max, sh.eta0, sh.iter, sh.burn,
+              (unsigned long long) sh.seed);
+  std::printf("%zu chains, %llu retained draws\nK histogram:", sh.chains.size(), (unsigned long long) n_retained);
+  for(std::size_t k = 0; k < K_hist.size(); k++){
+    if(K_hist[k] > 0) std::printf(" %zu:%llu", k, (unsigned long long) K_hist[k]);
+  }
+  std::printf("\nsplit R-hat: logpost %.4f, K %.4f\n", wsbm::split_rhat(lp), wsbm::split_rhat(kt));
+}
+
+} // namespace
+
+int main(int argc, char** argv){
+  if(argc < 2){
+    std::fprintf(stderr, "usage: wsbm_shard run|merge|info [options]\n");
+    return 2;
+  }
+  std::string cmd = argv[1];
+  std::map<std::string, std::string> opt;
+  std::vector<std::string> files;
+  for(int a = 2; a < argc; a++){
+    std::string s = argv[a];
+    if(s.compare(0, 2, "--") == 0 && a + 1 < argc){
+      opt[s.substr(2)] = argv[++a];
+    }else{
+      files.push_back(s);
+    }
+  }
+
+  try{
+    if(cmd == "run"){
+      if(!opt.count("W") || !opt.count("out") || !opt.count("chains")){
+        std::fprintf(stderr, "wsbm_shard run: --W, --chains and --out are required\n");
+        return 2;
+      }
+      int n = 0;
+      uint64_t hash = 0;
+      std::vector<double> W = wsbm::read_W_file(opt["W"], n, hash);
+      wsbm::Settings s;
+      s.K_max = opt.count("K_max") ? std::atoi(opt["K_max"].c_str()) : 20;
+      s.eta0 = opt.count("eta0") ? std::atof(opt["eta0"].c_str()) : 0.1;
+      s.iter = opt.count("iter") ? std::atoi(opt["iter"].c_str()) : 10000;
+      s.burn = opt.count("burn") ? std::atoi(opt["burn"].c_str()) : 5000;
+      s.seed = opt.count("seed") ? std::strtoull(opt["seed"].c_str(), NULL, 10) : 1;
+      if(s.burn >= s.iter) throw std::runtime_error("burn must be smaller than iter");
+      int threads = opt.count("threads") ? std::atoi(opt["threads"].c_str()) : 1;
+      wsbm::Placement pl;
+      if(opt.count("affinity")) pl.affinity = opt["affinity"];
+      pl.replicate = opt.count("replicate") && std::atoi(opt["replicate"].c_str()) != 0;
+      pl.hugepages = opt.count("hugepages") && std::atoi(opt["hugepages"].c_str()) != 0;
+      std::vector<wsbm::SocketStats> sockets;
+      wsbm::Shard sh = wsbm::run_shard(W, n, hash, s, parse_chains(opt["chains"]), threads, pl, &sockets);
+      wsbm::write_shard(opt["out"], sh);
+      print_summary(sh);
+      for(const wsbm::SocketStats& st : sockets){
+        std::printf("node %d: %d threads, W_f %.2f GB at %.2f GB/s (read test %.2f GB/s, %.0f%%)\n",
+                    st.node, st.threads, st.GB, st.GBps, st.peak_GBps, 100*st.utilization);
+      }
+      return 0;
+    }
+    if(cmd == "merge" || cmd == "info"){
+      std::vector<wsbm::Shard> shards;
+      for(const std::string& f : files) shards.push_back(wsbm::read_shard(f));
+      wsbm::Shard merged = wsbm::merge_shards(shards);
+      if(cmd == "merge"){
+        if(!opt.count("out")){
+          std::fprintf(stderr, "wsbm_shard merge: --out is required\n");
+          return 2;
+        }
+        wsbm::write_shard(opt["out"], merged);
+      }
+      print_summary(merged);
+      return 0;
+    }
+  }catch(std::exception& e){
+    std::fprintf(stderr, "wsbm_shard: %s\n", e.what());
+    return 1;
+  }
+  std::fprintf(stderr, "wsbm_shard: unknown command %s\n", cmd.c_str());
+  return 2;
+}
@@ -0,0 +1,324 @@
+// Chain shards: partial results of independent chains run in separate processes
+//
+// Every process reads the same binary W file (n x n raw doubles, column-major),
+// runs its chains with the thread-safe engine and writes a self-describing shard:
+// the hash of the W file and the sampler settings, then per chain the packed PPM
+// counts, the histogram of occupied communities, the K and log-posterior traces
+// and the run time. merge_shards checks that shards are compatible (same W, n and
+// settings, distinct chain ids) and concatenates their chains; a merged shard is
+// a shard again, so merging can be repeated.
+//
+// File layout (little-endian):
+//   char[8] magic "WSBMSHD1", uint64 W_hash, uint32 n, K_max, iter, burn,
+//   double eta0, uint64 seed, uint32 n_chains, then per chain:
+//   uint32 chain, n_retained, double seconds, uint32 ppm[n(n - 1)/2] (packed upper
+//   triangle, index j(j - 1)/2 + i), uint64 K_hist[K_max + 1],
+//   int32 K_trace[n_retained], double logpost[n_retained]
+
+#ifndef WSBM_SHARD_H
+#define WSBM_SHARD_H
+
+#include "wsbm_engine.h"
+#include "wsbm_hash.h"
+#include "wsbm_numa.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace wsbm {
+
+struct ShardChain {
+  uint32_t chain = 0, n_retained = 0;
+  double seconds = 0.0;
+  int node = 0, cpu = -1; // placement of the run (not written to the file)
+  std::vector<uint32_t> ppm;
+  std::vector<uint64_t> K_hist;
+  std::vector<int32_t> K_trace;
+  std::vector<double> logpost;
+};
+
+struct Shard {
+  uint64_t W_hash = 0;
+  uint32_t n = 0, K_max = 0, iter = 0, burn = 0;
+  double eta0 = 0.0;
+  uint64_t seed = 0;
+  std::vector<ShardChain> chains;
+};
+
+// Raw n x n double matrix; n is inferred from the file size
+inline std::vector<double> read_W_file(const std::string& file, int& n, uint64_t& hash){
+  std::ifstream in(file.c_str(), std::ios::binary | std::ios::ate);
+  if(!in) throw std::runtime_error("cannot read W file " + file);
+  std::size_t bytes = in.tellg();
+  n = (int) std::llround(std::sqrt(bytes/8.0));
+  if((std::size_t) n*n*8 != bytes || n < 2) throw std::runtime_error(file + " is not an n x n double matrix");
+  std::vector<double> W((std::size_t) n*n);
+  in.seekg(0);
+  in.read(reinterpret_cast<char*>(W.data()), bytes);
+  hash = hash64(W.data(), bytes);
+  return W;
+}
+
+// Run the given chains of W (r scale) on up to n_threads threads, placed as in pl
+// (wsbm_numa.h); sockets, if given, receives the W_f traffic per NUMA node
+inline Shard run_shard(const std::vector<double>& W, int n, uint64_t W_hash, const Settings& s,
+                       const std::vector<uint32_t>& chain_ids, int n_threads,
+                       const Placement& pl = Placement(), std::vector<SocketStats>* sockets = NULL){
+  check_settings(n, s);
+  std::vector<double> W_f(W.size());
+  fisher(W.data(), W_f.data(), W.size());
+  for(int i = 0; i < n; i++){
+    W_f[i + (std::size_t) i*n] = 0.0;
+  }
+
+  n_threads = std::max(1, std::min<int>(n_threads, chain_ids.size()));
+  std::vector< std::vector<int> > nodes = numa_topology();
+  std::vector<int> node_of, cpu_of;
+  assign_threads(nodes, n_threads, pl.affinity, node_of, cpu_of);
+
+  // W_f of each node: a first-touch replica per node in use, or the one copy
+  std::vector< std::unique_ptr<NodeBuffer> > replicas(nodes.size());
+  std::vector<const double*> W_f_node(nodes.size(), W_f.data());
+  if(pl.replicate || pl.hugepages){
+    for(int t = 0; t < n_threads; t++){
+      int node = pl.replicate ? node_of[t] : 0;
+      if(replicas[node]) continue;
+      replicas[node] = first_touch_copy(W_f.data(), W_f.size(), cpu_of[t], pl.hugepages);
+    }
+    for(std::size_t node = 0; node < nodes.size(); node++){
+      std::size_t r = pl.replicate ? node : 0;
+      if(replicas[r]) W_f_node[node] = replicas[r]->data();
+    }
+  }
+
+  Shard sh;
+  sh.W_hash = W_hash;
+  sh.n = n;
+  sh.K_max = s.K_max;
+  sh.iter = s.iter;
+  sh.burn = s.burn;
+  sh.eta0 = s.eta0;
+  sh.seed = s.seed;
+  sh.chains.resize(chain_ids.size());
+
+  std::chrono::steady_clock::time_point t_start = std::chrono::steady_clock::now();
+  std::atomic<std::size_t> next(0);
+  std::exception_ptr error; // first failure of a chain (e.g. bad_alloc), rethrown after the join
+  std::mutex error_m;
+  std::vector<std::thread> pool;
+  for(int t = 0; t < n_threads; t++){
+    pool.emplace_back([&, t]{
+      pin_thread(cpu_of[t]);
+      for(std::size_t c = next++; c < chain_ids.size(); c = next++){
+        try{
+          std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+          Settings sc = s;
+          sc.chain = chain_ids[c];
+          Fit fit = wsbm::fit(W_f_node[node_of[t]], n, sc);
+
+          ShardChain& out = sh.chains[c];
+          out.chain = chain_ids[c];
+          out.node = node_of[t];
+          out.cpu = cpu_of[t];
+          out.n_retained = fit.n_retained;
+          out.ppm.resize((std::size_t) n*(n - 1)/2);
+          for(int j = 1; j < n; j++){
+            for(int i = 0; i < j; i++){
+              out.ppm[(std::size_t) j*(j - 1)/2 + i] = (uint32_t) std::lround(fit.ppm[i + (std::size_t) j*n]*fit.n_retained);
+            }
+          }
+          out.K_hist.assign(s.K_max + 1, 0);
+          for(int K : fit.K_trace){
+            out.K_hist[std::min(K, s.K_max)]++;
+          }
+          out.K_trace.assign(fit.K_trace.begin(), fit.K_trace.end());
+          out.logpost = fit.logpost;
+          out.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        }catch(...){
+          std::lock_guard<std::mutex> lock(error_m);
+          if(!error) error = std::current_exception();
+          next = chain_ids.size(); // no new chains
+        }
+      }
+    });
+  }
+  for(std::thread& th : pool) th.join();
+  if(error) std::rethrow_exception(error);
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+  if(sockets != NULL){
+    sockets->clear();
+    for(std::size_t node = 0; node < nodes.size(); node++){
+      SocketStats st;
+      st.node = node;
+      std::vector<int> cpus;
+      for(int t = 0; t < n_threads; t++){
+        if(node_of[t] == (int) node){
+          st.threads++;
+          cpus.push_back(cpu_of[t]);
+        }
+      }
+      if(st.threads == 0) continue;
+      for(const ShardChain& c : sh.chains){
+        if(c.node == (int) node) st.GB += (double) s.iter*n*n*sizeof(double)/1e9;
+      }
+      st.GBps = st.GB/wall;
+      st.peak_GBps = read_bandwidth(W_f_node[node], W_f.size(), cpus);
+      st.utilization = st.peak_GBps > 0 ? st.GBps/st.peak_GBps : 0.0;
+      sockets->push_back(st);
+    }
+  }
+  return sh;
+}
+
+inline void write_shard(const std::string& file, const Shard& sh){
+  std::FILE* f = std::fopen(file.c_str(), "wb");
+  if(f == NULL) throw std::runtime_error("cannot open " + file + " for writing");
+  uint32_t dims[4] = {sh.n, sh.K_max, sh.iter, sh.burn};
+  uint32_t n_chains = sh.chains.size();
+  std::fwrite("WSBMSHD1", 1, 8, f);
+  std::fwrite(&sh.W_hash, 8, 1, f);
+  std::fwrite(dims, 4, 4, f);
+  std::fwrite(&sh.eta0, 8, 1, f);
+  std::fwrite(&sh.seed, 8, 1, f);
+  std::fwrite(&n_chains, 4, 1, f);
+  for(const ShardChain& c : sh.chains){
+    std::fwrite(&c.chain, 4, 1, f);
+    std::fwrite(&c.n_retained, 4, 1, f);
+    std::fwrite(&c.seconds, 8, 1, f);
+    std::fwrite(c.ppm.data(), 4, c.ppm.size(), f);
+    std::fwrite(c.K_hist.data(), 8, c.K_hist.size(), f);
+    std::fwrite(c.K_trace.data(), 4, c.K_trace.size(), f);
+    std::fwrite(c.logpost.data(), 8, c.logpost.size(), f);
+  }
+  if(std::fclose(f) != 0) throw std::runtime_error("writing " + file + " failed");
+}
+
+inline Shard read_shard(const std::string& file){
+  std::FILE* f = std::fopen(file.c_str(), "rb");
+  if(f == NULL) throw std::runtime_error("cannot open " + file);
+  Shard sh;
+  char magic[8];
+  uint32_t dims[4], n_chains = 0;
+  bool ok = std::fread(magic, 1, 8, f) == 8 && std::string(magic, 8) == "WSBMSHD1"
+    && std::fread(&sh.W_hash, 8, 1, f) == 1 && std::fread(dims, 4, 4, f) == 4
+    && std::fread(&sh.eta0, 8, 1, f) == 1 && std::fread(&sh.seed, 8, 1, f) == 1
+    && std::fread(&n_chains, 4, 1, f) == 1;
+  if(ok){
+    sh.n = dims[0];
+    sh.K_max = dims[1];
+    sh.iter = dims[2];
+    sh.burn = dims[3];
+    sh.chains.resize(n_chains);
+  }
+  for(uint32_t c = 0; ok && c < n_chains; c++){
+    ShardChain& ch = sh.chains[c];
+    ok = std::fread(&ch.chain, 4, 1, f) == 1 && std::fread(&ch.n_retained, 4, 1, f) == 1
+      && std::fread(&ch.seconds, 8, 1, f) == 1 && ch.n_retained <= sh.iter;
+    if(!ok) break;
+    ch.ppm.resize((std::size_t) sh.n*(sh.n - 1)/2);
+    ch.K_hist.resize(sh.K_max + 1);
+    ch.K_trace.resize(ch.n_retained);
+    ch.logpost.resize(ch.n_retained);
+    ok = std::fread(ch.ppm.data(), 4, ch.ppm.size(), f) == ch.ppm.size()
+      && std::fread(ch.K_hist.data(), 8, ch.K_hist.size(), f) == ch.K_hist.size()
+      && std::fread(ch.K_trace.data(), 4, ch.K_trace.size(), f) == ch.K_trace.size()
+      && std::fread(ch.logpost.data(), 8, ch.logpost.size(), f) == ch.logpost.size();
+  }
+  std::fclose(f);
+  if(!ok) throw std::runtime_error(file + " is not a valid WSBM shard");
+  return sh;
+}
+
+// Empty string if b can be merged into a, otherwise the reason
+inline std::string shard_mismatch(const Shard& a, const Shard& b){
+  if(a.W_hash != b.W_hash) return "different W files (hash " + hash_hex(a.W_hash) + " vs " + hash_hex(b.W_hash) + ")";
+  if(a.n != b.n) return "different n";
+  if(a.K_max != b.K_max || a.iter != b.iter || a.burn != b.burn || a.eta0 != b.eta0 || a.seed != b.seed){
+    return "different sampler settings (K_max, eta0, iter, burn or seed)";
+  }
+  for(const ShardChain& cb : b.chains){
+    for(const ShardChain& ca : a.chains){
+      if(ca.chain == cb.chain) return "chain " + std::to_string(cb.chain) + " appears twice";
+    }
+  }
+  return "";
+}
+
+inline Shard merge_shards(const std::vector<Shard>& shards){
+  if(shards.empty()) throw std::runtime_error("no shards to merge");
+  Shard out = shards[0];
+  for(std::size_t s = 1; s < shards.size(); s++){
+    std::string why = shard_mismatch(out, shards[s]);
+    if(!why.empty()) throw std::runtime_error("shard " + std::to_string(s + 1) + " is incompatible: " + why);
+    out.chains.insert(out.chains.end(), shards[s].chains.begin(), shards[s].chains.end());
+  }
+  return out;
+}
+
+// Split R-hat (Gelman-Rubin on the two halves of every chain) of one traced quantity
+inline double split_rhat(const std::vector< std::vector<double> >& chains){
+  std::vector< std::vector<double> > halves;
+  std::size_t L = std::numeric_limits<std::size_t>::max();
+  for(const std::vector<double>& c : chains){
+    L = std::min(L, c.size()/2);
+  }
+  if(chains.empty() || L < 2) return std::numeric_limits<double>::quiet_NaN();
+  for(const std::vector<double>& c : chains){
+    halves.push_back(std::vector<double>(c.begin(), c.begin() + L));
+    halves.push_back(std::vector<double>(c.end() - L, c.end()));
+  }
+  double m = halves.size(), grand = 0.0, B = 0.0, Wv = 0.0;
+  std::vector<double> means;
+  for(const std::vector<double>& h : halves){
+    double mean = 0.0, var = 0.0;
+    for(double v : h) mean += v;
+    mean /= L;
+    for(double v : h) var += (v - mean)*(v - mean);
+    Wv += var/(L - 1);
+    means.push_back(mean);
+    grand += mean;
+  }
+  grand /= m;
+  for(double mean : means) B += (mean - grand)*(mean - grand);
+  B *= L/(m - 1);
+  Wv /= m;
+  if(Wv == 0.0) return B == 0.0 ? 1.0 : std::numeric_limits<double>::infinity();
+  double var_plus = (L - 1.0)/L*Wv + B/L;
+  return std::sqrt(var_plus/Wv);
+}
+
+// Pooled co-clustering probabilities (n x n, column-major, diagonal 1)
+inline std::vector<double> pooled_ppm(const Shard& sh, uint64_t& n_retained){
+  int n = sh.n;
+  std::vector<double> ppm((std::size_t) n*n, 0.0);
+  n_retained = 0;
+  for(const ShardChain& c : sh.chains){
+    n_retained += c.n_retained;
+  }
+  std::vector<uint64_t> counts((std::size_t) n*(n - 1)/2, 0);
+  for(const ShardChain& c : sh.chains){
+    for(std::size_t k = 0; k < counts.size(); k++) counts[k] += c.ppm[k];
+  }
+  double denom = std::max<uint64_t>(1, n_retained);
+  for(int j = 0; j < n; j++){
+    for(int i = 0; i < j; i++){
+      ppm[i + (std::size_t) j*n] = ppm[j + (std::size_t) i*n] = counts[(std::size_t) j*(j - 1)/2 + i]/denom;
+    }
+    ppm[j + (std::size_t) j*n] = 1.0;
+  }
+  return ppm;
+}
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,251 @@
+// Fisher-transformed weight matrix in named POSIX shared memory
+//
+// The first process to attach a name creates the segment, fills W_f = fisher(W)
+// (diagonal 0) and stores its hash; later processes, possibly without W, attach
+// the same physical pages read-only, so the matrix is held once per machine
+// however many R sessions fit it. Attaching checks the layout and (by default)
+// re-hashes W_f; a process that passes W to an existing name checks that the
+// segment holds fisher(W) and refuses it otherwise. A reference count in the header unlinks the segment when the
+// last handle detaches. Only the attaching process counts its handle: a forked
+// child (e.g. parallel::mclapply) inherits the mapping but not the reference.
+// The segment is created with the given mode (default 0660, so users of the
+// creator's group can attach and count their handles; 0644 / 0600 restrict it).
+// A user who may only read it attaches read-only without counting a reference;
+// the mapping stays valid after the last counted handle unlinks the name.
+// A session that dies without releasing leaves its reference behind, so the
+// segment is never unlinked automatically; remove it with unlink()
+// (WSBM_shm_unlink), which is safe while other sessions still have it mapped.
+//
+// Segment layout: one header page (read-write for the reference count)
+//   char[8] magic "WSBMSHM1", uint64 n, uint64 hash (XXH64 of W_f),
+//   uint64 refs, uint64 ready (1 once W_f is written)
+// followed by W_f, n x n doubles column-major (mapped read-only).
+
+#ifndef WSBM_SHM_H
+#define WSBM_SHM_H
+
+#include "wsbm_engine.h"
+#include "wsbm_hash.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace wsbm {
+
+#ifndef _WIN32
+
+class SharedWf {
+public:
+  static const std::size_t HEADER_BYTES = 4096;
+
+  // Attach the segment name ("/wsbm_..."); if it does not exist and W (r scale,
+  // n x n) is given, create it with permissions mode. verify = re-hash W_f on attach.
+  SharedWf(const std::string& name, const double* W, int n, bool verify = true, mode_t mode = 0660)
+    : name_(name), header_(NULL), data_(NULL), n_(0), created_(false), counted_(false), pid_(::getpid()) {
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+    if(fd >= 0){
+      if(W == NULL){
+        ::close(fd);
+        ::shm_unlink(name.c_str());
+        throw std::runtime_error("shared W_f " + name + " does not exist (pass W to create it)");
+      }
+      ::fchmod(fd, mode); // shm_open applies the umask
+      create(fd, W, n);
+    }else if(errno == EEXIST){
+      bool writable = true;
+      fd = ::shm_open(name.c_str(), O_RDWR, 0);
+      if(fd < 0 && errno == EACCES){
+        writable = false;
+        fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+      }
+      if(fd < 0) throw std::runtime_error("cannot open shared W_f " + name + ": " + std::strerror(errno));
+      attach(fd, verify, writable);
+      if(W != NULL && !holds(W, n)){
+        release();
+        throw std::runtime_error("shared W_f " + name + " holds a different matrix (use another name, or WSBM_shm_unlink it)");
+      }
+    }else{
+      throw std::runtime_error("cannot create shared W_f " + name);
+    }
+  }
+
+  ~SharedWf(){ release(); }
+
+  SharedWf(const SharedWf&) = delete;
+  SharedWf& operator=(const SharedWf&) = delete;
+
+  // Detach; the last handle removes the segment
+  void release(){
+    if(header_ == NULL) return;
+    uint64_t left = counted_ && ::getpid() == pid_ ? __atomic_sub_fetch(&header_[3], 1, __ATOMIC_ACQ_REL) : 1;
+    if(data_ != NULL) ::munmap(const_cast<double*>(data_), data_bytes());
+    ::munmap(header_, HEADER_BYTES);
+    header_ = NULL;
+    data_ = NULL;
+    if(left == 0) ::shm_unlink(name_.c_str());
+  }
+
+  bool attached() const { return header_ != NULL; }
+  const double* data() const { return data_; }
+  int n() const { return n_; }
+  const std::string& name() const { return name_; }
+  bool created() const { return created_; }
+  // false for a read-only attach, whose handle is not in the reference count
+  bool counted() const { return counted_; }
+  uint64_t hash() const { return header_ == NULL ? 0 : header_[2]; }
+  uint64_t refs() const { return header_ == NULL ? 0 : __atomic_load_n(&header_[3], __ATOMIC_ACQUIRE); }
+  std::size_t bytes() const { return HEADER_BYTES + data_bytes(); }
+
+  // Integrity check of the mapped matrix against the stored hash
+  bool verify() const {
+    return data_ != NULL && hash64(data_, data_bytes()) == header_[2];
+  }
+
+  // Whether the segment holds fisher(W) with diagonal 0, compared column by column
+  // (O(n) memory) with the values create() would have written
+  bool holds(const double* W, int n) const {
+    if(data_ == NULL || n != n_) return false;
+    std::vector<double> col(n);
+    for(int j = 0; j < n; j++){
+      fisher(W + (std::size_t) j*n, col.data(), n);
+      col[j] = 0.0;
+      if(std::memcmp(col.data(), data_ + (std::size_t) j*n, n*sizeof(double)) != 0) return false;
+    }
+    return true;
+  }
+
+  // Remove a segment regardless of its reference count, e.g. when sessions died
+  // without releasing it; sessions that have it mapped keep their mapping
+  static bool unlink(const std::string& name){
+    return ::shm_unlink(name.c_str()) == 0;
+  }
+
+private:
+  std::string name_;
+  uint64_t* header_;
+  const double* data_;
+  int n_;
+  bool created_, counted_;
+  pid_t pid_;
+
+  std::size_t data_bytes() const { return (std::size_t) n_*n_*sizeof(double); }
+
+  void create(int fd, const double* W, int n){
+    n_ = n;
+    if(::ftruncate(fd, bytes()) != 0){
+      ::close(fd);
+      ::shm_unlink(name_.c_str());
+      throw std::runtime_error("cannot size shared W_f " + name_);
+    }
+    void* h = ::mmap(NULL, HEADER_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    void* d = ::mmap(NULL, data_bytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, HEADER_BYTES);
+    ::close(fd);
+    if(h == MAP_FAILED || d == MAP_FAILED){
+      ::shm_unlink(name_.c_str());
+      throw std::runtime_error("cannot map shared W_f " + name_);
+    }
+    double* W_f = static_cast<double*>(d);
+    fisher(W, W_f, (std::size_t) n*n);
+    for(int i = 0; i < n; i++){
+      W_f[i + (std::size_t) i*n] = 0.0;
+    }
+    ::mprotect(d, data_bytes(), PROT_READ);
+
+    header_ = static_cast<uint64_t*>(h);
+    header_[1] = n;
+    header_[2] = hash64(W_f, data_bytes());
+    header_[3] = 1;
+    std::memcpy(header_, "WSBMSHM1", 8);
+    __atomic_store_n(&header_[4], 1, __ATOMIC_RELEASE);
+    data_ = W_f;
+    created_ = true;
+    counted_ = true;
+  }
+
+  void attach(int fd, bool verify_hash, bool writable){
+    // The creator may not have sized the segment yet: mapping an empty object and
+    // reading the header would raise SIGBUS
+    struct stat st;
+    for(int t = 0; ::fstat(fd, &st) != 0 || (std::size_t) st.st_size < HEADER_BYTES; t++){
+      if(t > 6000){
+        ::close(fd);
+        throw std::runtime_error("shared W_f " + name_ + " was never sized");
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    void* h = ::mmap(NULL, HEADER_BYTES, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if(h == MAP_FAILED){
+      ::close(fd);
+      throw std::runtime_error("cannot map shared W_f " + name_);
+    }
+    header_ = static_cast<uint64_t*>(h);
+    // The creator may still be filling W_f
+    for(int t = 0; __atomic_load_n(&header_[4], __ATOMIC_ACQUIRE) != 1; t++){
+      if(t > 6000){
+        ::munmap(h, HEADER_BYTES);
+        header_ = NULL;
+        ::close(fd);
+        throw std::runtime_error("shared W_f " + name_ + " was never completed");
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    n_ = header_[1];
+    bool ok = std::memcmp(header_, "WSBMSHM1", 8) == 0 && ::fstat(fd, &st) == 0 && (std::size_t) st.st_size == bytes();
+    void* d = ok ? ::mmap(NULL, data_bytes(), PROT_READ, MAP_SHARED, fd, HEADER_BYTES) : MAP_FAILED;
+    ::close(fd);
+    if(d == MAP_FAILED){
+      ::munmap(h, HEADER_BYTES);
+      header_ = NULL;
+      throw std::runtime_error(name_ + " is not a valid shared W_f segment");
+    }
+    data_ = static_cast<const double*>(d);
+    if(writable){
+      __atomic_add_fetch(&header_[3], 1, __ATOMIC_ACQ_REL);
+      counted_ = true;
+    }
+    if(verify_hash && !verify()){
+      release();
+      throw std::runtime_error("shared W_f " + name_ + " failed the integrity check");
+    }
+  }
+};
+
+#else
+
+class SharedWf {
+public:
+  SharedWf(const std::string&, const double*, int, bool = true, int = 0660){
+    throw std::runtime_error("shared W_f needs a POSIX system (shm_open)");
+  }
+  void release(){}
+  bool attached() const { return false; }
+  const double* data() const { return NULL; }
+  int n() const { return 0; }
+  const std::string& name() const { static std::string s; return s; }
+  bool created() const { return false; }
+  bool counted() const { return false; }
+  uint64_t hash() const { return 0; }
+  uint64_t refs() const { return 0; }
+  std::size_t bytes() const { return 0; }
+  bool verify() const { return false; }
+  static bool unlink(const std::string&){ return false; }
+};
+
+#endif
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,232 @@
+// Anytime snapshots of a running chain in a memory-mapped file
+//
+// The sampler publishes the running co-clustering counts, the distribution of the
+// no. of occupied communities and the current labels into one of two buffers of
+// the file and then flips the active index, so the buffer a reader copies is
+// never the one being written. Each buffer also carries a sequence counter (odd
+// while it is written, seqlock style): a reader that raced with two consecutive
+// publishes sees the counter change and retries. Neither side takes a lock, so
+// sampling never waits for readers (another R session, a CLI, ...).
+//
+// File layout (native endianness, 8-byte aligned):
+//   header:  char[8] magic "WSBMSNP1", uint64 n, uint64 K_max,
+//            uint64 generation (no. of publishes), uint64 active (0 / 1)
+//   2 x buffer:
+//            uint64 seq, uint64 iter, uint64 n_retained, uint64 K_hist[K_max + 1],
+//            int32 z[n] (padded to 8 bytes), uint32 ppm[n(n - 1)/2] (packed upper triangle)
+// The snapshot writer is POSIX only (mmap); on Windows it reports an error.
+
+#ifndef WSBM_SNAPSHOT_H
+#define WSBM_SNAPSHOT_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace wsbm {
+
+namespace snapshot_detail {
+
+const std::size_t HEADER_BYTES = 40;
+
+inline std::size_t z_bytes(uint64_t n){
+  return (n*sizeof(int32_t) + 7)/8*8;
+}
+
+inline std::size_t buffer_bytes(uint64_t n, uint64_t K_max){
+  return 8*(3 + K_max + 1) + z_bytes(n) + (n*(n - 1)/2)*sizeof(uint32_t);
+}
+
+inline uint64_t load(const uint64_t* p){
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline void store(uint64_t* p, uint64_t v){
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+} // namespace snapshot_detail
+
+// Consistent copy of one published buffer
+struct Snapshot {
+  uint64_t n = 0, K_max = 0, generation = 0, iter = 0, n_retained = 0;
+  std::vector<uint64_t> K_hist;
+  std::vector<int32_t> z;
+  std::vector<uint32_t> ppm; // packed upper triangle, index j(j - 1)/2 + i for i < j
+};
+
+#ifndef _WIN32
+
+class SnapshotWriter {
+public:
+  SnapshotWriter(const std::string& file, int n, int K_max)
+    : n_(n), K_max_(K_max), map_(NULL), bytes_(0) {
+    using namespace snapshot_detail;
+    bytes_ = HEADER_BYTES + 2*buffer_bytes(n, K_max);
+    int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+      throw std::runtime_error("cannot open " + file + " for writing");
+    }
+    if(::ftruncate(fd, bytes_) != 0){
+      ::close(fd);
+      throw std::runtime_error("cannot resize " + file);
+    }
+    void* map = ::mmap(NULL, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED){
+      throw std::runtime_error("cannot map " + file);
+    }
+    map_ = static_cast<char*>(map);
+    uint64_t* h = header();
+    h[1] = n;
+    h[2] = K_max;
+    std::memcpy(map_, "WSBMSNP1", 8); // magic last: readers ignore the file until it is set
+  }
+
+  ~SnapshotWriter(){
+    if(map_ != NULL){
+      ::msync(map_, bytes_, MS_ASYNC);
+      ::munmap(map_, bytes_);
+    }
+  }
+
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+  // Publish into the inactive buffer; ppm_count(i, j) gives the co-clustering
+  // count of the pair i < j, K_hist the no. of retained draws with k occupied
+  // communities (k = 0, ..., K_max), z the current labels.
+  template <class PPMCount>
+  void publish(uint64_t iter, uint64_t n_retained, PPMCount ppm_count,
+               const std::vector<uint64_t>& K_hist, const int* z){
+    using namespace snapshot_detail;
+    uint64_t* h = header();
+    uint64_t b = 1 - load(&h[4]);
+    uint64_t* buf = buffer(b);
+    uint64_t seq = buf[0];
+
+    store(&buf[0], seq + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    buf[1] = iter;
+    buf[2] = n_retained;
+    for(int k = 0; k <= K_max_; k++){
+      buf[3 + k] = k < (int) K_hist.size() ? K_hist[k] : 0;
+    }
+    int32_t* z_out = reinterpret_cast<int32_t*>(buf + 3 + K_max_ + 1);
+    for(int i = 0; i < n_; i++){
+      z_out[i] = z[i];
+    }
+    uint32_t* ppm = reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(z_out) + z_bytes(n_));
+    for(int j = 1; j < n_; j++){
+      uint32_t* col = ppm + (std::size_t) j*(j - 1)/2;
+      for(int i = 0; i < j; i++){
+        col[i] = ppm_count(i, j);
+      }
+    }
+    store(&buf[0], seq + 2);
+
+    store(&h[4], b);
+    store(&h[3], load(&h[3]) + 1);
+  }
+
+private:
+  int n_, K_max_;
+  char* map_;
+  std::size_t bytes_;
+
+  uint64_t* header(){ return reinterpret_cast<uint64_t*>(map_); }
+  uint64_t* buffer(uint64_t b){
+    return reinterpret_cast<uint64_t*>(map_ + snapshot_detail::HEADER_BYTES + b*snapshot_detail::buffer_bytes(n_, K_max_));
+  }
+};
+
+// Copy the active buffer of a snapshot file; retries while the writer overwrites it
+inline Snapshot read_snapshot(const std::string& file, int max_tries = 1000){
+  using namespace snapshot_detail;
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if(fd < 0){
+    throw std::runtime_error("cannot open " + file);
+  }
+  struct stat st;
+  if(::fstat(fd, &st) != 0 || (std::size_t) st.st_size < HEADER_BYTES){
+    ::close(fd);
+    throw std::runtime_error(file + " is not a WSBM snapshot file");
+  }
+  std::size_t bytes = st.st_size;
+  void* map = ::mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(map == MAP_FAILED){
+    throw std::runtime_error("cannot map " + file);
+  }
+  const char* base = static_cast<const char*>(map);
+  const uint64_t* h = reinterpret_cast<const uint64_t*>(base);
+
+  Snapshot s;
+  bool ok = std::memcmp(base, "WSBMSNP1", 8) == 0;
+  if(ok){
+    s.n = h[1];
+    s.K_max = h[2];
+    ok = bytes == HEADER_BYTES + 2*buffer_bytes(s.n, s.K_max);
+  }
+  if(!ok){
+    ::munmap(map, bytes);
+    throw std::runtime_error(file + " is not a WSBM snapshot file");
+  }
+
+  s.K_hist.resize(s.K_max + 1);
+  s.z.resize(s.n);
+  s.ppm.resize(s.n*(s.n - 1)/2);
+  bool consistent = false;
+  for(int t = 0; t < max_tries && !consistent; t++){
+    s.generation = load(&h[3]);
+    uint64_t b = load(&h[4]);
+    const uint64_t* buf = reinterpret_cast<const uint64_t*>(base + HEADER_BYTES + b*buffer_bytes(s.n, s.K_max));
+    uint64_t seq = load(&buf[0]);
+    if(seq % 2 == 1){
+      continue;
+    }
+    s.iter = buf[1];
+    s.n_retained = buf[2];
+    std::memcpy(s.K_hist.data(), buf + 3, (s.K_max + 1)*sizeof(uint64_t));
+    const char* z_in = reinterpret_cast<const char*>(buf + 3 + s.K_max + 1);
+    std::memcpy(s.z.data(), z_in, s.n*sizeof(int32_t));
+    std::memcpy(s.ppm.data(), z_in + z_bytes(s.n), s.ppm.size()*sizeof(uint32_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    consistent = load(&buf[0]) == seq;
+  }
+  ::munmap(map, bytes);
+  if(!consistent){
+    throw std::runtime_error("no consistent snapshot in " + file + " (writer too fast?)");
+  }
+  return s;
+}
+
+#else
+
+class SnapshotWriter {
+public:
+  SnapshotWriter(const std::string&, int, int){
+    throw std::runtime_error("PPM snapshots need a POSIX system (mmap)");
+  }
+  template <class PPMCount>
+  void publish(uint64_t, uint64_t, PPMCount, const std::vector<uint64_t>&, const int*){}
+};
+
+inline Snapshot read_snapshot(const std::string&, int = 1000){
+  throw std::runtime_error("PPM snapshots need a POSIX system (mmap)");
+}
+
+#endif
+
+} // namespace wsbm
+
+#endif
@@ -0,0 +1,256 @@
+// Chrome Trace Event timeline of a run (chrome://tracing, ui.perfetto.dev)
+//
+// A Timeline collects complete events (name, category, start, duration, process
+// and thread id) from any thread and appends them to a JSON file in the Trace Event
+// array format when it is flushed or destroyed. The array format needs no closing
+// bracket, so several writers -- the R session (trace_span in functions.R), other
+// sourceCpp'd libraries, later runs -- append to one file under an advisory lock
+// and the viewer shows them on one time axis (microseconds since the Unix epoch,
+// as R's Sys.time()).
+//
+// Spans are scoped (Span) or consecutive (Laps: each lap closes the span since the
+// previous one). Stage spans are always recorded; per-iteration spans only for the
+// iterations picked by sampled(it), every round(1 / rate)-th, which bounds the
+// overhead and the file size. A NULL Timeline* turns every span into a pointer
+// test. At most max_events are buffered between flushes; later ones are dropped
+// and counted.
+
+#ifndef WSBM_TIMELINE_H
+#define WSBM_TIMELINE_H
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace wsbm {
+
+class Timeline {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  explicit Timeline(const std::string& file, double rate = 1.0, std::size_t max_events = 1000000)
+    : file_(file), max_events_(max_events), dropped_(0) {
+    stride_ = rate >= 1 ? 1 : rate <= 0 ? UINT64_MAX : (uint64_t) std::llround(1/rate);
+    t0_ = Clock::now();
+    epoch_us_ = (double) std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+  ~Timeline(){
+    try{
+      flush();
+    }catch(...){}
+  }
+  Timeline(const Timeline&) = delete;
+  Timeline& operator=(const Timeline&) = delete;
+
+  // Per-iteration spans are recorded for these iterations only
+  bool sampled(uint64_t it) const { return it % stride_ == 0; }
+  uint64_t dropped() const { return dropped_; }
+
+  // Complete event [t0, t1) on the calling thread; args = JSON members or ""
+  void record(const std::string& name, const char* cat, Clock::time_point t0, Clock::time_point t1,
+              const std::string& args = ""){
+    Event e{name, cat, us(t0), std::chrono::duration<double, std::micro>(t1 - t0).count(), tid(), args, false};
+    push(e);
+  }
+
+  // Name shown for the calling thread
+  void thread_name(const std::string& name){
+    Event e{name, "", 0.0, 0.0, tid(), "", true};
+    push(e);
+  }
+
+  // Append the buffered events to the file
+  void flush(){
+    std::vector<Event> events;
+    {
+      std::lock_guard<std::mutex> lock(m_);
+      events.swap(events_);
+    }
+    if(events.empty()) return;
+    std::string out;
+    long pid = process_id();
+    char num[128];
+    for(const Event& e : events){
+      if(e.meta){
+        std::snprintf(num, sizeof(num), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,", pid, e.tid);
+        out += num;
+        out += "\"args\":{\"name\":\"" + escape(e.name) + "\"}},\n";
+        continue;
+      }
+      out += "{\"name\":\"" + escape(e.name) + "\",\"cat\":\"" + escape(e.cat) + "\",\"ph\":\"X\",";
+      std::snprintf(num, sizeof(num), "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%ld", e.ts, e.dur, pid, e.tid);
+      out += num;
+      if(!e.args.empty()) out += ",\"args\":{" + e.args + "}";
+      out += "},\n";
+    }
+    append(out);
+  }
+
+  // Microseconds since the Unix epoch of a steady-clock time
+  double us(Clock::time_point t) const {
+    return epoch_us_ + std::chrono::duration<double, std::micro>(t - t0_).count();
+  }
+
+  // OS thread id (the same in every library of the process)
+  static long tid(){
+#ifdef __linux__
+    return (long) syscall(SYS_gettid);
+#else
+    return (long) (std::hash<std::thread::id>()(std::this_thread::get_id()) & 0x7fffffff);
+#endif
+  }
+
+  static std::string escape(const std::string& s){
+    std::string out;
+    for(char c : s){
+      if(c == '"' || c == '\\'){
+        out += '\\';
+        out += c;
+      }else if((unsigned char) c < 0x20){
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      }else{
+        out += c;
+      }
+    }
+    return out;
+  }
+
+private:
+  struct Event {
+    std::string name;
+    const char* cat;
+    double ts, dur;
+    long tid;
+    std::string args;
+    bool meta;
+  };
+
+  std::string file_;
+  uint64_t stride_;
+  std::size_t max_events_;
+  uint64_t dropped_;
+  Clock::time_point t0_;
+  double epoch_us_;
+  std::mutex m_;
+  std::vector<Event> events_;
+
+  void push(Event& e){
+    std::lock_guard<std::mutex> lock(m_);
+    if(events_.size() >= max_events_){
+      dropped_++;
+      return;
+    }
+    events_.push_back(std::move(e));
+  }
+
+  static long process_id(){
+#ifndef _WIN32
+    return (long) getpid();
+#else
+    return 0;
+#endif
+  }
+
+  // Append under an exclusive lock; a new file gets the opening bracket
+  void append(const std::string& out) const {
+#ifndef _WIN32
+    int fd = ::open(file_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd < 0) throw std::runtime_error("cannot open trace file " + file_);
+    ::flock(fd, LOCK_EX);
+    struct stat st;
+    std::string data = (::fstat(fd, &st) == 0 && st.st_size == 0) ? "[\n" + out : out;
+    const char* p = data.data();
+    std::size_t left = data.size();
+    while(left > 0){
+      ssize_t w = ::write(fd, p, left);
+      if(w <= 0) break;
+      p += w;
+      left -= w;
+    }
+    ::flock(fd, LOCK_UN);
+    ::close(fd);
+    if(left > 0) throw std::runtime_error("cannot write trace file " + file_);
+#else
+    std::FILE* f = std::fopen(file_.c_str(), "ab");
+    if(f == NULL) throw std::runtime_error("cannot open trace file " + file_);
+    std::fseek(f, 0, SEEK_END);
+    if(std::ftell(f) == 0) std::fputs("[\n", f);
+    std::fwrite(out.data(), 1, out.size(), f);
+    std::fclose(f);
+#endif
+  }
+};
+
+// Scoped span: recorded when it goes out of scope (nothing if tl is NULL or !on)
+class Span {
+public:
+  Span(Timeline* tl, const char* name, const char* cat = "wsbm", bool on = true)
+    : tl_(on ? tl : NULL), name_(name), cat_(cat) {
+    if(tl_) t0_ = Timeline::Clock::now();
+  }
+  ~Span(){
+    if(tl_) tl_->record(name_, cat_, t0_, Timeline::Clock::now(), args_);
+  }
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  // Numeric argument shown with the span
+  Span& arg(const char* key, double v){
+    if(tl_){
+      char buf[64];
+      std::snprintf(buf, sizeof(buf), "%.17g", v);
+      args_ += (args_.empty() ? "\"" : ",\"") + std::string(key) + "\":" + buf;
+    }
+    return *this;
+  }
+
+private:
+  Timeline* tl_;
+  const char* name_;
+  const char* cat_;
+  Timeline::Clock::time_point t0_;
+  std::string args_;
+};
+
+// Consecutive spans of one thread: lap(name) records the span since the last lap
+class Laps {
+public:
+  Laps(Timeline* tl, const char* cat, bool on = true) : tl_(on ? tl : NULL), cat_(cat) {
+    if(tl_) t_ = Timeline::Clock::now();
+  }
+  void lap(const char* name){
+    if(!tl_) return;
+    Timeline::Clock::time_point t = Timeline::Clock::now();
+    tl_->record(name, cat_, t_, t);
+    t_ = t;
+  }
+
+private:
+  Timeline* tl_;
+  const char* cat_;
+  Timeline::Clock::time_point t_;
+};
+
+} // namespace wsbm
+
+#endif
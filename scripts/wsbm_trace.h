@@ -0,0 +1,294 @@
+// Asynchronous, chunk-compressed trace of the retained samples
+//
+// The sampler thread pushes each retained draw (labels z, upper triangles of mu
+// and Var, log posterior) into a bounded single-producer / single-consumer ring
+// buffer; a background thread drains the ring, packs the records into chunks and
+// writes each chunk zlib-compressed. push() only waits when the ring is full; such
+// back-pressure stalls are counted and timed. Needs zlib (link with -lz).
+//
+// File layout (native endianness):
+//   header:  char[8] magic "WSBMTRC1", uint64 n, K, n_records, chunk_records,
+//            index_offset (0 while the trace is being written)
+//   chunks:  uint64 raw_bytes, comp_bytes, first_record, n_records, byte[comp_bytes]
+//   index:   uint64 n_chunks, uint64 offset[n_chunks]
+// A record is uint64 iter, double logpost, int32 z[n] (padded to 8 bytes),
+// double mu[K(K + 1)/2], double Var[K(K + 1)/2] (upper triangles, column-major).
+
+#ifndef WSBM_TRACE_H
+#define WSBM_TRACE_H
+
+#include <zlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace wsbm {
+
+namespace trace_detail {
+
+const std::size_t HEADER_BYTES = 48;
+
+inline std::size_t z_bytes(uint64_t n){
+  return (n*sizeof(int32_t) + 7)/8*8;
+}
+
+inline std::size_t record_bytes(uint64_t n, uint64_t K){
+  return 16 + z_bytes(n) + 2*(K*(K + 1)/2)*sizeof(double);
+}
+
+} // namespace trace_detail
+
+// Bounded lock-free ring of fixed-size records, one producer and one consumer
+class RecordRing {
+public:
+  RecordRing(std::size_t capacity, std::size_t record_bytes)
+    : cap_(capacity), bytes_(record_bytes), data_(capacity*record_bytes), head_(0), tail_(0) {}
+
+  // Producer: slot to fill, or NULL if the ring is full
+  char* slot(){
+    std::size_t h = head_.load(std::memory_order_relaxed);
+    if(h - tail_.load(std::memory_order_acquire) == cap_) return NULL;
+    return &data_[(h % cap_)*bytes_];
+  }
+  void commit(){ head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+  // Consumer: oldest record, or NULL if the ring is empty
+  const char* front(){
+    std::size_t t = tail_.load(std::memory_order_relaxed);
+    if(head_.load(std::memory_order_acquire) == t) return NULL;
+    return &data_[(t % cap_)*bytes_];
+  }
+  void pop(){ tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+private:
+  std::size_t cap_, bytes_;
+  std::vector<char> data_;
+  alignas(64) std::atomic<std::size_t> head_;
+  alignas(64) std::atomic<std::size_t> tail_;
+};
+
+struct TraceStats {
+  uint64_t records = 0, chunks = 0, raw_bytes = 0, comp_bytes = 0;
+  uint64_t stalls = 0;        // pushes that found the ring full
+  double stall_seconds = 0.0; // time the sampler spent waiting for space
+};
+
+class TraceWriter {
+public:
+  TraceWriter(const std::string& file, int n, int K, std::size_t capacity = 1024, int chunk_records = 256)
+    : n_(n), K_(K), chunk_records_(chunk_records), rec_bytes_(trace_detail::record_bytes(n, K)),
+      ring_(capacity, rec_bytes_), done_(false), failed_(false), f_(NULL) {
+    f_ = std::fopen(file.c_str(), "wb");
+    if(f_ == NULL){
+      throw std::runtime_error("cannot open " + file + " for writing");
+    }
+    write_header(0);
+    chunk_.reserve((std::size_t) chunk_records_*rec_bytes_);
+    worker_ = std::thread(&TraceWriter::drain, this);
+  }
+
+  ~TraceWriter(){
+    try{ close(); }catch(...){}
+  }
+
+  TraceWriter(const TraceWriter&) = delete;
+  TraceWriter& operator=(const TraceWriter&) = delete;
+
+  // Called by the sampler; mu and Var are K x K column-major (upper triangle used)
+  void push(uint64_t iter, double logpost, const int* z, const double* mu, const double* Var){
+    if(failed_.load()){
+      throw std::runtime_error("trace writer failed (disk full?)");
+    }
+    char* s = ring_.slot();
+    if(s == NULL){
+      stats_.stalls++;
+      std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+      while((s = ring_.slot()) == NULL){
+        std::this_thread::yield();
+      }
+      stats_.stall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+    std::memcpy(s, &iter, 8);
+    std::memcpy(s + 8, &logpost, 8);
+    int32_t* zs = reinterpret_cast<int32_t*>(s + 16);
+    for(int i = 0; i < n_; i++){
+      zs[i] = z[i];
+    }
+    double* m = reinterpret_cast<double*>(s + 16 + trace_detail::z_bytes(n_));
+    double* v = m + (std::size_t) K_*(K_ + 1)/2;
+    for(int kk = 0; kk < K_; kk++){
+      for(int k = 0; k <= kk; k++){
+        *m++ = mu[k + (std::size_t) kk*K_];
+        *v++ = Var[k + (std::size_t) kk*K_];
+      }
+    }
+    ring_.commit();
+  }
+
+  // Flush the remaining records, write the chunk index and finalize the header
+  void close(){
+    if(f_ == NULL) return;
+    done_.store(true);
+    worker_.join();
+    bool ok = !failed_.load();
+    if(ok){
+      long index_offset = std::ftell(f_);
+      uint64_t n_chunks = offsets_.size();
+      ok = std::fwrite(&n_chunks, 8, 1, f_) == 1
+        && std::fwrite(offsets_.data(), 8, offsets_.size(), f_) == offsets_.size();
+      write_header(index_offset);
+    }
+    ok = std::fclose(f_) == 0 && ok;
+    f_ = NULL;
+    if(!ok){
+      throw std::runtime_error("writing the trace file failed");
+    }
+  }
+
+  const TraceStats& stats() const { return stats_; }
+
+private:
+  int n_, K_, chunk_records_;
+  std::size_t rec_bytes_;
+  RecordRing ring_;
+  std::atomic<bool> done_, failed_;
+  std::FILE* f_;
+  std::thread worker_;
+  std::vector<char> chunk_, comp_;
+  std::vector<uint64_t> offsets_;
+  uint64_t chunk_first_ = 0;
+  TraceStats stats_;
+
+  void write_header(uint64_t index_offset){
+    uint64_t h[5] = {(uint64_t) n_, (uint64_t) K_, stats_.records, (uint64_t) chunk_records_, index_offset};
+    std::fseek(f_, 0, SEEK_SET);
+    std::fwrite("WSBMTRC1", 1, 8, f_);
+    std::fwrite(h, 8, 5, f_);
+    std::fseek(f_, 0, SEEK_END);
+  }
+
+  // Background thread
+  void drain(){
+    while(true){
+      const char* r = ring_.front();
+      if(r == NULL){
+        if(done_.load()){
+          if(ring_.front() != NULL) continue; // records pushed before done was set
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        continue;
+      }
+      chunk_.insert(chunk_.end(), r, r + rec_bytes_);
+      ring_.pop();
+      stats_.records++;
+      if(chunk_.size() == (std::size_t) chunk_records_*rec_bytes_) flush_chunk();
+    }
+    flush_chunk();
+  }
+
+  void flush_chunk(){
+    if(chunk_.empty()) return;
+    if(!failed_.load() && !write_chunk()) failed_.store(true);
+    chunk_.clear();
+  }
+
+  bool write_chunk(){
+    uLongf len = compressBound(chunk_.size());
+    comp_.resize(len);
+    if(compress2(reinterpret_cast<Bytef*>(comp_.data()), &len, reinterpret_cast<const Bytef*>(chunk_.data()),
+                 chunk_.size(), 1) != Z_OK){
+      return false;
+    }
+    uint64_t h[4] = {chunk_.size(), len, chunk_first_, chunk_.size()/rec_bytes_};
+    offsets_.push_back(std::ftell(f_));
+    if(std::fwrite(h, 8, 4, f_) != 4 || std::fwrite(comp_.data(), 1, len, f_) != len){
+      return false;
+    }
+    stats_.chunks++;
+    stats_.raw_bytes += chunk_.size();
+    stats_.comp_bytes += len;
+    chunk_first_ += h[3];
+    return true;
+  }
+};
+
+// Random access to the chunks of a finished trace file
+class TraceReader {
+public:
+  explicit TraceReader(const std::string& file) : f_(std::fopen(file.c_str(), "rb")), file_(file) {
+    if(f_ == NULL){
+      throw std::runtime_error("cannot open " + file);
+    }
+    char magic[8];
+    uint64_t h[5];
+    bool ok = std::fread(magic, 1, 8, f_) == 8 && std::memcmp(magic, "WSBMTRC1", 8) == 0
+      && std::fread(h, 8, 5, f_) == 5 && h[4] > 0;
+    if(ok){
+      n_ = h[0];
+      K_ = h[1];
+      n_records_ = h[2];
+      chunk_records_ = h[3];
+      uint64_t n_chunks = 0;
+      ok = std::fseek(f_, h[4], SEEK_SET) == 0 && std::fread(&n_chunks, 8, 1, f_) == 1;
+      offsets_.resize(n_chunks);
+      ok = ok && std::fread(offsets_.data(), 8, n_chunks, f_) == n_chunks;
+    }
+    if(!ok){
+      std::fclose(f_);
+      throw std::runtime_error(file + " is not a finished WSBM trace file");
+    }
+  }
+
+  ~TraceReader(){ std::fclose(f_); }
+
+  TraceReader(const TraceReader&) = delete;
+  TraceReader& operator=(const TraceReader&) = delete;
+
+  uint64_t n() const { return n_; }
+  uint64_t K() const { return K_; }
+  uint64_t n_records() const { return n_records_; }
+  uint64_t chunk_records() const { return chunk_records_; }
+  std::size_t n_chunks() const { return offsets_.size(); }
+  std::size_t record_bytes() const { return trace_detail::record_bytes(n_, K_); }
+
+  // Decompressed records of chunk c (every chunk but the last holds chunk_records)
+  std::vector<char> chunk(std::size_t c){
+    uint64_t h[4];
+    if(std::fseek(f_, offsets_.at(c), SEEK_SET) != 0 || std::fread(h, 8, 4, f_) != 4){
+      throw std::runtime_error("corrupt chunk in " + file_);
+    }
+    std::vector<char> comp(h[1]), raw(h[0]);
+    uLongf len = h[0];
+    if(std::fread(comp.data(), 1, h[1], f_) != h[1]
+         || uncompress(reinterpret_cast<Bytef*>(raw.data()), &len, reinterpret_cast<const Bytef*>(comp.data()), h[1]) != Z_OK
+         || len != h[0]){
+      throw std::runtime_error("corrupt chunk in " + file_);
+    }
+    return raw;
+  }
+
+  // Fields of a record
+  uint64_t iter(const char* r) const { uint64_t v; std::memcpy(&v, r, 8); return v; }
+  double logpost(const char* r) const { double v; std::memcpy(&v, r + 8, 8); return v; }
+  const int32_t* z(const char* r) const { return reinterpret_cast<const int32_t*>(r + 16); }
+  const double* mu(const char* r) const { return reinterpret_cast<const double*>(r + 16 + trace_detail::z_bytes(n_)); }
+  const double* Var(const char* r) const { return mu(r) + K_*(K_ + 1)/2; }
+
+private:
+  std::FILE* f_;
+  std::string file_;
+  uint64_t n_ = 0, K_ = 0, n_records_ = 0, chunk_records_ = 0;
+  std::vector<uint64_t> offsets_;
+};
+
+} // namespace wsbm
+
+#endif